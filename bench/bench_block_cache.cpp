@@ -0,0 +1,182 @@
+#include "cpu.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+// Every heap allocation made by the process goes through here
+static std::size_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    if(void *ptr = std::malloc(size)) {return ptr;}
+    throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept {std::free(ptr);}
+void operator delete(void *ptr, [[maybe_unused]] std::size_t size) noexcept {std::free(ptr);}
+
+// Layout of Instr and of the block cache before blocks moved into an arena
+struct LegacyInstr
+{
+    Opcode opcode;
+    uint8_t funct3;
+    uint8_t funct7;
+    imm_t imm;
+    int rd_id;
+    int rs1_id;
+    int rs2_id;
+
+    size_t size;
+    void (*exec)(Cpu &cpu, LegacyInstr &instr);
+};
+
+static const std::size_t NBlocks = 1024;
+static const std::size_t BlockLen = 8;
+static const instr_t addi_x5_x5_1 = 0x00128293;
+static const instr_t jal_x0_0 = 0x0000006f;
+
+static void writeBlocks(Cpu &cpu)
+{
+    cpu.commit(0, NBlocks * BlockLen * sizeof(instr_t));
+    for(std::size_t block = 0; block < NBlocks; ++block)
+    {
+        addr_t addr = block * BlockLen * sizeof(instr_t);
+        for(std::size_t i = 0; i + 1 < BlockLen; ++i, addr += sizeof(instr_t))
+        {
+            cpu.store<word_t>(addr, addi_x5_x5_1);
+        }
+        cpu.store<word_t>(addr, jal_x0_0);
+    }
+}
+
+static std::vector<LegacyInstr> legacyLookup(std::unordered_map<addr_t, std::vector<LegacyInstr>> &cache, addr_t addr)
+{
+    return cache.find(addr)->second;
+}
+
+static void legacyInterpret(std::vector<LegacyInstr> instrs)
+{
+    for(auto instr : instrs)
+    {
+        benchmark::DoNotOptimize(instr.exec);
+    }
+}
+
+static void BM_BlockCache_Legacy(benchmark::State &state)
+{
+    std::unordered_map<addr_t, std::vector<LegacyInstr>> cache {};
+    std::size_t cache_bytes = 0;
+    for(std::size_t block = 0; block < NBlocks; ++block)
+    {
+        std::vector<LegacyInstr> instrs(BlockLen);
+        instrs.shrink_to_fit();
+        cache_bytes += sizeof(instrs) + instrs.capacity() * sizeof(LegacyInstr);
+        cache.emplace(block * BlockLen * sizeof(instr_t), std::move(instrs));
+    }
+
+    std::size_t before = allocations;
+    std::size_t blocks = 0;
+    for(auto _ : state)
+    {
+        for(std::size_t block = 0; block < NBlocks; ++block, ++blocks)
+        {
+            auto instrs = legacyLookup(cache, block * BlockLen * sizeof(instr_t));
+            legacyInterpret(instrs);
+        }
+    }
+
+    state.counters["allocs_per_block"] = static_cast<double>(allocations - before) / blocks;
+    state.counters["cache_bytes"] = cache_bytes;
+    state.counters["instr_bytes"] = sizeof(LegacyInstr);
+}
+BENCHMARK(BM_BlockCache_Legacy);
+
+static void BM_BlockCache_Arena(benchmark::State &state)
+{
+    Memory mem {};
+    Cpu cpu(&mem);
+    writeBlocks(cpu);
+    for(std::size_t block = 0; block < NBlocks; ++block)
+    {
+        lookup(cpu, block * BlockLen * sizeof(instr_t));
+    }
+
+    std::size_t before = allocations;
+    std::size_t blocks = 0;
+    for(auto _ : state)
+    {
+        for(std::size_t block = 0; block < NBlocks; ++block, ++blocks)
+        {
+            BlockSpan instrs = lookup(cpu, block * BlockLen * sizeof(instr_t)).instrs;
+            for(const Instr &instr : instrs)
+            {
+                benchmark::DoNotOptimize(instr.exec);
+            }
+        }
+    }
+
+    state.counters["allocs_per_block"] = static_cast<double>(allocations - before) / blocks;
+    state.counters["cache_bytes"] = cpu.bb_arena.footprint();
+    state.counters["table_bytes"] = cpu.bb_table.footprint();
+    state.counters["instr_bytes"] = sizeof(Instr);
+}
+BENCHMARK(BM_BlockCache_Arena);
+
+// Dispatcher probe: pc -> block, hashed map as before vs the page table
+static std::vector<addr_t> dispatchTrace()
+{
+    std::vector<addr_t> trace {};
+    uint32_t seed = 1;
+    for(std::size_t i = 0; i < 4 * NBlocks; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        trace.push_back((seed >> 8) % NBlocks * BlockLen * sizeof(instr_t));
+    }
+    return trace;
+}
+
+static void BM_Dispatch_UnorderedMap(benchmark::State &state)
+{
+    std::unordered_map<addr_t, BlockDescriptor> table {};
+    for(std::size_t block = 0; block < NBlocks; ++block)
+    {
+        table.emplace(block * BlockLen * sizeof(instr_t), BlockDescriptor {});
+    }
+    std::vector<addr_t> trace = dispatchTrace();
+
+    for(auto _ : state)
+    {
+        for(addr_t pc : trace)
+        {
+            auto block = table.find(pc);
+            benchmark::DoNotOptimize(block);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * trace.size());
+}
+BENCHMARK(BM_Dispatch_UnorderedMap);
+
+static void BM_Dispatch_BlockTable(benchmark::State &state)
+{
+    BlockTable table {};
+    for(std::size_t block = 0; block < NBlocks; ++block)
+    {
+        table.insert(block * BlockLen * sizeof(instr_t));
+    }
+    std::vector<addr_t> trace = dispatchTrace();
+
+    for(auto _ : state)
+    {
+        for(addr_t pc : trace)
+        {
+            BlockDescriptor *block = table.find(pc);
+            benchmark::DoNotOptimize(block);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * trace.size());
+}
+BENCHMARK(BM_Dispatch_BlockTable);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,113 @@
+#include "cpu.hpp"
+#include <benchmark/benchmark.h>
+#include <elfio/elfio.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Decoder throughput over the executable segments of guest binaries. Paths
+// are relative to the repository root; more binaries can be given in
+// RV32I_BENCH_ELF, separated by ':'.
+static const char *const default_elfs[] =
+{
+    "rv32i_code_examples/fib/fib_out",
+    "test/data/HelloWorld",
+    "test/data/test7",
+};
+
+static std::vector<instr_t> textWords(const std::string &path)
+{
+    std::vector<instr_t> words {};
+    ELFIO::elfio reader;
+    if(!reader.load(path))
+    {
+        return words;
+    }
+    for(const auto &seg : reader.segments)
+    {
+        if(!(seg->get_flags() & ELFIO::PF_X) || !seg->get_data())
+        {
+            continue;
+        }
+        const std::size_t count = seg->get_file_size() / sizeof(instr_t);
+        const std::size_t at = words.size();
+        words.resize(at + count);
+        std::memcpy(words.data() + at, seg->get_data(), count * sizeof(instr_t));
+    }
+    return words;
+}
+
+static void decodeAll(benchmark::State &state, const std::vector<instr_t> &words)
+{
+    if(words.empty())
+    {
+        state.SkipWithError("no executable segment");
+        return;
+    }
+    for(auto _ : state)
+    {
+        for(instr_t word : words)
+        {
+            Instr instr = decode(word);
+            benchmark::DoNotOptimize(instr);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+    state.SetBytesProcessed(state.iterations() * words.size() * sizeof(instr_t));
+}
+
+static void BM_Decode_Elf(benchmark::State &state, const std::string &path)
+{
+    decodeAll(state, textWords(path));
+}
+
+// Uniformly random words, mostly illegal encodings
+static void BM_Decode_Random(benchmark::State &state)
+{
+    std::mt19937 rng(42);
+    std::vector<instr_t> words(1 << 16);
+    for(instr_t &word : words) {word = rng();}
+    decodeAll(state, words);
+}
+BENCHMARK(BM_Decode_Random);
+
+// The same words decoded a page at a time, as lookup() does
+static void BM_Predecode_Random(benchmark::State &state)
+{
+    std::mt19937 rng(42);
+    std::vector<instr_t> words(1 << 16);
+    for(instr_t &word : words) {word = rng();}
+    std::vector<Instr> out(PredecodeCache::PAGE_WORDS);
+    for(auto _ : state)
+    {
+        for(std::size_t at = 0; at < words.size(); at += out.size())
+        {
+            predecode(words.data() + at, out.size(), out.data());
+            benchmark::DoNotOptimize(out.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * words.size());
+    state.SetBytesProcessed(state.iterations() * words.size() * sizeof(instr_t));
+}
+BENCHMARK(BM_Predecode_Random);
+
+static const bool registered = []
+{
+    std::vector<std::string> paths(std::begin(default_elfs), std::end(default_elfs));
+    if(const char *extra = std::getenv("RV32I_BENCH_ELF"))
+    {
+        std::istringstream list(extra);
+        for(std::string path; std::getline(list, path, ':');)
+        {
+            if(!path.empty()) {paths.push_back(path);}
+        }
+    }
+    for(const std::string &path : paths)
+    {
+        benchmark::RegisterBenchmark(("BM_Decode_Elf/" + path).c_str(), BM_Decode_Elf, path);
+    }
+    return true;
+}();
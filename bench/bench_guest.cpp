@@ -0,0 +1,478 @@
+#include "cpu.hpp"
+#include "guest_asm.hpp"
+#include "io.hpp"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+// Guest throughput: small RV32I kernels run to their ebreak under each tier
+// mode, and tiered after translating ahead of time. Every iteration starts
+// from fresh memory and an empty code cache, so JIT modes pay for their
+// compiles; setup and result checks are not timed.
+// Use --benchmark_format=json or --benchmark_out=FILE to keep the numbers.
+
+typedef GuestAsm A;
+
+static const addr_t DATA = 0x00100000;
+static const addr_t DATA2 = 0x00200000;
+//program, DATA and DATA2
+static const std::size_t GUEST_MEM_SIZE = 0x00400000;
+
+struct Kernel
+{
+    const char *name;
+    std::vector<instr_t> (*build)();
+    void (*setup)(Cpu &cpu);
+    bool (*check)(Cpu &cpu);
+};
+
+static uint32_t xorshift(uint32_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static void noSetup(Cpu &) {}
+
+// Recursive fib(N), calls and stack traffic
+static const int32_t FIB_N = 24;
+
+static std::vector<instr_t> buildFib()
+{
+    A a;
+    A::Label fib = a.label(), base = a.label();
+    a.li(A::a0, FIB_N);
+    a.jal(A::ra, fib);
+    a.ebreak();
+
+    a.bind(fib);
+    a.li(A::t0, 2);
+    a.blt(A::a0, A::t0, base);
+    a.addi(A::sp, A::sp, -12);
+    a.sw(A::ra, A::sp, 8);
+    a.sw(A::a0, A::sp, 4);
+    a.addi(A::a0, A::a0, -1);
+    a.jal(A::ra, fib);
+    a.sw(A::a0, A::sp, 0);
+    a.lw(A::a0, A::sp, 4);
+    a.addi(A::a0, A::a0, -2);
+    a.jal(A::ra, fib);
+    a.lw(A::t1, A::sp, 0);
+    a.add(A::a0, A::a0, A::t1);
+    a.lw(A::ra, A::sp, 8);
+    a.addi(A::sp, A::sp, 12);
+    a.bind(base);
+    a.ret();
+    return a.finish();
+}
+
+static bool checkFib(Cpu &cpu) {return cpu.getReg(A::a0) == 46368;}
+
+// Word copy of 64 KiB, unrolled by four, repeated
+static const int32_t COPY_BYTES = 64 * 1024;
+static const int32_t COPY_ROUNDS = 16;
+
+static std::vector<instr_t> buildMemcpy()
+{
+    A a;
+    A::Label round = a.label(), loop = a.label();
+    a.li(A::s2, COPY_ROUNDS);
+    a.bind(round);
+    a.li(A::a0, DATA2);
+    a.li(A::a1, DATA);
+    a.li(A::a2, COPY_BYTES);
+    a.add(A::a3, A::a1, A::a2);
+    a.bind(loop);
+    a.lw(A::t0, A::a1, 0);
+    a.lw(A::t1, A::a1, 4);
+    a.lw(A::t2, A::a1, 8);
+    a.lw(A::t3, A::a1, 12);
+    a.sw(A::t0, A::a0, 0);
+    a.sw(A::t1, A::a0, 4);
+    a.sw(A::t2, A::a0, 8);
+    a.sw(A::t3, A::a0, 12);
+    a.addi(A::a1, A::a1, 16);
+    a.addi(A::a0, A::a0, 16);
+    a.bltu(A::a1, A::a3, loop);
+    a.addi(A::s2, A::s2, -1);
+    a.bne(A::s2, A::zero, round);
+    a.ebreak();
+    return a.finish();
+}
+
+static void setupMemcpy(Cpu &cpu)
+{
+    uint32_t x = 1;
+    for(int32_t i = 0; i < COPY_BYTES; i += 4) {cpu.store<word_t>(DATA + i, xorshift(x));}
+}
+
+static bool checkMemcpy(Cpu &cpu)
+{
+    return std::equal(cpu.getMemBase() + DATA, cpu.getMemBase() + DATA + COPY_BYTES, cpu.getMemBase() + DATA2);
+}
+
+// Insertion sort of xorshift words generated by the guest
+static const int32_t SORT_N = 1024;
+
+static std::vector<instr_t> buildSort()
+{
+    A a;
+    A::Label gen = a.label(), outer = a.label(), inner = a.label(), place = a.label(), done = a.label();
+    a.li(A::a0, DATA);
+    a.li(A::a1, SORT_N);
+    a.li(A::t0, 1);
+    a.bind(gen);
+    a.slli(A::t1, A::t0, 13);
+    a.xor_(A::t0, A::t0, A::t1);
+    a.srli(A::t1, A::t0, 17);
+    a.xor_(A::t0, A::t0, A::t1);
+    a.slli(A::t1, A::t0, 5);
+    a.xor_(A::t0, A::t0, A::t1);
+    a.sw(A::t0, A::a0, 0);
+    a.addi(A::a0, A::a0, 4);
+    a.addi(A::a1, A::a1, -1);
+    a.bne(A::a1, A::zero, gen);
+
+    a.li(A::s0, DATA);
+    a.li(A::s1, DATA + SORT_N * 4);
+    a.addi(A::s2, A::s0, 4);
+    a.bind(outer);
+    a.bgeu(A::s2, A::s1, done);
+    a.lw(A::t0, A::s2, 0);
+    a.addi(A::t1, A::s2, -4);
+    a.bind(inner);
+    a.bltu(A::t1, A::s0, place);
+    a.lw(A::t2, A::t1, 0);
+    a.bgeu(A::t0, A::t2, place);
+    a.sw(A::t2, A::t1, 4);
+    a.addi(A::t1, A::t1, -4);
+    a.j(inner);
+    a.bind(place);
+    a.sw(A::t0, A::t1, 4);
+    a.addi(A::s2, A::s2, 4);
+    a.j(outer);
+    a.bind(done);
+    a.ebreak();
+    return a.finish();
+}
+
+static bool checkSort(Cpu &cpu)
+{
+    std::vector<uint32_t> expected(SORT_N), actual(SORT_N);
+    uint32_t x = 1;
+    for(int32_t i = 0; i < SORT_N; ++i)
+    {
+        expected[i] = xorshift(x);
+        actual[i] = cpu.load<word_t>(DATA + i * 4);
+    }
+    std::sort(expected.begin(), expected.end());
+    return expected == actual;
+}
+
+// Bitwise CRC32 (reflected, 0xEDB88320) of a 16 KiB buffer
+static const int32_t CRC_BYTES = 16 * 1024;
+
+static std::vector<instr_t> buildCrc32()
+{
+    A a;
+    A::Label byte = a.label(), bit = a.label(), skip = a.label();
+    a.li(A::a0, DATA);
+    a.li(A::a1, DATA + CRC_BYTES);
+    a.li(A::t0, -1);
+    a.li(A::t4, static_cast<int32_t>(0xEDB88320));
+    a.bind(byte);
+    a.lbu(A::t1, A::a0, 0);
+    a.xor_(A::t0, A::t0, A::t1);
+    a.li(A::t2, 8);
+    a.bind(bit);
+    a.andi(A::t3, A::t0, 1);
+    a.srli(A::t0, A::t0, 1);
+    a.beq(A::t3, A::zero, skip);
+    a.xor_(A::t0, A::t0, A::t4);
+    a.bind(skip);
+    a.addi(A::t2, A::t2, -1);
+    a.bne(A::t2, A::zero, bit);
+    a.addi(A::a0, A::a0, 1);
+    a.bltu(A::a0, A::a1, byte);
+    a.xori(A::a0, A::t0, -1);
+    a.ebreak();
+    return a.finish();
+}
+
+static void setupCrc32(Cpu &cpu)
+{
+    uint32_t x = 7;
+    for(int32_t i = 0; i < CRC_BYTES; ++i) {cpu.store<uint8_t>(DATA + i, xorshift(x));}
+}
+
+static bool checkCrc32(Cpu &cpu)
+{
+    uint32_t crc = 0xffffffff;
+    for(int32_t i = 0; i < CRC_BYTES; ++i)
+    {
+        crc ^= cpu.load<uint8_t>(DATA + i);
+        for(int k = 0; k < 8; ++k) {crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);}
+    }
+    return static_cast<uint32_t>(cpu.getReg(A::a0)) == ~crc;
+}
+
+// C = A * B on NxN words; RV32I has no mul, so products go through a
+// shift-and-add subroutine
+static const int32_t MAT_N = 24;
+static const addr_t MAT_A = DATA, MAT_B = DATA + 0x10000, MAT_C = DATA + 0x20000;
+
+static std::vector<instr_t> buildMatmul()
+{
+    A a;
+    A::Label iloop = a.label(), jloop = a.label(), kloop = a.label(), mul = a.label();
+    A::Label mloop = a.label(), mskip = a.label(), mdone = a.label();
+    a.li(A::s3, MAT_N);
+    a.li(A::s11, MAT_N * 4);
+    a.li(A::s8, MAT_A);
+    a.li(A::s9, MAT_C);
+    a.li(A::s4, 0);
+    a.bind(iloop);
+    a.li(A::s2, MAT_B);
+    a.li(A::s5, 0);
+    a.bind(jloop);
+    a.li(A::s7, 0);
+    a.li(A::s6, 0);
+    a.mv(A::s10, A::s2);
+    a.bind(kloop);
+    a.slli(A::t0, A::s6, 2);
+    a.add(A::t0, A::s8, A::t0);
+    a.lw(A::a0, A::t0, 0);
+    a.lw(A::a1, A::s10, 0);
+    a.jal(A::ra, mul);
+    a.add(A::s7, A::s7, A::a0);
+    a.add(A::s10, A::s10, A::s11);
+    a.addi(A::s6, A::s6, 1);
+    a.blt(A::s6, A::s3, kloop);
+    a.sw(A::s7, A::s9, 0);
+    a.addi(A::s9, A::s9, 4);
+    a.addi(A::s2, A::s2, 4);
+    a.addi(A::s5, A::s5, 1);
+    a.blt(A::s5, A::s3, jloop);
+    a.add(A::s8, A::s8, A::s11);
+    a.addi(A::s4, A::s4, 1);
+    a.blt(A::s4, A::s3, iloop);
+    a.ebreak();
+
+    //a0 = a0 * a1
+    a.bind(mul);
+    a.li(A::t5, 0);
+    a.bind(mloop);
+    a.beq(A::a1, A::zero, mdone);
+    a.andi(A::t6, A::a1, 1);
+    a.beq(A::t6, A::zero, mskip);
+    a.add(A::t5, A::t5, A::a0);
+    a.bind(mskip);
+    a.slli(A::a0, A::a0, 1);
+    a.srli(A::a1, A::a1, 1);
+    a.j(mloop);
+    a.bind(mdone);
+    a.mv(A::a0, A::t5);
+    a.ret();
+    return a.finish();
+}
+
+static void setupMatmul(Cpu &cpu)
+{
+    uint32_t x = 3;
+    for(int32_t i = 0; i < MAT_N * MAT_N; ++i)
+    {
+        cpu.store<word_t>(MAT_A + i * 4, xorshift(x) & 0xff);
+        cpu.store<word_t>(MAT_B + i * 4, xorshift(x) & 0xff);
+    }
+}
+
+static bool checkMatmul(Cpu &cpu)
+{
+    for(int32_t i = 0; i < MAT_N; ++i)
+    {
+        for(int32_t j = 0; j < MAT_N; ++j)
+        {
+            uint32_t sum = 0;
+            for(int32_t k = 0; k < MAT_N; ++k)
+            {
+                sum += cpu.load<word_t>(MAT_A + (i * MAT_N + k) * 4) * cpu.load<word_t>(MAT_B + (k * MAT_N + j) * 4);
+            }
+            if(static_cast<uint32_t>(cpu.load<word_t>(MAT_C + (i * MAT_N + j) * 4)) != sum) {return false;}
+        }
+    }
+    return true;
+}
+
+// Naive byte search counting a pattern in 64 KiB of text over "abcd"
+static const int32_t TEXT_BYTES = 64 * 1024;
+static const char PATTERN[] = "abcab";
+static const int32_t PATTERN_LEN = sizeof(PATTERN) - 1;
+
+static std::vector<instr_t> buildSearch()
+{
+    A a;
+    A::Label outer = a.label(), inner = a.label(), next = a.label(), done = a.label();
+    a.li(A::a0, DATA);
+    a.li(A::a5, DATA + TEXT_BYTES - PATTERN_LEN + 1);
+    a.li(A::a2, DATA2);
+    a.li(A::a3, PATTERN_LEN);
+    a.li(A::a4, 0);
+    a.bind(outer);
+    a.bgeu(A::a0, A::a5, done);
+    a.li(A::t0, 0);
+    a.bind(inner);
+    a.add(A::t1, A::a0, A::t0);
+    a.lbu(A::t3, A::t1, 0);
+    a.add(A::t2, A::a2, A::t0);
+    a.lbu(A::t4, A::t2, 0);
+    a.bne(A::t3, A::t4, next);
+    a.addi(A::t0, A::t0, 1);
+    a.blt(A::t0, A::a3, inner);
+    a.addi(A::a4, A::a4, 1);
+    a.bind(next);
+    a.addi(A::a0, A::a0, 1);
+    a.j(outer);
+    a.bind(done);
+    a.mv(A::a0, A::a4);
+    a.ebreak();
+    return a.finish();
+}
+
+static void setupSearch(Cpu &cpu)
+{
+    uint32_t x = 11;
+    for(int32_t i = 0; i < TEXT_BYTES; ++i) {cpu.store<uint8_t>(DATA + i, 'a' + (xorshift(x) & 3));}
+    write_to_mem(cpu, DATA2, PATTERN, PATTERN_LEN);
+}
+
+static bool checkSearch(Cpu &cpu)
+{
+    const std::string text(reinterpret_cast<const char *>(cpu.getMemBase() + DATA), TEXT_BYTES);
+    reg_t count = 0;
+    for(std::size_t at = text.find(PATTERN); at != std::string::npos; at = text.find(PATTERN, at + 1)) {++count;}
+    return cpu.getReg(A::a0) == count;
+}
+
+// read/write syscalls of 64 bytes, stdin from /dev/zero and stdout to /dev/null
+static const int32_t ECHO_ROUNDS = 4096;
+
+static std::vector<instr_t> buildEcho()
+{
+    A a;
+    A::Label loop = a.label();
+    a.li(A::s0, ECHO_ROUNDS);
+    a.li(A::s1, DATA);
+    a.bind(loop);
+    a.li(A::a0, 0);
+    a.mv(A::a1, A::s1);
+    a.li(A::a2, 64);
+    a.li(A::a7, 63);
+    a.ecall();
+    a.mv(A::a2, A::a0);
+    a.li(A::a0, 1);
+    a.mv(A::a1, A::s1);
+    a.li(A::a7, 64);
+    a.ecall();
+    a.addi(A::s0, A::s0, -1);
+    a.bne(A::s0, A::zero, loop);
+    a.ebreak();
+    return a.finish();
+}
+
+static void setupEcho(Cpu &cpu)
+{
+    static const int in = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+    static const int out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    cpu.sys.stdio = {in, out, out};
+}
+
+static bool checkEcho(Cpu &cpu) {return cpu.getReg(A::a0) == 64;}
+
+static const Kernel kernels[] =
+{
+    {"fib", buildFib, noSetup, checkFib},
+    {"memcpy", buildMemcpy, setupMemcpy, checkMemcpy},
+    {"sort", buildSort, noSetup, checkSort},
+    {"crc32", buildCrc32, setupCrc32, checkCrc32},
+    {"matmul", buildMatmul, setupMatmul, checkMatmul},
+    {"search", buildSearch, setupSearch, checkSearch},
+    {"echo", buildEcho, setupEcho, checkEcho},
+};
+
+static void BM_Guest(benchmark::State &state, const Kernel *kernel, TierMode mode, bool aot)
+{
+    const std::vector<instr_t> program = kernel->build();
+    std::unique_ptr<Memory> mem;
+    std::unique_ptr<CodeCache> cache;
+    std::unique_ptr<Cpu> cpu;
+    uint64_t instrs = 0;
+    uint64_t compile_ns = 0;
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        cpu.reset();
+        cache.reset();
+        mem = std::make_unique<Memory>();
+        mem->commit(0, GUEST_MEM_SIZE);
+        cache = std::make_unique<CodeCache>();
+        cpu = std::make_unique<Cpu>(mem.get());
+        cpu->code_cache = cache.get();
+        cpu->tier_policy.mode = mode;
+        write_to_mem(*cpu, 0, reinterpret_cast<const char *>(program.data()), program.size() * sizeof(instr_t));
+        cpu->image.text = {{0, static_cast<addr_t>(program.size() * sizeof(instr_t))}};
+        cpu->image.entries = {0};
+        kernel->setup(*cpu);
+        state.ResumeTiming();
+
+        if(aot)
+        {
+            translateAhead(*cpu, std::thread::hardware_concurrency());
+        }
+        const int status = run_simulation(*cpu);
+
+        state.PauseTiming();
+        if(status || !kernel->check(*cpu))
+        {
+            state.SkipWithError("wrong guest result");
+            break;
+        }
+        instrs += cpu->getState().instret;
+        compile_ns += cpu->stats.compile_ns;
+        state.ResumeTiming();
+    }
+
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    state.counters["MIPS"] = benchmark::Counter(instrs / 1e6, benchmark::Counter::kIsRate);
+    state.counters["ns_per_instr"] = benchmark::Counter(instrs / 1e9, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    state.counters["guest_instrs"] = benchmark::Counter(instrs, benchmark::Counter::kAvgIterations);
+    state.counters["compile_ms"] = benchmark::Counter(compile_ns / 1e6, benchmark::Counter::kAvgIterations);
+    state.counters["peak_rss_mb"] = usage.ru_maxrss / 1024.0;
+}
+
+static const bool registered = []
+{
+    const struct {TierMode mode; bool aot; const char *name;} modes[] =
+    {
+        {TierMode::InterpOnly, false, "interp"},
+        {TierMode::JitOnly, false, "jit"},
+        {TierMode::Tiered, false, "tiered"},
+        {TierMode::Tiered, true, "aot"},
+    };
+    for(const Kernel &kernel : kernels)
+    {
+        for(auto [mode, aot, mode_name] : modes)
+        {
+            const std::string name = std::string("BM_Guest/") + kernel.name + "/" + mode_name;
+            benchmark::RegisterBenchmark(name.c_str(), BM_Guest, &kernel, mode, aot)->Unit(benchmark::kMillisecond);
+        }
+    }
+    return true;
+}();
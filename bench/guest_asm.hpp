@@ -0,0 +1,121 @@
+#ifndef RV32I_BENCH_GUEST_ASM_HPP
+#define RV32I_BENCH_GUEST_ASM_HPP
+
+#include "rv32i.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Just enough of an RV32I assembler to write the benchmark kernels without a
+// cross toolchain. Branches and jumps take labels, resolved by finish().
+class GuestAsm
+{
+public:
+    typedef std::size_t Label;
+
+    enum Reg : int
+    {
+        zero = 0, ra = 1, sp = 2, t0 = 5, t1 = 6, t2 = 7, s0 = 8, s1 = 9,
+        a0 = 10, a1 = 11, a2 = 12, a3 = 13, a4 = 14, a5 = 15, a6 = 16, a7 = 17,
+        s2 = 18, s3 = 19, s4 = 20, s5 = 21, s6 = 22, s7 = 23, s8 = 24, s9 = 25, s10 = 26, s11 = 27,
+        t3 = 28, t4 = 29, t5 = 30, t6 = 31,
+    };
+
+    Label label() {labels.push_back(-1); return labels.size() - 1;}
+    void bind(Label label) {labels[label] = code.size();}
+
+    void add(int rd, int rs1, int rs2)  {rtype(0b000, 0, rd, rs1, rs2);}
+    void sub(int rd, int rs1, int rs2)  {rtype(0b000, 0b0100000, rd, rs1, rs2);}
+    void xor_(int rd, int rs1, int rs2) {rtype(0b100, 0, rd, rs1, rs2);}
+    void addi(int rd, int rs1, int32_t imm)  {itype(OP_IMM, 0b000, rd, rs1, imm);}
+    void andi(int rd, int rs1, int32_t imm)  {itype(OP_IMM, 0b111, rd, rs1, imm);}
+    void xori(int rd, int rs1, int32_t imm)  {itype(OP_IMM, 0b100, rd, rs1, imm);}
+    void slli(int rd, int rs1, int shamt)    {itype(OP_IMM, 0b001, rd, rs1, shamt);}
+    void srli(int rd, int rs1, int shamt)    {itype(OP_IMM, 0b101, rd, rs1, shamt);}
+    void lw(int rd, int rs1, int32_t imm)    {itype(OP_LOAD, 0b010, rd, rs1, imm);}
+    void lbu(int rd, int rs1, int32_t imm)   {itype(OP_LOAD, 0b100, rd, rs1, imm);}
+    void sw(int rs2, int rs1, int32_t imm)   {stype(0b010, rs1, rs2, imm);}
+    void jalr(int rd, int rs1, int32_t imm)  {itype(OP_JALR, 0b000, rd, rs1, imm);}
+    void ecall()  {code.push_back(0x00000073);}
+    void ebreak() {code.push_back(0x00100073);}
+
+    void beq(int rs1, int rs2, Label target)  {branch(0b000, rs1, rs2, target);}
+    void bne(int rs1, int rs2, Label target)  {branch(0b001, rs1, rs2, target);}
+    void blt(int rs1, int rs2, Label target)  {branch(0b100, rs1, rs2, target);}
+    void bltu(int rs1, int rs2, Label target) {branch(0b110, rs1, rs2, target);}
+    void bgeu(int rs1, int rs2, Label target) {branch(0b111, rs1, rs2, target);}
+    void jal(int rd, Label target)
+    {
+        fixups.emplace_back(code.size(), target);
+        code.push_back((rd << 7) | OP_JAL);
+    }
+
+    void mv(int rd, int rs) {addi(rd, rs, 0);}
+    void j(Label target) {jal(zero, target);}
+    void ret() {jalr(zero, ra, 0);}
+    void li(int rd, int32_t value)
+    {
+        const int32_t lo = (value << 20) >> 20;
+        const uint32_t hi = static_cast<uint32_t>(value - lo) >> 12;
+        if(hi)
+        {
+            code.push_back((hi << 12) | (rd << 7) | OP_LUI);
+            addi(rd, rd, lo);
+        }
+        else
+        {
+            addi(rd, zero, lo);
+        }
+    }
+
+    // Program loaded at address 0
+    std::vector<instr_t> finish()
+    {
+        for(auto [at, target] : fixups)
+        {
+            const int32_t offset = (static_cast<int32_t>(labels[target]) - static_cast<int32_t>(at)) * 4;
+            const uint32_t imm = offset;
+            if((code[at] & 0x7f) == OP_JAL)
+            {
+                code[at] |= (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+                            (((imm >> 12) & 0xff) << 12);
+            }
+            else
+            {
+                code[at] |= (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (((imm >> 1) & 0xf) << 8) |
+                            (((imm >> 11) & 1) << 7);
+            }
+        }
+        return code;
+    }
+
+private:
+    static const uint32_t OP_IMM = 0b0010011, OP_REG = 0b0110011, OP_LOAD = 0b0000011, OP_STORE = 0b0100011;
+    static const uint32_t OP_BRANCH = 0b1100011, OP_JAL = 0b1101111, OP_JALR = 0b1100111, OP_LUI = 0b0110111;
+
+    void rtype(uint32_t funct3, uint32_t funct7, int rd, int rs1, int rs2)
+    {
+        code.push_back((funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | OP_REG);
+    }
+    void itype(uint32_t opcode, uint32_t funct3, int rd, int rs1, int32_t imm)
+    {
+        code.push_back((static_cast<uint32_t>(imm) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode);
+    }
+    void stype(uint32_t funct3, int rs1, int rs2, int32_t imm)
+    {
+        const uint32_t uimm = imm;
+        code.push_back((((uimm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((uimm & 0x1f) << 7) | OP_STORE);
+    }
+    void branch(uint32_t funct3, int rs1, int rs2, Label target)
+    {
+        fixups.emplace_back(code.size(), target);
+        code.push_back((rs2 << 20) | (rs1 << 15) | (funct3 << 12) | OP_BRANCH);
+    }
+
+    std::vector<instr_t> code {};
+    std::vector<std::ptrdiff_t> labels {};
+    std::vector<std::pair<std::size_t, Label>> fixups {};
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef RV32I_BATCH_HPP
+#define RV32I_BATCH_HPP
+
+#include "cpu.hpp"
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// One guest run of a batch. argv[0] defaults to the ELF path, empty stdio
+// paths leave the host's descriptors in place.
+struct BatchJob
+{
+    std::string elf;
+    std::vector<std::string> argv;
+    std::string stdin_path;
+    std::string stdout_path;
+};
+
+struct JobResult
+{
+    enum class Status {Ok, LoadError, RunError};
+
+    Status status {Status::RunError};
+    reg_t exit_code {0};
+    CpuState state {};
+    uint64_t instret {0};
+    double wall_ms {0};
+    JitStats stats {};
+};
+
+// Runs one job on a fresh Cpu and Memory
+JobResult run_job(const BatchJob &job, const TierPolicy &policy);
+
+// Runs jobs on nthreads host threads with work stealing, results are in job order
+std::vector<JobResult> run_batch(const std::vector<BatchJob> &jobs, unsigned nthreads, const TierPolicy &policy);
+
+// Batch file: one job per line, "elf [args...] [< stdin] [> stdout]",
+// empty lines and lines starting with # are skipped
+bool parse_batch_file(const char *filename, std::vector<BatchJob> &jobs);
+
+void write_report(std::ostream &os, const std::vector<BatchJob> &jobs, const std::vector<JobResult> &results);
+
+#endif
@@ -1,193 +1,749 @@
 #ifndef CPU_RV_HPP
 #define CPU_RV_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cstddef>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 #include <vector>
+#include <sys/mman.h>
 
 #include "asmjit/core/compiler.h"
 #include "asmjit/core/jitruntime.h"
 #include "asmjit/x86/x86compiler.h"
 #include "trace.hpp"
 
-enum class RegType {ZERO_REG = 0, STACK_REG = 1, DEFAULT_REG = 2};
+//host monotonic clock in ns, read by the time CSR
+uint64_t csrTime() noexcept;
 
-struct IRegister
+// Atomic member of a copyable snapshot, copies take its value with a relaxed
+// load. Lock-free, so a signal handler may store to it.
+template<typename T>
+struct CopyableAtomic : std::atomic<T>
 {
-    virtual ~IRegister() = default;
-    virtual int getId() const noexcept = 0;
-    virtual reg_t getVal() const noexcept = 0;
-    virtual void setVal(int val) = 0;
+    static_assert(std::atomic<T>::is_always_lock_free && sizeof(std::atomic<T>) == sizeof(T),
+                  "translated code accesses it as a plain T");
+    using std::atomic<T>::atomic;
+    CopyableAtomic() noexcept = default;
+    CopyableAtomic(const CopyableAtomic &other) noexcept : std::atomic<T>(other.load(std::memory_order_relaxed)) {}
+    CopyableAtomic &operator=(const CopyableAtomic &other) noexcept
+    {
+        this->store(other.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+};
+
+// Architectural state of a hart kept in one flat block so that interpreter
+// and translated code address any register as base + constant offset.
+struct alignas(64) CpuState
+{
+    static const int NRegs = 32;
+
+    reg_t regs[NRegs];
+    reg_t pc;
+    //retired instructions, updated a whole block at a time
+    uint64_t instret;
+    //the dispatcher and translated loops hand over to the profiler once
+    //instret reaches it. The timer signal handler stores to it, translated
+    //code reads it as a plain qword.
+    CopyableAtomic<uint64_t> sample_at {UINT64_MAX};
+    //shadow call stack for the profiler, return addresses outermost first.
+    //Calls nested deeper than CallDepth are counted but not recorded.
+    static constexpr uint32_t CallDepth = 64;
+    uint32_t call_depth {0};
+    addr_t calls[CallDepth] {};
+    //source of the time CSR. Translated code calls it through the state so
+    //it holds no host address and can be saved to the code cache.
+    uint64_t (*clock)() noexcept {csrTime};
+};
+
+// Return address stack hints of the ISA, followed by both engines: a JAL or
+// JALR writing a link register (x1 or x5) is a call, a JALR reading one it
+// does not write is a return
+constexpr bool isLinkReg(int reg) noexcept {return reg == 1 || reg == 5;}
+
+inline void pushCall(CpuState &state, addr_t ret) noexcept
+{
+    if(state.call_depth < CpuState::CallDepth)
+    {
+        state.calls[state.call_depth] = ret;
+    }
+    ++state.call_depth;
+}
+
+inline void popCall(CpuState &state) noexcept
+{
+    state.call_depth -= state.call_depth != 0;
+}
+
+// Exit slot of a translated block with a statically known successor.
+// Translated code returns the slot it left through; once the successor is
+// translated the slot is patched so the dispatcher can enter it directly.
+// Slots belong to the Cpu, translated code gets its block's slot table as an
+// argument and only refers to them by index.
+struct BlockLink;
+struct BlockDescriptor;
+typedef BlockLink *(*block_func_t)(CpuState *state, mem_t *mem, BlockLink *links);
+
+struct BlockLink
+{
+    addr_t target;
+    BlockDescriptor *next;
+};
+
+enum class JitTier : uint8_t {None = 0, Baseline = 1, Optimized = 2};
+
+enum class TierMode {Tiered, InterpOnly, JitOnly};
+
+// When blocks move up the tiers. Thresholds count executions of the block,
+// interpreted or native, before it is compiled at that tier.
+struct TierPolicy
+{
+    TierMode mode {TierMode::Tiered};
+    uint32_t jit_threshold {16};
+    uint32_t opt_threshold {1024};
+    //compiler worker threads, 0 compiles on the dispatching thread
+    unsigned compile_threads {0};
+};
+
+// Counters of the decoder, the dispatcher and the JIT, kept per Cpu. Units
+// installed from the code cache count as adopted, not compiled. Lookups are
+// block table searches by the dispatcher, chained exits the transfers
+// between native blocks that needed none. Blocks translated ahead of time
+// count as compiled or adopted as well, aot_ns is the wall time it took.
+struct JitStats
+{
+    uint64_t blocks_decoded {0};
+    uint64_t blocks_compiled {0};
+    uint64_t blocks_adopted {0};
+    uint64_t compile_ns {0};
+    uint64_t max_compile_ns {0};
+    uint64_t code_bytes {0};
+    uint64_t lookups {0};
+    uint64_t lookup_hits {0};
+    uint64_t chained_exits {0};
+    uint64_t interp_instrs {0};
+    uint64_t native_instrs {0};
+    uint64_t aot_blocks {0};
+    uint64_t aot_ns {0};
+};
+
+// Guest process state kept by the syscall layer. The heap grows up from the
+// end of the loaded image, anonymous mappings are handed out downwards from
+// mmap_top, which starts at MMAP_TOP or below the stack for an image ending
+// above MMAP_TOP. The heap stays below the lowest mapping.
+struct SyscallState
+{
+    static const addr_t MMAP_TOP = 0x70000000;
+
+    addr_t brk_start {0};
+    addr_t brk {0};
+    addr_t mmap_top {MMAP_TOP};
+    reg_t exit_code {0};
+    //host descriptors behind guest stdin, stdout and stderr
+    std::array<int, 3> stdio {0, 1, 2};
+    //host descriptors of the files the guest opened, guest fd 3 is the first,
+    //-1 in the slots it closed. The guest reaches no other host descriptor.
+    std::vector<int> files {};
+
+    //the lowest free guest fd, now standing for host_fd
+    int addFile(int host_fd);
+    //-1 if the guest has no such descriptor
+    int hostFd(int guest_fd) const noexcept;
+    //closes the files the guest left open
+    void closeFiles() noexcept;
+};
+
+struct TranslationAttr
+{
+    asmjit::x86::Compiler &cc;
+    asmjit::x86::Gp &dst1;
+    asmjit::x86::Gp &dst2;
+    asmjit::x86::Gp &ret;
+    asmjit::x86::Gp &mem;
+    asmjit::x86::Gp &addr;
+
+    asmjit::InvokeNode **invokeNode;
+    asmjit::Label *L_BRANCH;
 };
 
-class Register : IRegister
+// Flat 32-bit guest address space. The whole range is reserved up front
+// inaccessible with MAP_NORESERVE, so reserving it charges no memory. The
+// loader, the stack and the syscall layer commit what the guest maps, and
+// the kernel backs those pages on first touch. Any guest address is
+// base + addr with no range check, an access outside the committed ranges
+// faults and run_simulation reports it as a guest access fault. The guard
+// page past the end catches accesses straddling the top of the space.
+class Memory
 {
-    struct RegisterDefault : IRegister
+public:
+    static const std::size_t GUEST_PAGE_SIZE = std::size_t(1) << 12;
+
+private:
+    static const std::size_t SPACE_SIZE = std::size_t(1) << 32;
+    static const std::size_t GUARD_SIZE = std::size_t(1) << 12;
+    //pages tracked by one lazily allocated region of the committed map
+    static const std::size_t REGION_PAGES = 1024;
+    typedef std::bitset<REGION_PAGES> Region;
+    static const std::size_t NREGIONS = SPACE_SIZE / GUEST_PAGE_SIZE / REGION_PAGES;
+
+    mem_t *data;
+    //one bit per page, set while the page is committed. Regions the guest
+    //never mapped into stay unallocated.
+    std::unique_ptr<std::unique_ptr<Region>[]> committed {new std::unique_ptr<Region>[NREGIONS]};
+
+    static std::size_t pageUp(std::size_t addr) noexcept {return (addr + GUEST_PAGE_SIZE - 1) & ~(GUEST_PAGE_SIZE - 1);}
+    static bool aligned(std::size_t addr) noexcept {return !(addr & (GUEST_PAGE_SIZE - 1));}
+
+    // Allocates the regions covering the pages of [addr, addr + len) so that
+    // marking them after the mapping has changed cannot fail
+    bool track(addr_t addr, std::size_t len) noexcept
     {
-    // private:
-        int id_;
-        reg_t val_;
-    // public:
-        RegisterDefault(int id, reg_t val = 0) : id_(id), val_(val) {}
-        virtual std::unique_ptr<RegisterDefault> copy_() const
+        const std::size_t end = pageUp(std::size_t(addr) + len) / GUEST_PAGE_SIZE;
+        for(std::size_t page = addr / GUEST_PAGE_SIZE; page < end; page += REGION_PAGES - page % REGION_PAGES)
         {
-            return std::make_unique<RegisterDefault>(*this);
+            std::unique_ptr<Region> &region = committed[page / REGION_PAGES];
+            if(!region && !(region = std::unique_ptr<Region>(new (std::nothrow) Region {})))
+            {
+                return false;
+            }
         }
-        int getId() const noexcept override {return id_;}
-        virtual ~RegisterDefault() = default;
-        virtual void setVal(int val) override {val_ = val;}
-        reg_t getVal() const noexcept override {return val_;}
-    };
+        return true;
+    }
 
-    struct Register_X0 final : RegisterDefault
+    void mark(addr_t addr, std::size_t len, bool value) noexcept
     {
-        Register_X0() : RegisterDefault {0, 0} {}
-        void setVal([[maybe_unused]] int val) override {};
-        std::unique_ptr<RegisterDefault> copy_() const override
+        const std::size_t end = pageUp(std::size_t(addr) + len) / GUEST_PAGE_SIZE;
+        for(std::size_t page = addr / GUEST_PAGE_SIZE; page < end; ++page)
         {
-            return std::make_unique<Register_X0>(*this);
+            if(Region *region = committed[page / REGION_PAGES].get())
+            {
+                region->set(page % REGION_PAGES, value);
+            }
         }
-    };
+    }
+
+public:
+    Memory()
+    {
+        void *space = mmap(nullptr, SPACE_SIZE + GUARD_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(space == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(), "Failed to reserve guest memory");
+        }
+        data = static_cast<mem_t *>(space);
+    }
+    ~Memory() {munmap(data, SPACE_SIZE + GUARD_SIZE);}
+    Memory(const Memory &) = delete;
+    Memory &operator=(const Memory &) = delete;
+
+    // Makes the pages holding [addr, addr + len) readable and writable. They
+    // keep their contents and are backed once touched.
+    bool commit(addr_t addr, std::size_t len) noexcept
+    {
+        const std::size_t start = addr & ~(GUEST_PAGE_SIZE - 1);
+        const std::size_t end = pageUp(std::size_t(addr) + len);
+        if(end > SPACE_SIZE || !track(addr, len) || mprotect(data + start, end - start, PROT_READ | PROT_WRITE))
+        {
+            return false;
+        }
+        mark(addr, len, true);
+        return true;
+    }
+
+    // Gives whole pages back and makes them inaccessible again. Like munmap,
+    // addr must be page aligned and len is rounded up to whole pages.
+    bool release(addr_t addr, std::size_t len) noexcept
+    {
+        len = pageUp(len);
+        if(!aligned(addr) || std::size_t(addr) + len > SPACE_SIZE ||
+           mmap(data + addr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            return false;
+        }
+        mark(addr, len, false);
+        return true;
+    }
+
+    // Whether every byte of [addr, addr + len) lies in a committed page, for
+    // the host to access guest memory without faulting
+    bool mapped(addr_t addr, std::size_t len) const noexcept
+    {
+        const std::size_t end = pageUp(std::size_t(addr) + len) / GUEST_PAGE_SIZE;
+        if(end > SPACE_SIZE / GUEST_PAGE_SIZE)
+        {
+            return false;
+        }
+        for(std::size_t page = addr / GUEST_PAGE_SIZE; page < end; ++page)
+        {
+            const Region *region = committed[page / REGION_PAGES].get();
+            if(!region || !region->test(page % REGION_PAGES)) {return false;}
+        }
+        return true;
+    }
+
+    template<typename Value_t>
+    reg_t load(addr_t addr) const
+    {
+        return static_cast<reg_t>(*(reinterpret_cast<const Value_t *>(data + addr)));
+    }
+
+    template<typename Store_t>
+    void store(addr_t addr, reg_t val)
+    {
+        *(reinterpret_cast<Store_t *>((data + addr))) = val;
+    }
+
+    // Maps len bytes of fd from offset copy-on-write at guest addr. addr and
+    // offset must be page aligned.
+    bool mapFile(addr_t addr, int fd, off_t offset, std::size_t len) noexcept
+    {
+        if(!aligned(addr) || !aligned(offset) || std::size_t(addr) + len > SPACE_SIZE || !track(addr, len) ||
+           mmap(data + addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+        {
+            return false;
+        }
+        mark(addr, len, true);
+        return true;
+    }
+
+    // Replaces whole pages with fresh zero pages and gives their memory back.
+    // addr must be page aligned, len is rounded up to whole pages.
+    bool discard(addr_t addr, std::size_t len) noexcept
+    {
+        len = pageUp(len);
+        if(!aligned(addr) || std::size_t(addr) + len > SPACE_SIZE || !track(addr, len) ||
+           mmap(data + addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            return false;
+        }
+        mark(addr, len, true);
+        return true;
+    }
+
+    // Guest address of a host address inside the reservation, for fault
+    // reports. The guard page stands for the wrapped start of the space.
+    bool guestAddress(const void *host, addr_t &addr) const noexcept
+    {
+        const std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(host) - reinterpret_cast<std::uintptr_t>(data);
+        if(offset >= SPACE_SIZE + GUARD_SIZE)
+        {
+            return false;
+        }
+        addr = static_cast<addr_t>(offset);
+        return true;
+    }
+
+    mem_t *base() noexcept {return data;}
+    std::size_t size() const noexcept {return SPACE_SIZE;}
+};
+
+class Cpu;
+class Profiler;
+
+// Predecoded instruction. Register ids and funct7 share one halfword so the
+// whole record fits into 16 bytes and four of them into a cache line.
+struct Instr
+{
+    typedef void (*exec_t)(Cpu &cpu, const Instr *instr);
+
+    exec_t exec;
+    imm_t imm;
+    Opcode opcode;
+    uint8_t funct3;
+    uint16_t rd_id  : 5;
+    uint16_t rs1_id : 5;
+    uint16_t rs2_id : 5;
+    uint16_t funct7 : 1;
+};
+static_assert(sizeof(Instr) <= 16, "Instr must stay compact");
+
+// View of a predecoded basic block stored in an InstrArena
+struct BlockSpan
+{
+    Instr *instrs;
+    std::size_t count;
+
+    Instr *begin() const noexcept {return instrs;}
+    Instr *end() const noexcept {return instrs + count;}
+    std::size_t size() const noexcept {return count;}
+    Instr &front() const noexcept {return instrs[0];}
+    Instr &back() const noexcept {return instrs[count - 1];}
+};
+
+// Bump allocator for predecoded blocks. Blocks are never freed one by one,
+// so spans handed out stay valid for the lifetime of the arena.
+class InstrArena
+{
+private:
+    static constexpr std::size_t CHUNK_INSTRS = 4096;
+    std::vector<std::unique_ptr<Instr[]>> chunks {};
+    std::size_t used {CHUNK_INSTRS};
+    std::size_t chunk_size {CHUNK_INSTRS};
 
-    struct Register_X2 final : RegisterDefault
+public:
+    BlockSpan allocate(const Instr *instrs, std::size_t count)
     {
-    private:
-        static const reg_t stack_start = 0x000aeffc;
-    public:
-        Register_X2 () : RegisterDefault{2,stack_start} {}
-        std::unique_ptr<RegisterDefault> copy_() const override
+        if(used + count > chunk_size)
         {
-            return std::make_unique<Register_X2>(*this);
+            chunk_size = std::max(CHUNK_INSTRS, count);
+            chunks.emplace_back(new Instr[chunk_size]);
+            used = 0;
         }
+        Instr *dst = chunks.back().get() + used;
+        std::copy(instrs, instrs + count, dst);
+        used += count;
+        return BlockSpan {dst, count};
+    }
+
+    std::size_t footprint() const noexcept
+    {
+        return chunks.empty() ? 0 : ((chunks.size() - 1) * CHUNK_INSTRS + chunk_size) * sizeof(Instr);
+    }
+};
+
+// Decodes count words into out like decode(), eight at a time where the host
+// has AVX2
+void predecode(const instr_t *words, std::size_t count, Instr *out);
+
+// Guest code decoded a whole 4 KiB page at a time, so finding a block is a
+// scan for its terminator. Pages keep the words they were decoded from and
+// are decoded again once one of them no longer matches memory.
+class PredecodeCache
+{
+public:
+    static const std::size_t PAGE_WORDS = 1024;
+
+    Instr at(const mem_t *mem, addr_t pc);
+    std::size_t pages() const noexcept {return shadow.size();}
+
+private:
+    struct Page
+    {
+        std::array<instr_t, PAGE_WORDS> words;
+        std::array<Instr, PAGE_WORDS> instrs;
     };
 
-    std::unique_ptr<RegisterDefault> self_;
+    Page &fill(const mem_t *mem, addr_t page_addr);
+
+    std::unordered_map<addr_t, std::unique_ptr<Page>> shadow {};
+    addr_t last_addr {0};
+    Page *last {nullptr};
+};
+
+// Everything the dispatcher knows about the block starting at a guest pc:
+// no descriptor - never seen, native == nullptr - decoded only.
+struct CompileJob;
+struct BlockDescriptor
+{
+    addr_t pc;
+    BlockSpan instrs;
+    uint32_t exec_count;
+    //executions that left through the taken edge of the terminating branch
+    uint32_t taken_count;
+    JitTier tier;
+    block_func_t native;
+    //exit slots of native
+    BlockLink *links;
+    //exit slots of other blocks patched to jump into this one
+    std::vector<BlockLink *> chained;
+    //heads of traces compiled with a copy of this block
+    std::vector<addr_t> traces;
+    //translation still being compiled in the background
+    std::shared_ptr<CompileJob> pending;
+};
+
+// Hot path through several blocks compiled as one unit. The terminator of
+// every block but the last continues into the next one, cold directions of
+// branches leave through side exits. If loops is set the last block
+// continues back into the first.
+struct HotTrace
+{
+    std::vector<BlockDescriptor *> blocks;
+    bool loops;
+};
+
+// Function and label symbols of the guest image sorted by address
+class GuestSymbols
+{
+private:
+    std::vector<std::pair<addr_t, std::string>> symbols {};
 
 public:
-    Register(RegType reg_type, int id, int val = 0)
+    void add(addr_t addr, std::string name) {symbols.emplace_back(addr, std::move(name));}
+    void sort() {std::sort(symbols.begin(), symbols.end());}
+    bool empty() const noexcept {return symbols.empty();}
+
+    // Closest symbol at or below pc and the distance to it, nullptr if none
+    const std::string *nearest(addr_t pc, addr_t &offset) const
     {
-        switch (reg_type)
+        auto it = std::upper_bound(symbols.begin(), symbols.end(), pc,
+                                   [](addr_t addr, const auto &symbol) {return addr < symbol.first;});
+        if(it == symbols.begin())
         {
-            case RegType::ZERO_REG:
-            {
-                self_ = std::make_unique<Register_X0>();
-                break;
-            }
-            case RegType::STACK_REG:
-            {
-                self_ = std::make_unique<Register_X2>();
-                break;
-            }
-            case RegType::DEFAULT_REG:
-            {
-                self_ = std::make_unique<RegisterDefault>(id, val);
-                break;
-            }
+            return nullptr;
         }
+        --it;
+        offset = pc - it->first;
+        return &it->second;
     }
+};
+
+// What the loader knows about guest code before it runs: the file part of
+// the executable segments and the addresses it is entered at, the entry
+// point and the function and label symbols
+struct GuestImage
+{
+    std::vector<std::pair<addr_t, addr_t>> text {};
+    std::vector<addr_t> entries {};
 
-    Register(const Register &reg) : self_(reg.self_->copy_()) {}
-    Register(Register &&reg) noexcept = default;
-    Register &operator=(Register &&reg) noexcept
+    // Whether [addr, addr + size) lies inside one executable segment
+    bool inText(addr_t addr, std::size_t size) const noexcept
     {
-        self_ = std::move(reg.self_);
-        return *this;
+        return std::any_of(text.begin(), text.end(), [addr, size](const auto &range)
+                           {return addr >= range.first && uint64_t(addr) + size <= range.second;});
     }
+};
+
+// Translated code shared by every Cpu of the process. Entries are keyed by
+// the guest instructions they were compiled from, their addresses and the
+// tier, so guests running the same binary reuse each other's translations.
+class CodeCache
+{
+public:
+    //tier, KEY_* flags, then address, length and instruction words of each
+    //block
+    typedef std::vector<uint32_t> Key;
+    static const std::size_t KEY_HEAD_PC = 2;
+    //flags of key[1]: the unit loops, keeps the profiler's call stack,
+    //records to a trace ring
+    static constexpr uint32_t KEY_LOOPS = 1, KEY_PROFILED = 2, KEY_TRACED = 4;
+
+    struct Entry
+    {
+        block_func_t code;
+        std::size_t code_size;
+        //targets of the exit slots, in slot order
+        std::vector<addr_t> exits;
+    };
+
+    static CodeCache &shared();
+
+    const Entry *find(const Key &key);
+    // Entries whose first block starts at pc, with their keys
+    std::vector<std::pair<const Key *, const Entry *>> findByHead(addr_t pc);
+    // Adds code compiled by this caller. If another thread got there first its
+    // entry is kept and the new code is released.
+    const Entry *insert(Key key, Entry entry);
+    asmjit::Error add(block_func_t *code, asmjit::CodeHolder *holder);
+
+    // Persistent cache of the code compiled for one guest image. Files are
+    // only accepted for the same image hash and host CPU features.
+    bool save(const std::string &path, uint64_t image_hash);
+    std::size_t load(const std::string &path, uint64_t image_hash);
+    static uint64_t hashFile(const char *filename);
+    uint64_t featuresHash() const noexcept;
 
-    int getId() const noexcept override {return self_->getId();}
-    reg_t getVal() const noexcept override {return self_->getVal();}
-    void setVal(int val) override {self_->setVal(val);}
+    const asmjit::Environment &environment() const noexcept {return rt.environment();}
+    const asmjit::CpuFeatures &cpuFeatures() const noexcept {return rt.cpuFeatures();}
+    std::size_t size();
 
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
 
-    friend asmjit::x86::Mem toDwordPtr(Register &reg);
+private:
+    struct KeyHash
+    {
+        std::size_t operator()(const Key &key) const noexcept;
+    };
+
+    std::mutex lock;
+    asmjit::JitRuntime rt;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    std::unordered_multimap<addr_t, std::pair<const Key *, const Entry *>> by_head;
 };
 
-struct TranslationAttr
+// Self-contained copy of what a unit is compiled from, so a worker can
+// compile it while the Cpu keeps interpreting and possibly dropping the
+// blocks. The worker sets done with release order once result is written.
+struct CompileJob
 {
-    asmjit::x86::Compiler &cc;
-    asmjit::x86::Gp &dst1;
-    asmjit::x86::Gp &dst2;
-    asmjit::x86::Gp &ret;
+    JitTier tier;
+    bool loops;
+    //keeps the shadow call stack of the profiler
+    bool profiled;
+    std::vector<addr_t> pcs;
+    std::vector<std::vector<Instr>> blocks;
+    CodeCache::Key key;
+    CodeCache *cache;
+    bool logged;
+    //records execution through RingTrace
+    bool traced {false};
+    //symbol for perf, empty if perf is not told about the code
+    std::string perf_name {};
+    //assembly listing, written to the Cpu log when the code is installed
+    std::string listing {};
+    uint64_t compile_ns {0};
+    //nullptr if compilation failed
+    const CodeCache::Entry *result {nullptr};
+    std::atomic<bool> done {false};
+};
 
-    asmjit::InvokeNode **invokeNode;
-    asmjit::Label *L_BRANCH;
+// Compiler worker threads shared by every Cpu of the process. Workers are
+// started on demand and run jobs in submission order.
+class CompileQueue
+{
+public:
+    static CompileQueue &shared();
+
+    // Queues job and makes sure at least nthreads workers are running
+    void submit(std::shared_ptr<CompileJob> job, unsigned nthreads);
+    std::size_t threads();
+
+    CompileQueue();
+    ~CompileQueue();
+    CompileQueue(const CompileQueue &) = delete;
+    CompileQueue &operator=(const CompileQueue &) = delete;
+
+private:
+    void work();
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::shared_ptr<CompileJob>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping {false};
 };
 
-class Memory
+// Direct-mapped two-level table from a 4-byte aligned guest pc to its
+// block descriptor. Second level pages cover 64 KiB of guest code each and
+// are allocated on first insert.
+class BlockTable
 {
 private:
-    static const std::size_t MEMSIZE = 0x00ffffff;
-    std::size_t MemSize;
-    std::vector<mem_t> data{};
+    static const int L1_BITS = 16;
+    static const int L2_BITS = 14;
+    typedef std::array<BlockDescriptor *, std::size_t(1) << L2_BITS> Page;
+
+    std::unique_ptr<std::unique_ptr<Page>[]> dir {new std::unique_ptr<Page>[std::size_t(1) << L1_BITS]};
+    std::deque<BlockDescriptor> descriptors {};
+    std::size_t npages {0};
+
+    static std::size_t l1(addr_t pc) noexcept {return pc >> (32 - L1_BITS);}
+    static std::size_t l2(addr_t pc) noexcept {return (pc >> 2) & ((std::size_t(1) << L2_BITS) - 1);}
+
 public:
-    Memory(std::size_t MemSize_ = MEMSIZE) : MemSize(MemSize_) {data.reserve(MEMSIZE);};
+    BlockDescriptor *find(addr_t pc) const noexcept
+    {
+        const Page *page = dir[l1(pc)].get();
+        return (page && !(pc & 0b11)) ? (*page)[l2(pc)] : nullptr;
+    }
 
-    template<typename Value_t>
-    reg_t load(addr_t addr) const
+    BlockDescriptor &insert(addr_t pc)
     {
-        return static_cast<reg_t>(*(reinterpret_cast<const Value_t *>(data.data() + addr)));
+        std::unique_ptr<Page> &page = dir[l1(pc)];
+        if(!page)
+        {
+            page = std::make_unique<Page>();
+            page->fill(nullptr);
+            ++npages;
+        }
+        BlockDescriptor &block = descriptors.emplace_back(BlockDescriptor {});
+        (*page)[l2(pc)] = &block;
+        return block;
     }
 
-    template<typename Store_t>
-    void store(addr_t addr, reg_t val)
+    void erase(addr_t pc) noexcept
     {
-        *(reinterpret_cast<Store_t *>((data.data() + addr))) = val;
+        if(Page *page = dir[l1(pc)].get()) {(*page)[l2(pc)] = nullptr;}
+    }
+
+    std::size_t footprint() const noexcept
+    {
+        return (std::size_t(1) << L1_BITS) * sizeof(std::unique_ptr<Page>) + npages * sizeof(Page) +
+               descriptors.size() * sizeof(BlockDescriptor);
     }
 };
 
 class Cpu
 {
 private:
-    static const int NRegs = 32;
-    reg_t pc_;
-    std::vector<Register> regs {};
+    static const int NRegs = CpuState::NRegs;
+    static const reg_t stack_start = 0x7ffffff0;
+    //committed below the end of the page holding stack_start
+    static const std::size_t stack_size = std::size_t(8) << 20;
+    CpuState state_ {};
     Memory *mem;
     bool done {false};
 
-    //for tracing
-    // Trace tracer;
-
 public:
     //for binary translation
-    asmjit::JitRuntime rt;
-    std::unordered_map<addr_t, std::vector<struct Instr>> bb_cache {};
-    typedef  void (*func_t)(void);
-    std::unordered_map<addr_t, func_t> bb_translated {};
+    CodeCache *code_cache {&CodeCache::shared()};
+    InstrArena bb_arena {};
+    PredecodeCache predecoded {};
+    std::vector<Instr> bb_decode_buf {};
+    BlockTable bb_table {};
+    TierPolicy tier_policy {};
+    SyscallState sys {};
+    typedef block_func_t func_t;
+    std::deque<std::vector<BlockLink>> bb_links {};
+    JitStats stats {};
+    GuestSymbols symbols {};
+    GuestImage image {};
+    //set between Profiler::start and stop, code run meanwhile keeps the
+    //shadow call stack
+    Profiler *profiler {nullptr};
+    //set to record execution, needs a build with RV32I_TRACING
+    TraceRing *trace_ring {nullptr};
+    //assembly of translated code, nullptr unless asked for
     FILE *output_log;
 
-    Cpu (Memory *mem_, addr_t entry = 0, const char *filename = "x86_64") : pc_(entry), mem(mem_)
+    Cpu (Memory *mem_, addr_t entry = 0, const char *log_filename = nullptr) : mem(mem_)
     {
-        output_log = fopen(filename, "w+");
-        if(!output_log) {std::cout << "Failed to open a file " << filename << std::endl;}
-        regs.push_back(Register(RegType::ZERO_REG, 0));
-        regs.push_back(Register(RegType::DEFAULT_REG, 1));
-        regs.push_back(Register(RegType::STACK_REG, 2));
-        // regs.reserve(NRegs);
-        // regs[0] = Register(RegType::ZERO_REG, 0);
-        // regs[1] = Register(RegType::DEFAULT_REG, 1);
-        // regs[2] = Register(RegType::STACK_REG, 2);
-        for (int i = 3; i < NRegs; ++i)
+        if(!mem->commit(stackBottom(), stack_size))
         {
-            regs.push_back(Register(RegType::DEFAULT_REG, i));
-            // regs[i] = Register(RegType::DEFAULT_REG,i);
+            throw std::system_error(errno, std::generic_category(), "Failed to commit guest stack");
         }
+        output_log = log_filename ? fopen(log_filename, "w+") : nullptr;
+        if(log_filename && !output_log) {std::cout << "Failed to open a file " << log_filename << std::endl;}
+        state_.pc = entry;
+        state_.regs[2] = stack_start;
     }
-    ~Cpu() {}
+    ~Cpu() {if(output_log) {fclose(output_log);}}
+    //lowest address of the committed stack
+    static addr_t stackBottom() noexcept {return addr_t(stack_start) + 0x10 - stack_size;}
+    Cpu(const Cpu &) = delete;
+    Cpu &operator=(const Cpu &) = delete;
 
     //TODO: NOEXCEPT
     bool isdone() const noexcept {return done;}
     //TODO: INSTR SIZE AS ARG
-    void advancePc(std::size_t step = sizeof(reg_t)) {pc_ += step;}
-    reg_t getPc() const noexcept {return pc_;}
-    void setPc(reg_t val) noexcept {pc_ = val;}
+    void advancePc(std::size_t step = sizeof(reg_t)) {state_.pc += step;}
+    reg_t getPc() const noexcept {return state_.pc;}
+    void setPc(reg_t val) noexcept {state_.pc = val;}
 
-    void setReg(int ireg, reg_t value) {regs[ireg].setVal(value);}
-    reg_t getReg(int ireg) const {return regs[ireg].getVal();}
+    // x0 is hardwired to zero: write unconditionally and clear it afterwards
+    void setReg(int ireg, reg_t value) noexcept {state_.regs[ireg] = value; state_.regs[0] = 0;}
+    reg_t getReg(int ireg) const noexcept {return state_.regs[ireg];}
     void setDone(bool val = true) noexcept {done = val;}
 
+    CpuState &getState() noexcept {return state_;}
+    const CpuState &getState() const noexcept {return state_;}
+    void setState(const CpuState &state) noexcept {state_ = state; state_.regs[0] = 0;}
+
     template<typename Value_t>
     reg_t load(addr_t addr) const
     {
@@ -200,58 +756,96 @@ public:
         mem->store<Store_t>(addr, val);
     }
 
+    bool commit(addr_t addr, std::size_t len) noexcept {return mem->commit(addr, len);}
+    bool release(addr_t addr, std::size_t len) noexcept {return mem->release(addr, len);}
+    bool mapFile(addr_t addr, int fd, off_t offset, std::size_t len) noexcept {return mem->mapFile(addr, fd, offset, len);}
+    bool discard(addr_t addr, std::size_t len) noexcept {return mem->discard(addr, len);}
+    bool mapped(addr_t addr, std::size_t len) const noexcept {return mem->mapped(addr, len);}
+    bool guestAddress(const void *host, addr_t &addr) const noexcept {return mem->guestAddress(host, addr);}
+
+    mem_t *getMemBase() noexcept {return mem->base();}
+    std::size_t getMemSize() const noexcept {return mem->size();}
+
     void dump(std::ostream &os)
     {
         os << "regs:" << std::endl;
-        os << "pc: " << pc_ << std::endl;
+        os << "pc: " << state_.pc << std::endl;
         for (int i = 0; i < NRegs; i++)
         {
-            os << "x" << i << " = " << regs[i].getVal() << std::endl;
+            os << "x" << i << " = " << state_.regs[i] << std::endl;
         }
     }
 
-    reg_t fetch() {return mem->load<reg_t>(pc_);}
+    reg_t fetch() {return mem->load<reg_t>(state_.pc);}
     reg_t fetch(addr_t addr) {return mem->load<reg_t>(addr);}
-
-    friend Cpu::func_t translate(Cpu &cpu, std::vector<Instr> &bb);
 };
 
-struct Instr
+
+// How decode takes an encoding apart: the instruction bits holding rd, rs1,
+// rs2, funct3 and funct7 (all others are immediate or ignored), the layout
+// of the immediate and the handler specialized for the encoding
+struct DecodeEntry
 {
-    Opcode opcode;
-    uint8_t funct3;
-    uint8_t funct7;
-    imm_t imm;
-    int rd_id;
-    int rs1_id;
-    int rs2_id;
+    enum Format : uint8_t {NoImm, IImm, SImm, BImm, UImm, JImm};
 
-    size_t size;
-    void (*exec)(Cpu &cpu, Instr &instr);
+    Instr::exec_t exec;
+    uint32_t fields;
+    Format format;
 };
 
-Instr decode(reg_t instr);
-
-void executeImm (Cpu &cpu, Instr &instr);
-void executeOp (Cpu &cpu, Instr &instr);
-void executeBranch (Cpu &cpu, Instr &instr);
-void executeLoad (Cpu &cpu, Instr &instr);
-void executeStore (Cpu &cpu, Instr &instr);
-void executeSystem(Cpu &cpu, Instr &instr);
-void executeLui(Cpu &cpu, Instr &instr);
-void executeAuipc(Cpu &cpu, Instr &instr);
-void executeJalr(Cpu &cpu, Instr &instr);
-void executeJal(Cpu &cpu, Instr &instr);
-void executeFence(Cpu &cpu, Instr &instr);
+// Decode tables are generated at compile time, one entry per opcode bits
+// 6:2, funct3, funct7 bit 30 and rd == x0. Illegal encodings get
+// executeIllegal, so does any word decodeIndex sends to ILLEGAL_DECODE_INDEX.
+static const std::size_t DECODE_TABLE_SIZE = 1024;
+typedef std::array<DecodeEntry, DECODE_TABLE_SIZE> DecodeTable;
+extern const DecodeTable decode_table;
+#ifdef RV32I_TRACING
+//same, with handlers recording to TraceRing::current
+extern const DecodeTable traced_decode_table;
+#endif
+
+//first entry of reserved opcode 0b11111
+static const std::size_t ILLEGAL_DECODE_INDEX = std::size_t(0x1f) << 5;
+//funct7 bits besides bit 30, zero in every OP and OP-IMM shift encoding
+static const instr_t FUNCT7_RESERVED = 0xbe000000;
+
+//encodings not ending in 0b11 share the entries of reserved opcode 0b11111.
+//OP and the OP-IMM shifts with other funct7 bits set (M extension, bad
+//shift amounts) are illegal, the table only tells bit 30 apart.
+constexpr std::size_t decodeIndex(instr_t instr) noexcept
+{
+    const std::size_t opcode = (instr & 0b11) == 0b11 ? (instr >> 2) & 0x1f : 0x1f;
+    const std::size_t funct3 = (instr >> 12) & 0b111;
+    const bool full_funct7 = opcode == 0b01100 || (opcode == 0b00100 && (funct3 & 0b11) == 0b01);
+    if(full_funct7 && (instr & FUNCT7_RESERVED))
+    {
+        return ILLEGAL_DECODE_INDEX;
+    }
+    return opcode << 5 | funct3 << 2 | ((instr >> 30) & 1) << 1 | (((instr >> 7) & 0x1f) == 0);
+}
+
+Instr decode(reg_t instr, const DecodeTable &table = decode_table);
+
+void executeIllegal(Cpu &cpu, const Instr *instr);
+void executeSystem(Cpu &cpu, const Instr &instr);
+//Zicsr on the user counters. cycle counts retired instructions like
+//instret, time is the host monotonic clock in ns. Both engines add a block
+//to instret at its entry, so a CSR instruction, which ends its block, sees
+//itself counted and reads instret - 1. time reads CpuState::clock.
+//the instruction reads its CSR without writing it
+bool csrReadOnly(const Instr &instr) noexcept;
+//false if csr is not a counter
+bool readCsr(const CpuState &state, uint32_t csr, uint32_t &value) noexcept;
+//runs the syscall in a7, returns the value for a0 (negative errno on failure)
+reg_t doSyscall(Cpu &cpu);
 void execute(Cpu &cpu, Instr &instr);
-void interpret_block(Cpu &cpu, std::vector<Instr> instrs);
+void interpret_block(Cpu &cpu, const Instr *instrs);
 
 //translateion
-const size_t BB_AVERAGE_SIZE = 10;
-const size_t BB_THRESHOLD = 10;
-bool is_bb_end(Instr &instr);
+bool is_bb_end(const Instr &instr);
 
-asmjit::x86::Mem toDwordPtr(Register &reg);
+asmjit::x86::Mem toDwordPtr(asmjit::x86::Gp &state, int reg_id);
+asmjit::x86::Mem pcDwordPtr(asmjit::x86::Gp &state);
 
 void translateOp(Instr &instr, TranslationAttr &attr)    ;
 void translateImm(Instr &instr, TranslationAttr &attr)   ;
@@ -259,8 +853,28 @@ void translateBranch(Instr &instr, TranslationAttr &attr);
 void translateLoad (Instr &instr, TranslationAttr &attr) ;
 void translateStore(Instr &instr, TranslationAttr &attr) ;
 
-std::vector<Instr> lookup(Cpu &cpu, addr_t addr);
-Cpu::func_t translate(Cpu &cpu, std::vector<Instr> &bb);
+BlockDescriptor &lookup(Cpu &cpu, addr_t addr);
+HotTrace formTrace(Cpu &cpu, BlockDescriptor &head);
+Cpu::func_t translate(Cpu &cpu, BlockDescriptor &block, JitTier tier = JitTier::Baseline);
+bool adoptCached(Cpu &cpu, BlockDescriptor &block);
+//compiles the unit on the worker threads, installs it at once if it is cached
+bool requestTranslation(Cpu &cpu, BlockDescriptor &block, JitTier tier);
+//installs the finished pending unit unless its blocks changed meanwhile
+bool finishTranslation(Cpu &cpu, BlockDescriptor &block);
+//decodes the blocks reachable from cpu.image entries through direct
+//branches and jumps and translates them on nthreads threads before the run.
+//Blocks only reached through JALR are left to the dispatcher. Returns the
+//number of blocks installed.
+std::size_t translateAhead(Cpu &cpu, unsigned nthreads);
+void compile(CompileJob &job);
+//targets of the exit slots of the unit compiled from key, false if key is
+//malformed. Has to follow what compile() emits.
+bool unitExits(const CodeCache::Key &key, std::vector<addr_t> &exits);
+
+//block chaining
+BlockLink *newLinks(Cpu &cpu, const std::vector<addr_t> &targets);
+void chainBlock(BlockLink *link, BlockDescriptor &next);
+void invalidateBlock(Cpu &cpu, addr_t addr);
 
 #endif
 
@@ -4,11 +4,24 @@
 #include "cpu.hpp"
 #include "rv32i.hpp"
 
+#include <ostream>
+#include <string>
+#include <vector>
+
 int elfio_manager(const char *filename, Cpu &cpu);
 
-void write_to_mem(Cpu &cpu, int Ninstr, const char *data_ptr, addr_t entry = 0);
+// Lays out argc, argv, an empty envp and auxv below the stack pointer as the
+// Linux RISC-V ABI expects at process entry, also passing argc/argv in a0/a1
+void setup_stack(Cpu &cpu, const std::vector<std::string> &argv);
+
+void write_to_mem(Cpu &cpu, addr_t addr, const char *data, std::size_t size);
+
+JitTier wantedTier(const TierPolicy &policy, const BlockDescriptor &block);
 
 int run_simulation(Cpu &cpu);
 
+// Prints the counters as one JSON object
+void write_stats(std::ostream &os, const JitStats &stats);
+
 #endif
 
@@ -0,0 +1,46 @@
+#ifndef RV32I_PERF_HPP
+#define RV32I_PERF_HPP
+
+#include "cpu.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Tells Linux perf about translated code. The perf map
+// (/tmp/perf-<pid>.map) names the code for perf report, the jitdump file
+// (jit-<pid>.dump) also carries its bytes so that perf inject --jit makes it
+// visible to perf annotate. Both are off until opened, compilers then
+// report every unit they add to the code cache.
+class PerfJitLog
+{
+public:
+    static PerfJitLog &shared();
+
+    bool openMap();
+    // perf record has to run with -k mono to match the jitdump timestamps
+    bool openJitdump(const char *dir = "/tmp");
+    bool enabled() const noexcept {return active.load(std::memory_order_relaxed);}
+
+    void codeLoaded(const void *code, std::size_t size, const std::string &name);
+
+    PerfJitLog() = default;
+    ~PerfJitLog();
+    PerfJitLog(const PerfJitLog &) = delete;
+    PerfJitLog &operator=(const PerfJitLog &) = delete;
+
+private:
+    std::mutex lock;
+    std::atomic<bool> active {false};
+    FILE *map {nullptr};
+    FILE *dump {nullptr};
+    void *marker {nullptr};
+    std::size_t marker_size {0};
+    uint64_t code_index {0};
+};
+
+// "guest:<symbol>+0x<offset>@<pc>/<tier>", without symbols the pc alone
+std::string perfName(const GuestSymbols *symbols, addr_t pc, JitTier tier);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef RV32I_PROFILER_HPP
+#define RV32I_PROFILER_HPP
+
+#include "cpu.hpp"
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// Sampling profiler of the guest. The dispatcher and loops in translated
+// code compare instret with CpuState::sample_at at block boundaries, where
+// the architectural state is up to date, and call sample() once it is
+// reached. Sampling is driven either by retired instructions or by a host
+// CPU time timer that moves sample_at to 0, so between samples the cost is
+// one compare per block.
+class Profiler
+{
+public:
+    enum class Clock {Instret, CpuTime};
+    static const std::size_t MAX_DEPTH = 64;
+
+    // period is in instructions or in microseconds of thread CPU time
+    Profiler(Clock clock, uint64_t period) : clock(clock), period(period) {}
+    ~Profiler() {stop();}
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    // Profiles cpu on the calling thread until stop(). Start it before the
+    // guest runs: only code run while cpu.profiler is set keeps the shadow
+    // call stack.
+    bool start(Cpu &cpu);
+    void stop();
+
+    // Records the call stack at the current pc and schedules the next sample
+    void sample(Cpu &cpu);
+
+    // Brendan Gregg's folded format, callers first: "main;f;g count"
+    void writeFolded(std::ostream &os, const GuestSymbols &symbols) const;
+    uint64_t samples() const noexcept {return nsamples;}
+
+private:
+    struct StackHash
+    {
+        std::size_t operator()(const std::vector<addr_t> &stack) const noexcept;
+    };
+
+    void unwind(Cpu &cpu, std::vector<addr_t> &stack) const;
+
+    Clock clock;
+    uint64_t period;
+    Cpu *cpu {nullptr};
+    timer_t timer {};
+    bool timer_armed {false};
+    //SIGPROF action replaced by start(), put back by stop()
+    struct sigaction old_action {};
+    bool action_set {false};
+    uint64_t nsamples {0};
+    //innermost frame first
+    std::unordered_map<std::vector<addr_t>, uint64_t, StackHash> stacks {};
+    std::vector<addr_t> scratch {};
+};
+
+#endif
@@ -57,8 +57,23 @@ namespace I
     namespace System {
     enum class funct3 : std::uint8_t
     {
-        ECALL  = 0b000,
-        EBREAK = 0b001,
+        PRIV   = 0b000, //ECALL, EBREAK by imm
+        CSRRW  = 0b001,
+        CSRRS  = 0b010,
+        CSRRC  = 0b011,
+        CSRRWI = 0b101,
+        CSRRSI = 0b110,
+        CSRRCI = 0b111,
+    };
+    //user counters, the only CSRs there are
+    enum Csr : std::uint16_t
+    {
+        CYCLE    = 0xc00,
+        TIME     = 0xc01,
+        INSTRET  = 0xc02,
+        CYCLEH   = 0xc80,
+        TIMEH    = 0xc81,
+        INSTRETH = 0xc82,
     };}
     namespace Fence {
     enum class funct3 : std::uint8_t
@@ -67,8 +82,7 @@ namespace I
         FENCE_I = 0b001,
     };}
 
-    //TODO:FINISH FOR SHIFTS
-    imm_t getImm(reg_t instr);
+    constexpr imm_t getImm(reg_t instr) {return instr >> 20;}
 };
 
 namespace R
@@ -102,7 +116,11 @@ namespace B
         BGEU = 0b111,
     };}
 
-    imm_t getImm(reg_t instr);
+    constexpr imm_t getImm(reg_t instr)
+    {
+        return ((instr >> 20) & 0xfffff000) | ((static_cast<uint32_t>(instr) << 4) & 0x00000800) |
+               ((instr >> 20) & 0x000007e0) | ((instr >> 7) & 0x0000001e);
+    }
 }
 
 namespace S
@@ -115,35 +133,50 @@ namespace S
         SW = 0b010,
     };}
 
-    imm_t getImm(reg_t instr);
+    constexpr imm_t getImm(reg_t instr) {return ((instr >> 20) & 0xffffffe0) | ((instr >> 7) & 0x0000001f);}
 }
 
 namespace U
 {
-    imm_t getImm(reg_t instr);
+    //the upper 20 bits, not shifted back into place
+    constexpr imm_t getImm(reg_t instr) {return (instr & 0xfffff000) >> 12;}
 }
 
 namespace J
 {
-    imm_t getImm(reg_t instr);
+    constexpr imm_t getImm(reg_t instr)
+    {
+        return ((instr >> 12) & 0xfff00000) | (instr & 0x000ff000) | ((instr >> 9) & 0x00000800) | ((instr >> 20) & 0x000007fe);
+    }
 }
 
-Opcode  getOpcode(reg_t instr);
-uint8_t getfunct3(reg_t instr);
-int     getRdId(reg_t instr);
-int     getRs1Id(reg_t instr);
-int     getRs2Id(reg_t instr);
+constexpr Opcode  getOpcode(reg_t instr) {return static_cast<Opcode>(instr & 0b01111111);}
+constexpr uint8_t getfunct3(reg_t instr) {return (instr >> 12) & 0b111;}
+constexpr uint8_t getfunct7(reg_t instr) {return (instr >> 30) & 1;}
+constexpr int     getRdId(reg_t instr)   {return (instr >> 7) & regsize;}
+constexpr int     getRs1Id(reg_t instr)  {return (instr >> 15) & regsize;}
+constexpr int     getRs2Id(reg_t instr)  {return (instr >> 20) & regsize;}
 
 namespace Syscall
 {
+    //asm-generic numbers as used by rv32 Linux
     enum class rv
     {
-        LSEEK  = 62,
-        READ   = 63,
-        WRITE  = 64,
-        CLOSE  = 57,
-        EXIT   = 93,
-        MMAP   = 222,
+        OPENAT          = 56,
+        CLOSE           = 57,
+        LSEEK           = 62,
+        READ            = 63,
+        WRITE           = 64,
+        READV           = 65,
+        WRITEV          = 66,
+        FSTAT           = 80,
+        EXIT            = 93,
+        EXIT_GROUP      = 94,
+        CLOCK_GETTIME   = 113,
+        BRK             = 214,
+        MUNMAP          = 215,
+        MMAP            = 222,
+        CLOCK_GETTIME64 = 403,
     };
 }
 
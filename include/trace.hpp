@@ -1,28 +1,118 @@
+#ifndef RV32I_TRACE_HPP
+#define RV32I_TRACE_HPP
+
 #include "rv32i.hpp"
-#include <fstream>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
 
-class Trace
+// One traced event, 16 bytes. reg holds rd of a register write and the
+// access size of a memory access; addr holds the syscall number of a syscall.
+struct TraceEvent
+{
+    enum Kind : uint8_t {Block = 1, RegWrite = 2, MemRead = 3, MemWrite = 4, Syscall = 5};
+
+    uint8_t kind;
+    uint8_t reg;
+    uint16_t reserved;
+    uint32_t pc;
+    uint32_t addr;
+    uint32_t value;
+};
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent must stay compact");
+
+// Single producer ring of events. The traced thread pushes, the writer
+// thread drains; a full ring makes the producer wait so no event is lost.
+class TraceRing
 {
-private:
-    std::ofstream trace_out_file;
 public:
-    Trace(const char *filename = "trace.log") : trace_out_file(filename, std::ios::out) {}
-    ~Trace() {trace_out_file.close();}
+    static const std::size_t CAPACITY = std::size_t(1) << 16;
+    //ring the engines on this thread record to
+    static thread_local TraceRing *current;
 
-    void MemoryWrite(addr_t addr, reg_t val)
-    {
-        trace_out_file << "Write to addr=" << std::ofstream::hex << addr << ";val=" << val << std::endl;
-    }
-    void MemoryRead(addr_t addr, reg_t val)
-    {
-        trace_out_file << "Read from addr=" << std::ofstream::hex << addr << ";val=" << val << std::endl;
-    }
-    void RegisterChange(int reg_id, reg_t val)
+    explicit TraceRing(uint32_t id) : id(id) {}
+
+    void push(const TraceEvent &event) noexcept
     {
-        trace_out_file << "Write to reg=x" << reg_id << ";val=" << val << std::endl;
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        while(h - tail.load(std::memory_order_acquire) >= CAPACITY)
+        {
+            std::this_thread::yield();
+        }
+        events[h & (CAPACITY - 1)] = event;
+        head.store(h + 1, std::memory_order_release);
     }
-    void Interrupt(int interrupt_number)
+
+    const uint32_t id;
+    std::unique_ptr<TraceEvent[]> events {new TraceEvent[CAPACITY]};
+    alignas(64) std::atomic<uint64_t> head {0};
+    alignas(64) std::atomic<uint64_t> tail {0};
+};
+
+// Background thread writing the rings to a file. The file is the magic
+// "RV32TRC1" followed by chunks of a ring id, an event count and the events.
+class TraceWriter
+{
+public:
+    static const char MAGIC[8];
+
+    bool open(const char *path);
+    // Ring for one traced Cpu
+    TraceRing *newRing();
+    // Writes out what is left and stops the thread
+    void close();
+
+    TraceWriter() = default;
+    ~TraceWriter() {close();}
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+private:
+    bool drain();
+    void run();
+
+    std::mutex lock;
+    std::deque<TraceRing> rings;
+    FILE *out {nullptr};
+    std::thread thread;
+    std::atomic<bool> stopping {false};
+};
+
+// Tracing policies the interpreter, the dispatcher and the JIT are
+// instantiated with. NoTrace compiles to nothing.
+struct NoTrace
+{
+    static constexpr bool enabled = false;
+
+    static void block(addr_t) noexcept {}
+    static void regWrite(addr_t, unsigned, reg_t) noexcept {}
+    static void memRead(addr_t, addr_t, reg_t, unsigned) noexcept {}
+    static void memWrite(addr_t, addr_t, reg_t, unsigned) noexcept {}
+    static void syscall(addr_t, reg_t, reg_t) noexcept {}
+};
+
+struct RingTrace
+{
+    static constexpr bool enabled = true;
+
+    static void record(uint8_t kind, uint8_t reg, addr_t pc, addr_t addr, reg_t value) noexcept
     {
-        trace_out_file << "Interrupt number=" << interrupt_number << std::endl;
+        TraceRing::current->push(TraceEvent {kind, reg, 0, pc, addr, static_cast<uint32_t>(value)});
     }
+    static void block(addr_t pc) noexcept {record(TraceEvent::Block, 0, pc, 0, 0);}
+    static void regWrite(addr_t pc, unsigned rd, reg_t value) noexcept {record(TraceEvent::RegWrite, rd, pc, 0, value);}
+    static void memRead(addr_t pc, addr_t addr, reg_t value, unsigned size) noexcept {record(TraceEvent::MemRead, size, pc, addr, value);}
+    static void memWrite(addr_t pc, addr_t addr, reg_t value, unsigned size) noexcept {record(TraceEvent::MemWrite, size, pc, addr, value);}
+    static void syscall(addr_t pc, reg_t nr, reg_t ret) noexcept {record(TraceEvent::Syscall, 0, pc, nr, ret);}
 };
+
+// Prints a trace file as one line per event, false if it is malformed
+bool decodeTrace(std::istream &in, std::ostream &out);
+
+#endif
@@ -0,0 +1,257 @@
+#include "batch.hpp"
+#include "io.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Redirects a guest stdio descriptor to a host file for the lifetime of a job
+class StdioFile
+{
+private:
+    int fd {-1};
+
+public:
+    StdioFile() = default;
+    StdioFile(const StdioFile &) = delete;
+    StdioFile &operator=(const StdioFile &) = delete;
+    ~StdioFile() {if(fd >= 0) {close(fd);}}
+
+    bool open(Cpu &cpu, int guest_fd, const std::string &path, int flags)
+    {
+        if(path.empty())
+        {
+            return true;
+        }
+        fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if(fd < 0)
+        {
+            return false;
+        }
+        cpu.sys.stdio[guest_fd] = fd;
+        return true;
+    }
+};
+
+JobResult run_job(const BatchJob &job, const TierPolicy &policy)
+{
+    JobResult result {};
+    auto start = std::chrono::steady_clock::now();
+
+    //a job that gets no address space fails alone, the others go on
+    std::unique_ptr<Memory> mem {};
+    std::unique_ptr<Cpu> guest {};
+    try
+    {
+        mem = std::make_unique<Memory>();
+        guest = std::make_unique<Cpu>(mem.get());
+    }
+    catch(const std::exception &err)
+    {
+        std::cout << job.elf << ": " << err.what() << std::endl;
+        result.status = JobResult::Status::LoadError;
+        return result;
+    }
+    Cpu &cpu = *guest;
+    cpu.tier_policy = policy;
+
+    StdioFile in, out;
+    if(elfio_manager(job.elf.c_str(), cpu) ||
+       !in.open(cpu, STDIN_FILENO, job.stdin_path, O_RDONLY) ||
+       !out.open(cpu, STDOUT_FILENO, job.stdout_path, O_WRONLY | O_CREAT | O_TRUNC))
+    {
+        result.status = JobResult::Status::LoadError;
+        return result;
+    }
+    setup_stack(cpu, job.argv.empty() ? std::vector<std::string> {job.elf} : job.argv);
+
+    result.status = run_simulation(cpu) ? JobResult::Status::RunError : JobResult::Status::Ok;
+    //jobs share the process, descriptors a guest leaves open would pile up
+    cpu.sys.closeFiles();
+    result.exit_code = cpu.sys.exit_code;
+    result.state = cpu.getState();
+    result.instret = cpu.getState().instret;
+    result.stats = cpu.stats;
+    result.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Per-thread job queue. The owner takes from the back, idle threads steal
+// from the front so they pick up the work dealt last to a busy thread.
+class WorkQueue
+{
+private:
+    std::mutex lock;
+    std::deque<std::size_t> jobs;
+
+public:
+    void push(std::size_t job) {std::lock_guard<std::mutex> guard(lock); jobs.push_back(job);}
+
+    bool pop(std::size_t &job)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(jobs.empty()) {return false;}
+        job = jobs.back();
+        jobs.pop_back();
+        return true;
+    }
+
+    bool steal(std::size_t &job)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(jobs.empty()) {return false;}
+        job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+};
+
+std::vector<JobResult> run_batch(const std::vector<BatchJob> &jobs, unsigned nthreads, const TierPolicy &policy)
+{
+    std::vector<JobResult> results(jobs.size());
+    nthreads = std::max(1u, std::min<unsigned>(nthreads, jobs.size()));
+
+    //jobs are dealt round-robin up front and none are added later, so a
+    //thread that finds every queue empty is done
+    std::vector<WorkQueue> queues(nthreads);
+    for(std::size_t i = 0; i < jobs.size(); ++i)
+    {
+        queues[i % nthreads].push(i);
+    }
+
+    auto worker = [&](unsigned self)
+    {
+        std::size_t job = 0;
+        while(true)
+        {
+            bool found = queues[self].pop(job);
+            for(unsigned i = 1; !found && i < nthreads; ++i)
+            {
+                found = queues[(self + i) % nthreads].steal(job);
+            }
+            if(!found)
+            {
+                return;
+            }
+            results[job] = run_job(jobs[job], policy);
+        }
+    };
+
+    std::vector<std::thread> threads {};
+    for(unsigned i = 1; i < nthreads; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for(std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    return results;
+}
+
+bool parse_batch_file(const char *filename, std::vector<BatchJob> &jobs)
+{
+    std::ifstream in(filename);
+    if(!in)
+    {
+        std::cout << "Can't open batch file " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for(int lineno = 1; std::getline(in, line); ++lineno)
+    {
+        std::istringstream words(line);
+        std::string word;
+        BatchJob job {};
+        while(words >> word)
+        {
+            if(word == "<" || word == ">")
+            {
+                std::string &path = word == "<" ? job.stdin_path : job.stdout_path;
+                if(!(words >> path))
+                {
+                    std::cout << filename << ":" << lineno << ": missing file after " << word << std::endl;
+                    return false;
+                }
+            }
+            else if(job.elf.empty() && word[0] == '#')
+            {
+                break;
+            }
+            else
+            {
+                job.argv.push_back(word);
+                if(job.elf.empty()) {job.elf = word;}
+            }
+        }
+        if(!job.elf.empty())
+        {
+            jobs.push_back(std::move(job));
+        }
+    }
+    return true;
+}
+
+static const char *statusName(JobResult::Status status)
+{
+    switch (status)
+    {
+        case JobResult::Status::Ok:        return "ok";
+        case JobResult::Status::LoadError: return "load-error";
+        case JobResult::Status::RunError:  return "run-error";
+    }
+    return "";
+}
+
+// s as the contents of a JSON string
+static void writeJsonString(std::ostream &os, const std::string &s)
+{
+    for(unsigned char c : s)
+    {
+        if(c == '"' || c == '\\')
+        {
+            os << '\\' << c;
+        }
+        else if(c < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            os << escaped;
+        }
+        else
+        {
+            os << c;
+        }
+    }
+}
+
+void write_report(std::ostream &os, const std::vector<BatchJob> &jobs, const std::vector<JobResult> &results)
+{
+    os << "[\n";
+    for(std::size_t i = 0; i < results.size(); ++i)
+    {
+        const JobResult &result = results[i];
+        os << "  {\"job\": " << i << ", \"elf\": \"";
+        writeJsonString(os, jobs[i].elf);
+        os << "\", \"status\": \"" << statusName(result.status)
+           << "\", \"exit_code\": " << result.exit_code << ", \"instret\": " << result.instret
+           << ", \"wall_ms\": " << result.wall_ms << ", \"pc\": " << result.state.pc << ", \"regs\": [";
+        for(int r = 0; r < CpuState::NRegs; ++r)
+        {
+            os << (r ? ", " : "") << result.state.regs[r];
+        }
+        os << "], \"stats\": ";
+        write_stats(os, result.stats);
+        os << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    os << "]" << std::endl;
+}
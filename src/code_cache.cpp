@@ -0,0 +1,241 @@
+#include "asmjit/x86/x86assembler.h"
+#include "cpu.hpp"
+#include "perf.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+CodeCache &CodeCache::shared()
+{
+    static CodeCache cache;
+    return cache;
+}
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, std::size_t size)
+{
+    for(std::size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325;
+
+// FNV-1a over the key words
+std::size_t CodeCache::KeyHash::operator()(const Key &key) const noexcept
+{
+    uint64_t hash = FNV_OFFSET;
+    for(uint32_t word : key)
+    {
+        hash = (hash ^ word) * 0x100000001b3;
+    }
+    return hash;
+}
+
+const CodeCache::Entry *CodeCache::find(const Key &key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(key);
+    if(it == entries.end())
+    {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return &it->second;
+}
+
+std::vector<std::pair<const CodeCache::Key *, const CodeCache::Entry *>> CodeCache::findByHead(addr_t pc)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::pair<const Key *, const Entry *>> found {};
+    auto [first, last] = by_head.equal_range(pc);
+    for(auto it = first; it != last; ++it)
+    {
+        found.push_back(it->second);
+    }
+    return found;
+}
+
+const CodeCache::Entry *CodeCache::insert(Key key, Entry entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    //try_emplace leaves entry alone if the key is taken
+    auto [it, inserted] = entries.try_emplace(std::move(key), std::move(entry));
+    if(!inserted)
+    {
+        rt.release(entry.code);
+    }
+    else
+    {
+        by_head.emplace(it->first[KEY_HEAD_PC], std::make_pair(&it->first, &it->second));
+    }
+    return &it->second;
+}
+
+asmjit::Error CodeCache::add(block_func_t *code, asmjit::CodeHolder *holder)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return rt.add(code, holder);
+}
+
+std::size_t CodeCache::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+uint64_t CodeCache::hashFile(const char *filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    uint64_t hash = FNV_OFFSET;
+    char buf[1 << 16];
+    while(in.read(buf, sizeof(buf)) || in.gcount())
+    {
+        hash = fnv1a(hash, reinterpret_cast<const uint8_t *>(buf), in.gcount());
+    }
+    return hash;
+}
+
+uint64_t CodeCache::featuresHash() const noexcept
+{
+    const asmjit::CpuFeatures &features = rt.cpuFeatures();
+    const asmjit::Environment &env = rt.environment();
+    uint64_t hash = fnv1a(FNV_OFFSET, reinterpret_cast<const uint8_t *>(&features), sizeof(features));
+    return fnv1a(hash, reinterpret_cast<const uint8_t *>(&env), sizeof(env));
+}
+
+// File layout, host byte order:
+//   header, then per entry: key length, exit count, code size, key words,
+//   exit targets, code bytes.
+// Translated code has no relocations (it reaches guest state, memory, exit
+// slots and the clock through its arguments only), so its bytes run at any
+// address. Traced code calls the recorder directly and is not saved.
+struct CacheFileHeader
+{
+    char magic[8];
+    uint64_t features_hash;
+    uint64_t image_hash;
+    uint32_t count;
+};
+
+static const char CACHE_MAGIC[8] = {'R', 'V', '3', '2', 'J', 'I', 'T', '4'};
+
+template<typename T>
+static bool readValue(std::istream &in, T &value)
+{
+    return bool(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+// Counts the rest of the file up to end cannot hold come from a corrupt
+// file, they are refused before anything is allocated for them
+template<typename T>
+static bool readArray(std::istream &in, std::vector<T> &values, uint32_t count, std::streamoff end)
+{
+    const std::streamoff pos = in.tellg();
+    if(pos < 0 || uint64_t(count) * sizeof(T) > uint64_t(end - pos))
+    {
+        return false;
+    }
+    values.resize(count);
+    return bool(in.read(reinterpret_cast<char *>(values.data()), count * sizeof(T)));
+}
+
+bool CodeCache::save(const std::string &path, uint64_t image_hash)
+{
+    //written aside and renamed so a concurrent run never sees half a file
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if(!out)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    CacheFileHeader header {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.features_hash = featuresHash();
+    header.image_hash = image_hash;
+    //traced code calls into this process, so it is not saved
+    header.count = std::count_if(entries.begin(), entries.end(), [](const auto &item) {return !(item.first[1] & KEY_TRACED);});
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    for(const auto &[key, entry] : entries)
+    {
+        if(key[1] & KEY_TRACED)
+        {
+            continue;
+        }
+        uint32_t sizes[3] = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(entry.exits.size()),
+                             static_cast<uint32_t>(entry.code_size)};
+        out.write(reinterpret_cast<const char *>(sizes), sizeof(sizes));
+        out.write(reinterpret_cast<const char *>(key.data()), key.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(entry.exits.data()), entry.exits.size() * sizeof(addr_t));
+        out.write(reinterpret_cast<const char *>(entry.code), entry.code_size);
+    }
+
+    out.close();
+    if(!out || std::rename(tmp_path.c_str(), path.c_str()))
+    {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::size_t CodeCache::load(const std::string &path, uint64_t image_hash)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    const std::streamoff end = in.tellg();
+    in.seekg(0);
+    CacheFileHeader header {};
+    if(!in || end < 0 || !readValue(in, header) || std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+       header.features_hash != featuresHash() || header.image_hash != image_hash)
+    {
+        return 0;
+    }
+
+    std::size_t loaded = 0;
+    for(uint32_t i = 0; i < header.count; ++i)
+    {
+        uint32_t sizes[3] {};
+        Key key {};
+        std::vector<addr_t> exits {};
+        std::vector<addr_t> expected {};
+        std::vector<uint8_t> bytes {};
+        if(!readValue(in, sizes) || sizes[0] <= KEY_HEAD_PC || !readArray(in, key, sizes[0], end) ||
+           !readArray(in, exits, sizes[1], end) || !readArray(in, bytes, sizes[2], end))
+        {
+            break;
+        }
+        //the code indexes its exit slots, chaining would run past a short table
+        if(!unitExits(key, expected) || exits != expected)
+        {
+            break;
+        }
+
+        asmjit::CodeHolder holder;
+        holder.init(environment(), cpuFeatures());
+        asmjit::x86::Assembler assembler(&holder);
+        assembler.embed(bytes.data(), bytes.size());
+
+        block_func_t code = nullptr;
+        if(add(&code, &holder))
+        {
+            break;
+        }
+        const addr_t head_pc = key[KEY_HEAD_PC];
+        const JitTier tier = static_cast<JitTier>(key[0]);
+        const Entry *entry = insert(std::move(key), Entry {code, bytes.size(), std::move(exits)});
+        //a unit compiled meanwhile keeps its key and this copy is freed
+        if(PerfJitLog::shared().enabled() && entry->code == code)
+        {
+            PerfJitLog::shared().codeLoaded(reinterpret_cast<const void *>(code), bytes.size(),
+                                            perfName(nullptr, head_pc, tier));
+        }
+        ++loaded;
+    }
+    return loaded;
+}
@@ -0,0 +1,66 @@
+#include "cpu.hpp"
+#include "perf.hpp"
+
+CompileQueue &CompileQueue::shared()
+{
+    static CompileQueue queue;
+    return queue;
+}
+
+//workers insert into the code cache and report to perf, so both have to
+//outlive the queue
+CompileQueue::CompileQueue() {CodeCache::shared(); PerfJitLog::shared();}
+
+CompileQueue::~CompileQueue()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for(std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void CompileQueue::submit(std::shared_ptr<CompileJob> job, unsigned nthreads)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(std::move(job));
+        while(workers.size() < nthreads)
+        {
+            workers.emplace_back(&CompileQueue::work, this);
+        }
+    }
+    ready.notify_one();
+}
+
+std::size_t CompileQueue::threads()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return workers.size();
+}
+
+void CompileQueue::work()
+{
+    while(true)
+    {
+        std::shared_ptr<CompileJob> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [this]() {return stopping || !jobs.empty();});
+            if(stopping)
+            {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        //the dispatcher only polls done, result is published by the release
+        compile(*job);
+        job->done.store(true, std::memory_order_release);
+    }
+}
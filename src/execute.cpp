@@ -1,353 +1,385 @@
 #include "rv32i.hpp"
 #include "cpu.hpp"
+#include <array>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
-#include <sys/types.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include <utility>
 #include <vector>
 
-void interpret_block(Cpu &cpu, std::vector<Instr> instrs)
+// Handlers of non-terminating instructions finish with a tail call into the
+// next instruction of the block, so a block runs as one chain of jumps. The
+// tail call has to be guaranteed at every optimization level, a plain call
+// would take a host stack frame per instruction. Compilers without musttail
+// get a dispatch loop instead: a handler leaves the next instruction behind
+// and returns, terminators leave nothing.
+#if defined(__clang__)
+#define RV32I_MUSTTAIL [[clang::musttail]]
+#elif defined(__GNUC__) && __GNUC__ >= 15
+#define RV32I_MUSTTAIL __attribute__((musttail))
+#endif
+
+#ifdef RV32I_MUSTTAIL
+#define DISPATCH_NEXT(cpu, instr) RV32I_MUSTTAIL return instr[1].exec(cpu, instr + 1)
+
+void interpret_block(Cpu &cpu, const Instr *instrs)
 {
-    for(auto instr : instrs)
+    instrs->exec(cpu, instrs);
+}
+#else
+static thread_local const Instr *next_instr = nullptr;
+
+#define DISPATCH_NEXT(cpu, instr) do { next_instr = instr + 1; return; } while(0)
+
+void interpret_block(Cpu &cpu, const Instr *instrs)
+{
+    for(const Instr *instr = instrs; instr != nullptr;)
     {
-        instr.exec(cpu, instr);
+        next_instr = nullptr;
+        instr->exec(cpu, instr);
+        instr = next_instr;
     }
 }
+#endif
+
+static void executeStop([[maybe_unused]] Cpu &cpu, [[maybe_unused]] const Instr *instr) {}
 
 void execute (Cpu &cpu, Instr &instr)
 {
-    instr.exec(cpu, instr);
+    Instr step[2] = {instr, Instr {}};
+    step[1].exec = executeStop;
+    interpret_block(cpu, step);
+}
+
+void executeIllegal(Cpu &cpu, [[maybe_unused]] const Instr *instr)
+{
+    std::cout << "Illegal instruction at 0x" << std::hex << cpu.getPc() << std::dec << std::endl;
+    cpu.setDone();
 }
 
-void executeImm (Cpu &cpu, Instr &instr)
+template<uint8_t F3, uint8_t F7>
+static inline reg_t alu(reg_t lhs, reg_t rhs)
 {
-    using namespace I::Imm;
-    switch (static_cast<funct3>(instr.funct3))
+    using funct3 = R::Op::funct3;
+    const uint32_t a = lhs;
+    const uint32_t b = rhs;
+    switch (static_cast<funct3>(F3))
     {
-        case funct3::ADDI:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) + instr.imm);
-                break;
-            }
-        case funct3::ANDI:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) & instr.imm);
-                break;
-            }
-        case funct3::ORI:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) | instr.imm);
-                break;
-            }
-        case funct3::XORI:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) ^ instr.imm);
-                break;
-            }
-        case funct3::SLTI:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) < instr.imm);
-                break;
-            }
-        case funct3::SLTIU:
-            {
-                cpu.setReg(instr.rd_id, static_cast<std::uint32_t>(cpu.getReg(instr.rs1_id)) < static_cast<std::uint32_t>(instr.imm));
-                break;
-            }
-        case funct3::SLLI:
-            {
-                instr.imm = instr.imm & 0b11111;
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) << instr.imm);
-                break;
-            }
-        case funct3::SRLI:
-            {
-                instr.imm = instr.imm & 0b11111;
-                //SRAI:
-                if (instr.imm >> 5)
-                {
-                    cpu.setReg(instr.rd_id, static_cast<std::uint32_t>(cpu.getReg(instr.rs1_id)) >> instr.imm);
-                }
-                //SRLI
-                else
-                {
-                    cpu.setReg(instr.rd_id, static_cast<std::uint32_t>(cpu.getReg(instr.rs1_id)) >> instr.imm);
-                }
-                break;
-            }
-        //TODO: THROW AN ERROR
-        default: {}
+        case funct3::ADD:  return F7 ? a - b : a + b;
+        case funct3::SLL:  return a << (b & 0b11111);
+        case funct3::SLT:  return lhs < rhs;
+        case funct3::SLTU: return a < b;
+        case funct3::XOR:  return a ^ b;
+        case funct3::SRL:  return F7 ? (lhs >> (b & 0b11111)) : static_cast<reg_t>(a >> (b & 0b11111));
+        case funct3::OR:   return a | b;
+        case funct3::AND:  return a & b;
+        default:           return 0;
     }
-    cpu.advancePc();
 }
 
-void executeOp (Cpu &cpu, Instr &instr)
+template<uint8_t F3>
+static inline bool branchTaken(reg_t lhs, reg_t rhs)
 {
-    using namespace R::Op;
-    switch ((funct3)instr.funct3)
+    using funct3 = B::Branch::funct3;
+    switch (static_cast<funct3>(F3))
     {
-        case funct3::ADD:
-            {
-                //SUB
-                if  (instr.funct7)
-                {
-                    cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) - cpu.getReg(instr.rs2_id));
-                }
-                //ADD
-                else
-                {
-                    cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) + cpu.getReg(instr.rs2_id));
-                }
-                break;
-            }
-        case funct3::AND:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) & cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::OR:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) | cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::XOR:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) ^ cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::SLT:
-            {
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) < cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::SLTU:
-            {
-                cpu.setReg(instr.rd_id, static_cast<uint32_t>(cpu.getReg(instr.rs1_id)) < static_cast<uint32_t>(cpu.getReg(instr.rs2_id)));
-                break;
-            }
-        case funct3::SLL:
-            {
-                //if SLTIU
-                instr.rs2_id = instr.rs2_id & 0b11111;
-                cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) << cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::SRL:
-            {
-                instr.rs2_id = instr.rs2_id & 0b11111;
-                //SRA
-                if (instr.funct7)
-                {
-                    cpu.setReg(instr.rd_id, cpu.getReg(instr.rs1_id) >> cpu.getReg(instr.rs2_id));
-                }
-                else
-                {
-                    cpu.setReg(instr.rd_id, static_cast<uint32_t>(cpu.getReg(instr.rs1_id)) >> cpu.getReg(instr.rs2_id));
-                }
-                break;
-            }
-        //TODO: THROW AND ERROR
-        default: {}
+        case funct3::BEQ:  return lhs == rhs;
+        case funct3::BNE:  return lhs != rhs;
+        case funct3::BLT:  return lhs < rhs;
+        case funct3::BGE:  return lhs >= rhs;
+        case funct3::BLTU: return static_cast<uint32_t>(lhs) < static_cast<uint32_t>(rhs);
+        case funct3::BGEU: return static_cast<uint32_t>(lhs) >= static_cast<uint32_t>(rhs);
+        default:           return false;
     }
-    cpu.advancePc();
 }
 
-void executeBranch (Cpu &cpu, Instr &instr)
+template<uint8_t F3> struct LoadType;
+template<> struct LoadType<static_cast<uint8_t>(I::Load::funct3::LB)>  {using type = byte_t;};
+template<> struct LoadType<static_cast<uint8_t>(I::Load::funct3::LH)>  {using type = half_t;};
+template<> struct LoadType<static_cast<uint8_t>(I::Load::funct3::LW)>  {using type = word_t;};
+template<> struct LoadType<static_cast<uint8_t>(I::Load::funct3::LBU)> {using type = uint8_t;};
+template<> struct LoadType<static_cast<uint8_t>(I::Load::funct3::LHU)> {using type = uint16_t;};
+
+template<uint8_t F3> struct StoreType;
+template<> struct StoreType<static_cast<uint8_t>(S::Store::funct3::SB)> {using type = byte_t;};
+template<> struct StoreType<static_cast<uint8_t>(S::Store::funct3::SH)> {using type = half_t;};
+template<> struct StoreType<static_cast<uint8_t>(S::Store::funct3::SW)> {using type = word_t;};
+
+template<Opcode OP, uint8_t F3, uint8_t F7>
+static constexpr bool isLegal()
 {
-    using namespace B::Branch;
-    switch ((funct3)instr.funct3)
+    switch (OP)
     {
-        case funct3::BEQ:
-            {
-                if (cpu.getReg(instr.rs1_id) == cpu.getReg(instr.rs2_id)) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
-        case funct3::BNE:
-            {
-                if (cpu.getReg(instr.rs1_id) != cpu.getReg(instr.rs2_id)) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
-        case funct3::BLT:
-            {
-                if (cpu.getReg(instr.rs1_id) < cpu.getReg(instr.rs2_id)) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
-        case funct3::BGE:
-            {
-                if (cpu.getReg(instr.rs1_id) > cpu.getReg(instr.rs2_id)) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
-        case funct3::BLTU:
-            {
-                if (static_cast<uint32_t>(cpu.getReg(instr.rs1_id)) < static_cast<uint32_t>(cpu.getReg(instr.rs2_id))) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
-        case funct3::BGEU:
-            {
-                if (static_cast<uint32_t>(cpu.getReg(instr.rs1_id)) > static_cast<uint32_t>(cpu.getReg(instr.rs2_id))) {cpu.advancePc(instr.imm);}
-                else {cpu.advancePc();}
-                return;
-            }
+        case Opcode::Imm:    return !F7 || F3 == static_cast<uint8_t>(I::Imm::funct3::SRLI);
+        case Opcode::Op:     return !F7 || F3 == static_cast<uint8_t>(R::Op::funct3::ADD) || F3 == static_cast<uint8_t>(R::Op::funct3::SRL);
+        case Opcode::Load:   return !F7 && F3 != 0b011 && F3 < 0b110;
+        case Opcode::Store:  return !F7 && F3 < 0b011;
+        case Opcode::Branch: return !F7 && F3 != 0b010 && F3 != 0b011;
+        case Opcode::System: return !F7 && F3 != 0b100;
+        default:             return !F7 && !F3;
     }
 }
 
-void executeLoad (Cpu &cpu, Instr &instr)
+// Handler specialized on everything decode knows about the instruction
+// except its register ids and immediate. RD0 handlers drop the result.
+// Tracer records what the instruction did, NoTrace handlers record nothing.
+template<typename Tracer, Opcode OP, uint8_t F3, uint8_t F7, bool RD0>
+static void executeSpecialized(Cpu &cpu, const Instr *instr)
 {
-    using namespace I::Load;
-    switch ((funct3)instr.funct3)
+    CpuState &state = cpu.getState();
+
+    if constexpr (!isLegal<OP, F3, F7>())
     {
-        case funct3::LB:
-            {
-                cpu.setReg(instr.rd_id, cpu.load<byte_t>(instr.imm + cpu.getReg(instr.rs1_id)));
-                break;
-            }
-        case funct3::LH:
-            {
-                cpu.setReg(instr.rd_id, cpu.load<half_t>(instr.imm + cpu.getReg(instr.rs1_id)));
-                break;
-            }
-        case funct3::LW:
+        executeIllegal(cpu, instr);
+        return;
+    }
+    else if constexpr (OP == Opcode::Imm || OP == Opcode::Op)
+    {
+        if constexpr (!RD0)
+        {
+            const reg_t rhs = (OP == Opcode::Imm) ? instr->imm : state.regs[instr->rs2_id];
+            state.regs[instr->rd_id] = alu<F3, F7>(state.regs[instr->rs1_id], rhs);
+            Tracer::regWrite(state.pc, instr->rd_id, state.regs[instr->rd_id]);
+        }
+        cpu.advancePc();
+        DISPATCH_NEXT(cpu, instr);
+    }
+    else if constexpr (OP == Opcode::Load)
+    {
+        if constexpr (!RD0)
+        {
+            using Load_t = typename LoadType<F3>::type;
+            const addr_t addr = state.regs[instr->rs1_id] + instr->imm;
+            state.regs[instr->rd_id] = cpu.load<Load_t>(addr);
+            Tracer::memRead(state.pc, addr, state.regs[instr->rd_id], sizeof(Load_t));
+            Tracer::regWrite(state.pc, instr->rd_id, state.regs[instr->rd_id]);
+        }
+        cpu.advancePc();
+        DISPATCH_NEXT(cpu, instr);
+    }
+    else if constexpr (OP == Opcode::Store)
+    {
+        using Store_t = typename StoreType<F3>::type;
+        const addr_t addr = state.regs[instr->rs1_id] + instr->imm;
+        cpu.store<Store_t>(addr, state.regs[instr->rs2_id]);
+        Tracer::memWrite(state.pc, addr, state.regs[instr->rs2_id], sizeof(Store_t));
+        cpu.advancePc();
+        DISPATCH_NEXT(cpu, instr);
+    }
+    else if constexpr (OP == Opcode::Lui || OP == Opcode::Auipc)
+    {
+        if constexpr (!RD0)
+        {
+            const uint32_t upper = static_cast<uint32_t>(instr->imm) << 12;
+            state.regs[instr->rd_id] = (OP == Opcode::Lui) ? upper : upper + state.pc;
+            Tracer::regWrite(state.pc, instr->rd_id, state.regs[instr->rd_id]);
+        }
+        cpu.advancePc();
+        DISPATCH_NEXT(cpu, instr);
+    }
+    else if constexpr (OP == Opcode::Fence)
+    {
+        cpu.advancePc();
+        DISPATCH_NEXT(cpu, instr);
+    }
+    else if constexpr (OP == Opcode::Branch)
+    {
+        const bool taken = branchTaken<F3>(state.regs[instr->rs1_id], state.regs[instr->rs2_id]);
+        state.pc += taken ? instr->imm : static_cast<imm_t>(RV32I_INTR_SIZE);
+    }
+    else if constexpr (OP == Opcode::Jal)
+    {
+        if constexpr (!RD0)
+        {
+            state.regs[instr->rd_id] = state.pc + RV32I_INTR_SIZE;
+            Tracer::regWrite(state.pc, instr->rd_id, state.regs[instr->rd_id]);
+            if(cpu.profiler && isLinkReg(instr->rd_id))
             {
-                cpu.setReg(instr.rd_id, cpu.load<word_t>(instr.imm + cpu.getReg(instr.rs1_id)));
-                break;
+                pushCall(state, state.pc + RV32I_INTR_SIZE);
             }
-        case funct3::LBU:
+        }
+        state.pc += instr->imm;
+    }
+    else if constexpr (OP == Opcode::Jalr)
+    {
+        //target is computed first as rd may be the same register as rs1
+        const reg_t target = (state.regs[instr->rs1_id] + instr->imm) & 0xfffffffe; //least-significant bit to zero
+        if(cpu.profiler && isLinkReg(instr->rs1_id) && instr->rs1_id != instr->rd_id)
+        {
+            popCall(state);
+        }
+        if constexpr (!RD0)
+        {
+            state.regs[instr->rd_id] = state.pc + RV32I_INTR_SIZE;
+            Tracer::regWrite(state.pc, instr->rd_id, state.regs[instr->rd_id]);
+            if(cpu.profiler && isLinkReg(instr->rd_id))
             {
-                cpu.setReg(instr.rd_id, (0x000000ff & cpu.load<byte_t>(instr.imm + cpu.getReg(instr.rs1_id))));
-                break;
+                pushCall(state, state.pc + RV32I_INTR_SIZE);
             }
-        case funct3::LHU:
+        }
+        state.pc = target;
+    }
+    else if constexpr (OP == Opcode::System)
+    {
+        const addr_t pc = state.pc;
+        const reg_t nr = state.regs[17];
+        executeSystem(cpu, *instr);
+        if constexpr (F3 != 0)
+        {
+            if constexpr (!RD0)
             {
-                cpu.setReg(instr.rd_id, (0x0000ffff & cpu.load<half_t>(instr.imm + cpu.getReg(instr.rs1_id))));
-                break;
+                Tracer::regWrite(pc, instr->rd_id, state.regs[instr->rd_id]);
             }
+        }
+        else if(!instr->imm)
+        {
+            Tracer::syscall(pc, nr, state.regs[10]);
+        }
     }
-    cpu.advancePc();
 }
 
-//TODO: CONST
-//TODO: CLANG FORMAT
-void executeStore (Cpu &cpu, Instr &instr)
+// Handler table of one opcode, indexed by funct3 | funct7 << 3 | (rd == x0) << 4
+using HandlerTable = std::array<Instr::exec_t, 32>;
+
+template<typename Tracer, Opcode OP, std::size_t... Idx>
+static constexpr HandlerTable makeHandlers(std::index_sequence<Idx...>)
+{
+    return {{(isLegal<OP, Idx & 0b111, (Idx >> 3) & 1>() ? &executeSpecialized<Tracer, OP, Idx & 0b111, (Idx >> 3) & 1, ((Idx >> 4) & 1) != 0>
+                                                        : &executeIllegal)...}};
+}
+
+template<typename Tracer, Opcode OP>
+static constexpr HandlerTable handlers = makeHandlers<Tracer, OP>(std::make_index_sequence<32>{});
+
+template<typename Tracer>
+static constexpr Instr::exec_t handlerOf(Opcode opcode, std::size_t idx)
 {
-    using namespace S::Store;
-    switch ((funct3)instr.funct3)
+    switch (opcode)
     {
-        case funct3::SB:
-            {
-                cpu.store<byte_t>((addr_t)(instr.imm + cpu.getReg(instr.rs1_id)), cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::SH:
-            {
-                cpu.store<half_t>((addr_t)(instr.imm + cpu.getReg(instr.rs1_id)), cpu.getReg(instr.rs2_id));
-                break;
-            }
-        case funct3::SW:
-            {
-                cpu.store<word_t>((addr_t)(instr.imm + cpu.getReg(instr.rs1_id)), cpu.getReg(instr.rs2_id));
-                break;
-            }
+        case Opcode::Imm:    return handlers<Tracer, Opcode::Imm>[idx];
+        case Opcode::Op:     return handlers<Tracer, Opcode::Op>[idx];
+        case Opcode::Load:   return handlers<Tracer, Opcode::Load>[idx];
+        case Opcode::Store:  return handlers<Tracer, Opcode::Store>[idx];
+        case Opcode::Branch: return handlers<Tracer, Opcode::Branch>[idx];
+        case Opcode::Lui:    return handlers<Tracer, Opcode::Lui>[idx];
+        case Opcode::Auipc:  return handlers<Tracer, Opcode::Auipc>[idx];
+        case Opcode::Jal:    return handlers<Tracer, Opcode::Jal>[idx];
+        case Opcode::Jalr:   return handlers<Tracer, Opcode::Jalr>[idx];
+        case Opcode::Fence:  return handlers<Tracer, Opcode::Fence>[idx];
+        case Opcode::System: return handlers<Tracer, Opcode::System>[idx];
+        default:             return executeIllegal;
     }
-    cpu.advancePc();
 }
 
-void executeLui(Cpu &cpu, Instr &instr)
+// Fields and immediate layout of each format
+static constexpr uint32_t RD = 0x1f << 7, RS1 = 0x1f << 15, RS2 = 0x1f << 20, F3 = 0b111 << 12, F7 = 1u << 30;
+
+static constexpr DecodeEntry layoutOf(Opcode opcode, uint8_t funct3)
 {
-    cpu.setReg(instr.rd_id, (instr.imm << 12));
-    cpu.advancePc();
+    switch (opcode)
+    {
+        case Opcode::Imm:
+            {
+                //only shifts carry funct7, the rest have immediate bits there
+                const bool shift = funct3 == static_cast<uint8_t>(I::Imm::funct3::SLLI) ||
+                                   funct3 == static_cast<uint8_t>(I::Imm::funct3::SRLI);
+                return {nullptr, RD | RS1 | F3 | (shift ? F7 : 0), DecodeEntry::IImm};
+            }
+        case Opcode::Op:     return {nullptr, RD | RS1 | RS2 | F3 | F7, DecodeEntry::NoImm};
+        case Opcode::Load:   return {nullptr, RD | RS1 | F3, DecodeEntry::IImm};
+        case Opcode::Store:  return {nullptr, RS1 | RS2 | F3, DecodeEntry::SImm};
+        case Opcode::Branch: return {nullptr, RS1 | RS2 | F3, DecodeEntry::BImm};
+        case Opcode::Lui:
+        case Opcode::Auipc:  return {nullptr, RD, DecodeEntry::UImm};
+        case Opcode::Jal:    return {nullptr, RD, DecodeEntry::JImm};
+        case Opcode::Jalr:   return {nullptr, RD | RS1 | F3, DecodeEntry::IImm};
+        case Opcode::System: return {nullptr, RD | RS1 | F3, DecodeEntry::IImm};
+        case Opcode::Fence:
+        default:             return {nullptr, 0, DecodeEntry::NoImm};
+    }
 }
 
-void executeAuipc(Cpu &cpu, Instr &instr)
+template<typename Tracer>
+static constexpr DecodeTable makeDecodeTable()
 {
-    cpu.setReg(instr.rd_id, cpu.getPc() + (instr.imm << 12));
-    cpu.advancePc();
+    DecodeTable table {};
+    for(std::size_t idx = 0; idx < DECODE_TABLE_SIZE; ++idx)
+    {
+        const Opcode opcode = static_cast<Opcode>((idx >> 5) << 2 | 0b11);
+        const uint8_t funct3 = (idx >> 2) & 0b111;
+        DecodeEntry entry = layoutOf(opcode, funct3);
+        //the handler sees what decode stores: absent fields are zero
+        const std::size_t handler = ((entry.fields & F3) ? funct3 : 0) |
+                                    ((entry.fields & F7) ? ((idx >> 1) & 1) << 3 : 0) |
+                                    ((entry.fields & RD) ? (idx & 1) << 4 : 1 << 4);
+        entry.exec = handlerOf<Tracer>(opcode, handler);
+        table[idx] = entry;
+    }
+    return table;
 }
 
-void executeJalr(Cpu &cpu, Instr &instr)
+constexpr DecodeTable decode_table = makeDecodeTable<NoTrace>();
+#ifdef RV32I_TRACING
+constexpr DecodeTable traced_decode_table = makeDecodeTable<RingTrace>();
+#endif
+
+uint64_t csrTime() noexcept
 {
-    cpu.setReg(instr.rd_id, cpu.getPc() + instr.size);
-    imm_t target_addr = (cpu.getReg(instr.rs1_id) + instr.imm) & 0xfffffffe; //least-significant bit to zero
-    cpu.setPc(target_addr);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void executeJal(Cpu &cpu, Instr &instr)
+bool csrReadOnly(const Instr &instr) noexcept
 {
-    cpu.setReg(instr.rd_id, cpu.getPc() + instr.size);
-    cpu.advancePc(instr.imm);
+    using I::System::funct3;
+    const funct3 op = static_cast<funct3>(instr.funct3);
+    return op != funct3::CSRRW && op != funct3::CSRRWI && instr.rs1_id == 0;
 }
-void executeSystem(Cpu &cpu,[[maybe_unused]] Instr &instr)
+
+bool readCsr(const CpuState &state, uint32_t csr, uint32_t &value) noexcept
 {
+    using namespace I::System;
+    uint64_t counter = 0;
+    switch (csr)
+    {
+        case Csr::CYCLE:
+        case Csr::CYCLEH:
+        case Csr::INSTRET:
+        case Csr::INSTRETH:
+            //the reading instruction was counted with its block
+            counter = state.instret - 1;
+            break;
+        case Csr::TIME:
+        case Csr::TIMEH:
+            counter = state.clock();
+            break;
+        default:
+            return false;
+    }
+    value = (csr & 0x80) ? counter >> 32 : counter;
+    return true;
+}
+
+void executeSystem(Cpu &cpu, const Instr &instr)
+{
+    //CSRs are read-only counters, so only reads are legal
+    if(instr.funct3)
+    {
+        uint32_t value = 0;
+        if(!csrReadOnly(instr) || !readCsr(cpu.getState(), instr.imm & 0xfff, value))
+        {
+            executeIllegal(cpu, &instr);
+            return;
+        }
+        cpu.setReg(instr.rd_id, value);
+    }
     //EBREAK
-    if(instr.imm) {cpu.setDone();}
+    else if(instr.imm) {cpu.setDone();}
     //ECALL
     else
     {
-        switch (static_cast<Syscall::rv>(cpu.getReg(17)))
-        {
-            case Syscall::rv::READ:
-            {
-                int fd = cpu.getReg(10);
-                size_t buf_size = cpu.getReg(12);
-                addr_t start_buf = cpu.getReg(11);
-                std::vector<byte_t> buf = {};
-                buf.reserve(buf_size);
-                ssize_t ret_val = read(fd, static_cast<void *>(buf.data()), buf_size);
-                for(int i = 0; i < buf_size; i++)
-                {
-                    cpu.store<byte_t>(start_buf + i * sizeof(byte_t), buf[i]);
-                }
-                cpu.setReg(1, ret_val);
-                break;
-            }
-            case Syscall::rv::WRITE:
-            {
-                size_t buf_size = cpu.getReg(12);
-                addr_t start_buf = cpu.getReg(11);
-                std::vector<byte_t> buf = {};
-                for(int i = 0; i < buf_size; i++)
-                {
-                    buf.push_back(cpu.load<byte_t>(start_buf + i * sizeof(byte_t)));
-                }
-                ssize_t ret_val = write(cpu.getReg(10), static_cast<void *>(buf.data()), buf_size);
-                cpu.setReg(1, ret_val);
-                break;
-            }
-            case Syscall::rv::EXIT:
-            {
-                cpu.setDone();
-                break;
-            }
-            case Syscall::rv::MMAP:
-            {
-
-            }
-            case Syscall::rv::CLOSE:
-            {
-                int fd = cpu.getReg(10);
-                int ret_val = close(fd);
-                cpu.setReg(1, ret_val);
-                break;
-            }
-            case Syscall::rv::LSEEK:
-            {
-                int fd = cpu.getReg(10);
-                __off_t offset = cpu.getReg(11);
-                int whence = cpu.getReg(12);
-                int ret_val = lseek(fd, offset, whence);
-                cpu.setReg(1, ret_val);
-                break;
-            }
-            default: {}
-        }
+        cpu.setReg(10, doSyscall(cpu));
     }
     cpu.advancePc();
 }
 
-void executeFence([[maybe_unused]] Cpu &cpu,[[maybe_unused]] Instr &instr) {}
 
@@ -1,21 +1,116 @@
 #include "io.hpp"
+#include "profiler.hpp"
 #include "rv32i.hpp"
+#include <algorithm>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <ucontext.h>
+#include <unistd.h>
 #include <elfio/elfio.hpp>
 #include <elfio/elf_types.hpp>
 #include <elfio/elfio_segment.hpp>
+#include <elfio/elfio_symbols.hpp>
 
-void write_to_mem(Cpu &cpu, int Ninstr, const char *data_ptr, addr_t entry)
+void write_to_mem(Cpu &cpu, addr_t addr, const char *data, std::size_t size)
 {
-    for (int j = 0; j < Ninstr; ++j)
+    std::memcpy(cpu.getMemBase() + addr, data, size);
+}
+
+// Commits the pages of a PT_LOAD segment, maps its file part copy-on-write
+// at its virtual address and zeroes the bss tail of its last file page, the
+// rest of the bss is untouched zero memory. Segments that are not congruent
+// to the file modulo the page size or share a page with the previous one are
+// copied.
+static bool load_segment(Cpu &cpu, int fd, const ELFIO::segment &seg, addr_t &mapped_end)
+{
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+    const addr_t vaddr = seg.get_virtual_address();
+    const std::size_t offset = seg.get_offset();
+    const std::size_t filesz = seg.get_file_size();
+    const std::size_t memsz = seg.get_memory_size();
+
+    if(vaddr + static_cast<uint64_t>(memsz) > cpu.getMemSize() || filesz > memsz)
+    {
+        std::cout << "Segment at 0x" << std::hex << vaddr << std::dec << " does not fit into guest memory" << std::endl;
+        return false;
+    }
+    if(!cpu.commit(vaddr, memsz))
+    {
+        std::cout << "Failed to map segment at 0x" << std::hex << vaddr << std::dec << std::endl;
+        return false;
+    }
+    if(!filesz)
+    {
+        return true;
+    }
+
+    const addr_t map_start = vaddr & ~(page - 1);
+    const std::size_t map_offset = offset - (vaddr - map_start);
+    const std::size_t map_len = (vaddr - map_start + filesz + page - 1) & ~(page - 1);
+    const bool congruent = (vaddr & (page - 1)) == (offset & (page - 1));
+
+    if(!congruent || map_start < mapped_end || !cpu.mapFile(map_start, fd, map_offset, map_len))
+    {
+        std::vector<char> buf(filesz);
+        if(pread(fd, buf.data(), filesz, offset) != static_cast<ssize_t>(filesz))
+        {
+            std::cout << "Failed to read segment at 0x" << std::hex << vaddr << std::dec << std::endl;
+            return false;
+        }
+        write_to_mem(cpu, vaddr, buf.data(), filesz);
+    }
+
+    const addr_t file_end = vaddr + filesz;
+    const addr_t page_end = (file_end + page - 1) & ~(page - 1);
+    if(memsz > filesz && page_end > file_end)
+    {
+        std::memset(cpu.getMemBase() + file_end, 0, std::min<std::size_t>(memsz - filesz, page_end - file_end));
+    }
+    mapped_end = std::max(mapped_end, page_end);
+    return true;
+}
+
+// Function and untyped (assembly label) symbols, used to name guest code.
+// Functions in an executable segment are also entry points for translation
+// ahead of time, labels may as well name data.
+static void load_symbols(const ELFIO::elfio &reader, GuestSymbols &symbols, GuestImage &image)
+{
+    for(ELFIO::section *sec : reader.sections)
     {
-        cpu.store<addr_t>(entry + j * sizeof(addr_t), *(reinterpret_cast<const reg_t *>(data_ptr + j * sizeof(reg_t))));
+        if(sec->get_type() != ELFIO::SHT_SYMTAB)
+        {
+            continue;
+        }
+        ELFIO::symbol_section_accessor accessor(reader, sec);
+        for(ELFIO::Elf_Xword i = 0; i < accessor.get_symbols_num(); ++i)
+        {
+            std::string name;
+            ELFIO::Elf64_Addr value = 0;
+            ELFIO::Elf_Xword size = 0;
+            unsigned char bind = 0, type = 0, other = 0;
+            ELFIO::Elf_Half section = 0;
+            if(accessor.get_symbol(i, name, value, size, bind, type, section, other) && !name.empty() &&
+               section != ELFIO::SHN_UNDEF && (type == ELFIO::STT_FUNC || type == ELFIO::STT_NOTYPE))
+            {
+                if(type == ELFIO::STT_FUNC && image.inText(value, RV32I_INTR_SIZE))
+                {
+                    image.entries.push_back(value);
+                }
+                symbols.add(value, std::move(name));
+            }
+        }
     }
+    symbols.sort();
 }
 
 int elfio_manager(const char *filename, Cpu &cpu)
 {
+    //lazy: segment data is mapped from the file, not read by ELFIO
     ELFIO::elfio reader;
-    if(!reader.load(filename))
+    if(!reader.load(filename, true))
     {
         std::cout << "Can't find or process ELF file " << filename << std::endl;
         return 1;
@@ -31,67 +126,348 @@ int elfio_manager(const char *filename, Cpu &cpu)
         return 1;
     }
 
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        std::cout << "Can't open ELF file " << filename << std::endl;
+        return 1;
+    }
+
+    addr_t mapped_end = 0;
+    uint64_t image_end = 0;
     ELFIO::Elf_Half seg_num = reader.segments.size();
-    ELFIO::Elf64_Addr entry_point = reader.get_entry();
+    for(int i = 0; i < seg_num; i++)
+    {
+        const ELFIO::segment *seg = reader.segments[i];
+        if(seg->get_type() != ELFIO::PT_LOAD)
+        {
+            continue;
+        }
+        if(!load_segment(cpu, fd, *seg, mapped_end))
+        {
+            close(fd);
+            return 1;
+        }
+        image_end = std::max<uint64_t>(image_end, seg->get_virtual_address() + seg->get_memory_size());
+        if(seg->get_flags() & ELFIO::PF_X)
+        {
+            cpu.image.text.emplace_back(seg->get_virtual_address(), seg->get_virtual_address() + seg->get_file_size());
+        }
+    }
+    //mappings keep their own reference to the file
+    close(fd);
 
-    addr_t seg_offset = reader.get_segments_offset();
-    addr_t seg_header_size = reader.get_segment_entry_size();
-    addr_t code_start_offset = seg_offset + seg_num * seg_header_size;
+    //the heap starts on the page after the image
+    cpu.sys.brk_start = cpu.sys.brk = (image_end + 0xfff) & ~uint64_t(0xfff);
+    //an image reaching past MMAP_TOP gets its mappings below the stack, or
+    //none if it reaches past that too
+    if(cpu.sys.mmap_top < cpu.sys.brk_start)
+    {
+        cpu.sys.mmap_top = std::max(Cpu::stackBottom(), cpu.sys.brk_start);
+    }
+    cpu.image.entries.push_back(reader.get_entry());
+    load_symbols(reader, cpu.symbols, cpu.image);
+    cpu.setPc(reader.get_entry());
+    return 0;
+}
 
-    int Ninstr = 0;
+void setup_stack(Cpu &cpu, const std::vector<std::string> &argv)
+{
+    addr_t sp = cpu.getReg(2);
+    std::vector<addr_t> argv_ptrs {};
+    for(const std::string &arg : argv)
+    {
+        sp -= arg.size() + 1;
+        write_to_mem(cpu, sp, arg.c_str(), arg.size() + 1);
+        argv_ptrs.push_back(sp);
+    }
 
-    for(int i = 0; i < seg_num; i++)
+    //argc, argv[], NULL, envp NULL, AT_NULL auxv entry
+    const std::size_t nwords = 1 + argv_ptrs.size() + 1 + 1 + 2;
+    sp = (sp - nwords * sizeof(word_t)) & ~addr_t(0xf);
+
+    addr_t cur = sp;
+    cpu.store<word_t>(cur, argv_ptrs.size());
+    for(addr_t ptr : argv_ptrs)
     {
-        const ELFIO::segment *seg = reader.segments[i];
-        if(seg->get_type() == ELFIO::PT_LOAD && seg->get_flags() == (ELFIO::PF_X | ELFIO::PF_R))
+        cur += sizeof(word_t);
+        cpu.store<word_t>(cur, ptr);
+    }
+    for(int i = 0; i < 4; ++i)
+    {
+        cur += sizeof(word_t);
+        cpu.store<word_t>(cur, 0);
+    }
+
+    cpu.setReg(2, sp);
+    cpu.setReg(10, argv_ptrs.size());
+    cpu.setReg(11, sp + sizeof(word_t));
+}
+
+JitTier wantedTier(const TierPolicy &policy, const BlockDescriptor &block)
+{
+    //ECALL/EBREAK and illegal instructions are left to the interpreter, so is
+    //a block starting with one
+    if(block.instrs.front().opcode == Opcode::System || block.instrs.front().exec == executeIllegal)
+    {
+        return JitTier::None;
+    }
+
+    switch (policy.mode)
+    {
+        case TierMode::InterpOnly:
+            return JitTier::None;
+        case TierMode::JitOnly:
+            return block.exec_count >= policy.opt_threshold ? JitTier::Optimized : JitTier::Baseline;
+        case TierMode::Tiered:
+        default:
+            if(block.exec_count >= policy.opt_threshold) {return JitTier::Optimized;}
+            if(block.exec_count >= policy.jit_threshold) {return JitTier::Baseline;}
+            return JitTier::None;
+    }
+}
+
+// Edge profile used to lay out traces: counts exits that did not fall
+// through the terminating branch. A trace unit leaves through the side
+// exits of its member blocks as well, which say nothing about the branch
+// of its head, and its head is already laid out.
+static void profileExit(BlockDescriptor &block, addr_t next_pc)
+{
+    if(block.tier < JitTier::Optimized && next_pc != block.pc + block.instrs.size() * RV32I_INTR_SIZE)
+    {
+        ++block.taken_count;
+    }
+}
+
+// Called at a block boundary once instret reached sample_at
+static void takeSample(Cpu &cpu)
+{
+    if(cpu.profiler)
+    {
+        cpu.profiler->sample(cpu);
+    }
+    else
+    {
+        cpu.getState().sample_at.store(UINT64_MAX, std::memory_order_relaxed);
+    }
+}
+
+// Runs translated code and keeps following patched exits without going
+// back to the block lookup. An exit through a not yet patched static edge is
+// linked here if its successor has been translated in the meantime. Blocks
+// due for a higher tier or with finished background code are handed back to
+// run_simulation.
+static void run_translated(Cpu &cpu, BlockDescriptor *block)
+{
+    CpuState *state = &cpu.getState();
+    mem_t *mem = cpu.getMemBase();
+    const TierPolicy &policy = cpu.tier_policy;
+    const uint64_t instret = state->instret;
+
+    while(true)
+    {
+        BlockLink *exit = block->native(state, mem, block->links);
+        if(!exit)
         {
-            Ninstr = (seg->get_file_size() - code_start_offset) / sizeof(addr_t);
-            addr_t main_entry_offset = entry_point - seg->get_virtual_address() - code_start_offset;
-            const char *start = seg->get_data() + code_start_offset;
+            break;
+        }
+        profileExit(*block, exit->target);
+        if(state->instret >= state->sample_at.load(std::memory_order_relaxed))
+        {
+            takeSample(cpu);
+        }
 
-            cpu.setPc(main_entry_offset);
+        BlockDescriptor *next = exit->next;
+        if(!next)
+        {
+            ++cpu.stats.lookups;
+            if(next = cpu.bb_table.find(exit->target); next && next->native)
+            {
+                ++cpu.stats.lookup_hits;
+                chainBlock(exit, *next);
+            }
+            break;
+        }
 
-            write_to_mem(cpu, Ninstr, start);
+        if(next->pending ? next->pending->done.load(std::memory_order_acquire) : wantedTier(policy, *next) > next->tier)
+        {
+            break;
         }
+        ++cpu.stats.chained_exits;
+        ++next->exec_count;
+        block = next;
     }
-
-    return 0;
+    cpu.stats.native_instrs += state->instret - instret;
 }
 
-int run_simulation(Cpu &cpu)
+// Dispatcher loop. Tracer records the interpreted blocks, translated code
+// records its own.
+template<typename Tracer>
+static int simulate(Cpu &cpu)
 {
     while(!cpu.isdone())
     {
-        if(auto basic_block= cpu.bb_translated.find(cpu.getPc()); basic_block != cpu.bb_translated.end())
+        if(cpu.getState().instret >= cpu.getState().sample_at.load(std::memory_order_relaxed))
         {
-            (basic_block->second)();
-            continue;
+            takeSample(cpu);
+        }
+
+        BlockDescriptor *block = cpu.bb_table.find(cpu.getPc());
+        ++cpu.stats.lookups;
+        if(block)
+        {
+            ++cpu.stats.lookup_hits;
         }
-        else if(cpu.bb_cache.count(cpu.getPc()))
+        else
         {
-            auto cache_block= cpu.bb_cache.find(cpu.getPc());
-            if(cache_block->second.size() >= BB_THRESHOLD)
+            if(cpu.getPc() & 0b11)
+            {
+                std::cout << "Instruction address misaligned 0x" << std::hex << cpu.getPc() << std::dec << std::endl;
+                return 1;
+            }
+            block = &lookup(cpu, cpu.getPc());
+            if(cpu.tier_policy.mode != TierMode::InterpOnly && block->instrs.front().opcode != Opcode::System)
             {
-                auto func = translate(cpu, cache_block->second);
-                if(func)
+                adoptCached(cpu, *block);
+            }
+        }
+
+        //while a worker compiles the block it keeps running at its old tier
+        bool translated = true;
+        if(block->pending)
+        {
+            if(block->pending->done.load(std::memory_order_acquire))
+            {
+                translated = finishTranslation(cpu, *block);
+                if(translated && cpu.bb_table.find(cpu.getPc()) != block)
                 {
-                    cpu.bb_translated.emplace(cpu.getPc(), func);
-                    func();
                     continue;
                 }
-                else
-                {
-                    std::cout << "TRNASLATION ERROR\n";
-                    return 1;
-                }
             }
-            //TODO: HANDLE AN ERROR
         }
-        auto instrs = lookup(cpu, cpu.getPc());
-        interpret_block (cpu, instrs);
+        else if(JitTier tier = wantedTier(cpu.tier_policy, *block); tier > block->tier)
+        {
+            translated = requestTranslation(cpu, *block, tier);
+        }
+        if(!translated)
+        {
+            std::cout << "TRNASLATION ERROR\n";
+            return 1;
+        }
+
+        ++block->exec_count;
+        if(block->native)
+        {
+            run_translated(cpu, block);
+        }
+        else
+        {
+            cpu.getState().instret += block->instrs.size();
+            cpu.stats.interp_instrs += block->instrs.size();
+            Tracer::block(block->pc);
+            interpret_block (cpu, block->instrs.begin());
+            profileExit(*block, cpu.getPc());
+        }
     }
 
     return 0;
 }
 
+// Guest run of this thread. A fault inside its guest memory jumps back to
+// run_simulation, which reports it and stops the Cpu.
+struct GuestRun
+{
+    const Cpu *cpu;
+    sigjmp_buf env;
+    addr_t addr;
+    bool store;
+};
+
+static thread_local GuestRun *volatile guest_run = nullptr;
+static struct sigaction prev_segv_action;
+static struct sigaction prev_bus_action;
 
+static void guestFaultHandler(int sig, siginfo_t *info, [[maybe_unused]] void *context)
+{
+    GuestRun *run = guest_run;
+    if(run && run->cpu->guestAddress(info->si_addr, run->addr))
+    {
+#if defined(__x86_64__) && defined(__linux__)
+        //bit 1 of the page fault error code is set by writes
+        run->store = static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_ERR] & 2;
+#endif
+        siglongjmp(run->env, 1);
+    }
+    //not a guest access: restore the previous action, the fault recurs on return
+    sigaction(sig, sig == SIGSEGV ? &prev_segv_action : &prev_bus_action, nullptr);
+}
+
+static void installFaultHandler()
+{
+    static std::once_flag installed;
+    std::call_once(installed, []
+    {
+        struct sigaction action {};
+        action.sa_sigaction = guestFaultHandler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &prev_segv_action);
+        sigaction(SIGBUS, &action, &prev_bus_action);
+    });
+}
+
+static int run_guest(Cpu &cpu)
+{
+#ifdef RV32I_TRACING
+    if(cpu.trace_ring)
+    {
+        TraceRing::current = cpu.trace_ring;
+        int status = simulate<RingTrace>(cpu);
+        TraceRing::current = nullptr;
+        return status;
+    }
+#endif
+    return simulate<NoTrace>(cpu);
+}
+
+// A guest access outside its committed memory faults in the host. The fault
+// leaves the run where it happened, the Cpu is done and cannot be resumed.
+int run_simulation(Cpu &cpu)
+{
+    installFaultHandler();
+    GuestRun run {&cpu, {}, 0, false};
+    if(sigsetjmp(run.env, 1))
+    {
+        guest_run = nullptr;
+#ifdef RV32I_TRACING
+        TraceRing::current = nullptr;
+#endif
+        std::cout << (run.store ? "Store" : "Load") << " access fault at 0x" << std::hex << run.addr << std::dec << std::endl;
+        cpu.setDone();
+        return 1;
+    }
+    guest_run = &run;
+    int status = run_guest(cpu);
+    guest_run = nullptr;
+    return status;
+}
+
+void write_stats(std::ostream &os, const JitStats &stats)
+{
+    const uint64_t instrs = stats.interp_instrs + stats.native_instrs;
+    os << "{\"blocks_decoded\": " << stats.blocks_decoded
+       << ", \"blocks_compiled\": " << stats.blocks_compiled
+       << ", \"blocks_adopted\": " << stats.blocks_adopted
+       << ", \"compile_ns\": " << stats.compile_ns
+       << ", \"mean_compile_ns\": " << (stats.blocks_compiled ? stats.compile_ns / stats.blocks_compiled : 0)
+       << ", \"max_compile_ns\": " << stats.max_compile_ns
+       << ", \"code_bytes\": " << stats.code_bytes
+       << ", \"lookups\": " << stats.lookups
+       << ", \"lookup_hit_rate\": " << (stats.lookups ? double(stats.lookup_hits) / stats.lookups : 0.0)
+       << ", \"chained_exits\": " << stats.chained_exits
+       << ", \"interp_instrs\": " << stats.interp_instrs
+       << ", \"native_instrs\": " << stats.native_instrs
+       << ", \"native_ratio\": " << (instrs ? double(stats.native_instrs) / instrs : 0.0)
+       << ", \"aot_blocks\": " << stats.aot_blocks
+       << ", \"aot_ns\": " << stats.aot_ns << "}";
+}
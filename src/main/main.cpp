@@ -1,23 +1,262 @@
 #include "io.hpp"
+#include "batch.hpp"
+#include "perf.hpp"
+#include "profiler.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
 #include <elfio/elfio.hpp>
 #include <elfio/elf_types.hpp>
 #include <elfio/elfio_segment.hpp>
 
+static void usage(const char *prog)
+{
+    std::cout << "Usage: " << prog << " [--tier=tiered|interp-only|jit-only]"
+              << " [--jit-threshold=N] [--opt-threshold=N] [--jit-threads=N]"
+              << " [--aot [--threads=N]] [--code-cache=<dir>] [--jit-log=<file>] [--stats=json]"
+              << " [--perf-map] [--jitdump[=<dir>]]"
+              << " [--profile=<file> [--profile-instrs=N | --profile-us=N]] [--trace=<file>]"
+              << " <elf> [guest args...]" << std::endl
+              << "       " << prog << " [options] --batch=<jobs file> [--threads=N]" << std::endl;
+}
+
+// Returns the value of --name=value or nullptr if arg is another option
+static const char *optValue(const char *arg, const char *name)
+{
+    size_t len = std::strlen(name);
+    return (!std::strncmp(arg, name, len) && arg[len] == '=') ? arg + len + 1 : nullptr;
+}
+
+static bool parseUint(const char *value, uint32_t &out)
+{
+    char *end = nullptr;
+    unsigned long n = std::strtoul(value, &end, 10);
+    if(!*value || *end || n > UINT32_MAX) {return false;}
+    out = static_cast<uint32_t>(n);
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
-    if(argc < 2)
+    TierPolicy policy {};
+    const char *elf = nullptr;
+    const char *batch = nullptr;
+    const char *cache_dir = nullptr;
+    const char *jit_log = nullptr;
+    bool stats = false;
+    bool aot = false;
+    const char *profile = nullptr;
+    Profiler::Clock profile_clock = Profiler::Clock::Instret;
+    uint32_t profile_period = 100000;
+    const char *trace = nullptr;
+    uint32_t nthreads = std::thread::hardware_concurrency();
+    std::vector<std::string> guest_argv {};
+
+    for(int i = 1; i < argc && !elf; ++i)
+    {
+        const char *arg = argv[i];
+        if(const char *value = optValue(arg, "--tier"))
+        {
+            if(!std::strcmp(value, "tiered")) {policy.mode = TierMode::Tiered;}
+            else if(!std::strcmp(value, "interp-only")) {policy.mode = TierMode::InterpOnly;}
+            else if(!std::strcmp(value, "jit-only")) {policy.mode = TierMode::JitOnly;}
+            else
+            {
+                std::cout << "Unknown tier mode " << value << std::endl;
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(const char *value = optValue(arg, "--jit-threshold"))
+        {
+            if(!parseUint(value, policy.jit_threshold)) {usage(argv[0]); return 1;}
+        }
+        else if(const char *value = optValue(arg, "--opt-threshold"))
+        {
+            if(!parseUint(value, policy.opt_threshold)) {usage(argv[0]); return 1;}
+        }
+        else if(const char *value = optValue(arg, "--jit-threads"))
+        {
+            if(!parseUint(value, policy.compile_threads)) {usage(argv[0]); return 1;}
+        }
+        else if(!std::strcmp(arg, "--aot"))
+        {
+            aot = true;
+        }
+        else if(const char *value = optValue(arg, "--code-cache"))
+        {
+            cache_dir = value;
+        }
+        else if(const char *value = optValue(arg, "--jit-log"))
+        {
+            jit_log = value;
+        }
+        else if(const char *value = optValue(arg, "--stats"))
+        {
+            if(std::strcmp(value, "json")) {usage(argv[0]); return 1;}
+            stats = true;
+        }
+        else if(!std::strcmp(arg, "--perf-map"))
+        {
+            if(!PerfJitLog::shared().openMap()) {std::cout << "Failed to open the perf map" << std::endl; return 1;}
+        }
+        else if(!std::strcmp(arg, "--jitdump") || optValue(arg, "--jitdump"))
+        {
+            const char *dir = optValue(arg, "--jitdump");
+            if(!PerfJitLog::shared().openJitdump(dir ? dir : "/tmp"))
+            {
+                std::cout << "Failed to open the jitdump file" << std::endl;
+                return 1;
+            }
+        }
+        else if(const char *value = optValue(arg, "--profile"))
+        {
+            profile = value;
+        }
+        else if(const char *value = optValue(arg, "--profile-instrs"))
+        {
+            profile_clock = Profiler::Clock::Instret;
+            if(!parseUint(value, profile_period) || !profile_period) {usage(argv[0]); return 1;}
+        }
+        else if(const char *value = optValue(arg, "--profile-us"))
+        {
+            profile_clock = Profiler::Clock::CpuTime;
+            if(!parseUint(value, profile_period) || !profile_period) {usage(argv[0]); return 1;}
+        }
+        else if(const char *value = optValue(arg, "--trace"))
+        {
+#ifdef RV32I_TRACING
+            trace = value;
+#else
+            std::cout << "Built without tracing, can't write " << value << std::endl;
+            return 1;
+#endif
+        }
+        else if(const char *value = optValue(arg, "--batch"))
+        {
+            batch = value;
+        }
+        else if(const char *value = optValue(arg, "--threads"))
+        {
+            if(!parseUint(value, nthreads) || !nthreads) {usage(argv[0]); return 1;}
+        }
+        else if(arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            //everything from the elf on is the guest's argv
+            elf = arg;
+            guest_argv.assign(argv + i, argv + argc);
+        }
+    }
+
+    if(batch)
+    {
+        //options of a single run have no meaning for a batch
+        const char *single_run = cache_dir ? "--code-cache" : jit_log ? "--jit-log" : stats ? "--stats" :
+                                 profile ? "--profile" : trace ? "--trace" : aot ? "--aot" : nullptr;
+        if(single_run)
+        {
+            std::cout << single_run << " can't be used with --batch" << std::endl;
+            return 1;
+        }
+        std::vector<BatchJob> jobs {};
+        if(elf || !parse_batch_file(batch, jobs))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        std::vector<JobResult> results = run_batch(jobs, nthreads, policy);
+        write_report(std::cout, jobs, results);
+        return 0;
+    }
+
+    if(!elf)
     {
         std::cout << "Too little arguments" << std::endl;
+        usage(argv[0]);
         return 1;
     }
 
     Memory mem{};
-    Cpu cpu(&mem);
-    if(elfio_manager(argv[1], cpu)) {return 1;}
+    Cpu cpu(&mem, 0, jit_log);
+    cpu.tier_policy = policy;
+    if(elfio_manager(elf, cpu)) {return 1;}
+    setup_stack(cpu, guest_argv);
+
+    //code translated by earlier runs of the same image on this host
+    std::string cache_file {};
+    uint64_t image_hash = 0;
+    if(cache_dir)
+    {
+        image_hash = CodeCache::hashFile(elf);
+        char name[64];
+        std::snprintf(name, sizeof(name), "/%016llx-%016llx.rv32jit", static_cast<unsigned long long>(image_hash),
+                      static_cast<unsigned long long>(cpu.code_cache->featuresHash()));
+        cache_file = std::string(cache_dir) + name;
+        cpu.code_cache->load(cache_file, image_hash);
+    }
+
+    std::unique_ptr<Profiler> profiler {};
+    if(profile)
+    {
+        profiler = std::make_unique<Profiler>(profile_clock, profile_period);
+        if(!profiler->start(cpu))
+        {
+            std::cout << "Failed to start the profiler" << std::endl;
+            return 1;
+        }
+    }
+
+    TraceWriter tracer {};
+    if(trace)
+    {
+        if(!tracer.open(trace))
+        {
+            std::cout << "Failed to open trace file " << trace << std::endl;
+            return 1;
+        }
+        cpu.trace_ring = tracer.newRing();
+    }
+
+    if(aot)
+    {
+        if(policy.mode == TierMode::InterpOnly)
+        {
+            std::cout << "--aot needs a translating tier mode" << std::endl;
+            return 1;
+        }
+        translateAhead(cpu, nthreads);
+    }
 
-    if(run_simulation(cpu)) {return 1;}
+    int status = run_simulation(cpu);
+    tracer.close();
+    if(profiler)
+    {
+        profiler->stop();
+        std::ofstream out(profile);
+        profiler->writeFolded(out, cpu.symbols);
+        if(!out) {std::cout << "Failed to write profile " << profile << std::endl;}
+    }
+    //on stderr, stdout belongs to the guest
+    if(stats)
+    {
+        write_stats(std::cerr, cpu.stats);
+        std::cerr << std::endl;
+    }
+    if(status) {return 1;}
+
+    if(cache_dir && !cpu.code_cache->save(cache_file, image_hash))
+    {
+        std::cout << "Failed to write code cache " << cache_file << std::endl;
+    }
 
     cpu.dump(std::cout);
     return 0;
 }
-
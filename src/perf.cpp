@@ -0,0 +1,142 @@
+#include "perf.hpp"
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+static const uint32_t JITDUMP_MAGIC = 0x4A695444;
+static const uint32_t JITDUMP_VERSION = 1;
+static const uint32_t JIT_CODE_LOAD = 0;
+static const uint32_t EM_X86_64_MACHINE = 62;
+
+struct JitdumpHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitdumpCodeLoad
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    //followed by the zero terminated name and the code bytes
+};
+
+static uint64_t monotonicNs()
+{
+    timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+PerfJitLog &PerfJitLog::shared()
+{
+    static PerfJitLog log;
+    return log;
+}
+
+PerfJitLog::~PerfJitLog()
+{
+    if(map) {fclose(map);}
+    if(marker) {munmap(marker, marker_size);}
+    if(dump) {fclose(dump);}
+}
+
+bool PerfJitLog::openMap()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if(!map)
+    {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        if(!(map = fopen(path.c_str(), "w")))
+        {
+            return false;
+        }
+    }
+    active.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+bool PerfJitLog::openJitdump(const char *dir)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if(dump)
+    {
+        return true;
+    }
+
+    std::string path = std::string(dir) + "/jit-" + std::to_string(getpid()) + ".dump";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+    if(fd < 0)
+    {
+        return false;
+    }
+    //perf record finds the file through this executable mapping of it
+    marker_size = sysconf(_SC_PAGESIZE);
+    marker = mmap(nullptr, marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if(marker == MAP_FAILED || !(dump = fdopen(fd, "wb")))
+    {
+        if(marker != MAP_FAILED) {munmap(marker, marker_size);}
+        marker = nullptr;
+        close(fd);
+        return false;
+    }
+
+    JitdumpHeader header {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitdumpHeader), EM_X86_64_MACHINE, 0,
+                          static_cast<uint32_t>(getpid()), monotonicNs(), 0};
+    fwrite(&header, sizeof(header), 1, dump);
+    fflush(dump);
+    active.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void PerfJitLog::codeLoaded(const void *code, std::size_t size, const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if(map)
+    {
+        fprintf(map, "%lx %zx %s\n", reinterpret_cast<unsigned long>(code), size, name.c_str());
+        fflush(map);
+    }
+    if(dump)
+    {
+        uint64_t addr = reinterpret_cast<uintptr_t>(code);
+        JitdumpCodeLoad record {JIT_CODE_LOAD, static_cast<uint32_t>(sizeof(JitdumpCodeLoad) + name.size() + 1 + size),
+                                monotonicNs(), static_cast<uint32_t>(getpid()), static_cast<uint32_t>(syscall(SYS_gettid)),
+                                addr, addr, size, code_index++};
+        fwrite(&record, sizeof(record), 1, dump);
+        fwrite(name.c_str(), name.size() + 1, 1, dump);
+        fwrite(code, size, 1, dump);
+        fflush(dump);
+    }
+}
+
+std::string perfName(const GuestSymbols *symbols, addr_t pc, JitTier tier)
+{
+    char buf[32];
+    std::string name = "guest:";
+    addr_t offset = 0;
+    if(const std::string *symbol = symbols ? symbols->nearest(pc, offset) : nullptr)
+    {
+        std::snprintf(buf, sizeof(buf), "+0x%x@", offset);
+        name += *symbol + buf;
+    }
+    std::snprintf(buf, sizeof(buf), "0x%08x/%s", pc, tier >= JitTier::Optimized ? "opt" : "base");
+    return name + buf;
+}
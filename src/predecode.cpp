@@ -0,0 +1,173 @@
+#include "cpu.hpp"
+#include "asmjit/core/cpuinfo.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+// The vector decoder writes whole Instr records: exec, then imm, opcode,
+// funct3 and the register halfword with rd in its low bits
+static_assert(sizeof(Instr) == 16 && offsetof(Instr, exec) == 0 && offsetof(Instr, imm) == 8 &&
+              offsetof(Instr, opcode) == 12 && offsetof(Instr, funct3) == 13, "predecode assumes the Instr layout");
+static_assert(sizeof(DecodeEntry) == 16 && offsetof(DecodeEntry, exec) == 0, "predecode gathers exec from decode_table");
+
+static void predecodeScalar(const instr_t *words, std::size_t count, Instr *out)
+{
+    for(std::size_t i = 0; i < count; ++i)
+    {
+        out[i] = decode(words[i]);
+    }
+}
+
+// decode_table fields with the immediate format in bits 2:0, which are
+// opcode bits and never a field
+static const std::array<uint32_t, DECODE_TABLE_SIZE> layouts = []
+{
+    std::array<uint32_t, DECODE_TABLE_SIZE> table {};
+    for(std::size_t idx = 0; idx < DECODE_TABLE_SIZE; ++idx)
+    {
+        table[idx] = decode_table[idx].fields | decode_table[idx].format;
+    }
+    return table;
+}();
+
+#define RV32I_AVX2 __attribute__((target("avx2")))
+
+RV32I_AVX2 static inline __m256i bits(__m256i v, uint32_t mask)
+{
+    return _mm256_and_si256(v, _mm256_set1_epi32(mask));
+}
+
+//all ones in the lanes whose layout has the immediate format
+RV32I_AVX2 static inline __m256i hasFormat(__m256i layout, DecodeEntry::Format format)
+{
+    return _mm256_cmpeq_epi32(bits(layout, 0b111), _mm256_set1_epi32(format));
+}
+
+//four Instr records from their first and second qwords
+RV32I_AVX2 static inline void store(Instr *dst, __m256i first, __m256i second)
+{
+    const __m256i even = _mm256_unpacklo_epi64(first, second);
+    const __m256i odd = _mm256_unpackhi_epi64(first, second);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_permute2x128_si256(even, odd, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 2), _mm256_permute2x128_si256(even, odd, 0x31));
+}
+
+RV32I_AVX2 static void predecodeAvx2(const instr_t *words, std::size_t count, Instr *out)
+{
+    const __m256i mask2 = _mm256_set1_epi32(0b11);
+    const __m256i mask3 = _mm256_set1_epi32(0b111);
+    const __m256i mask5 = _mm256_set1_epi32(0x1f);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+
+    std::size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + i));
+
+        //decodeIndex() of every lane
+        const __m256i full = _mm256_cmpeq_epi32(_mm256_and_si256(w, mask2), mask2);
+        const __m256i opcode = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(w, 2), mask5), _mm256_andnot_si256(full, mask5));
+        const __m256i funct3 = _mm256_and_si256(_mm256_srli_epi32(w, 12), mask3);
+        const __m256i rd0 = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srli_epi32(w, 7), mask5), zero), one);
+        __m256i idx = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(opcode, 5), _mm256_slli_epi32(funct3, 2)),
+                                      _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(w, 30), one), 1), rd0));
+        //OP and the OP-IMM shifts with reserved funct7 bits set are illegal
+        const __m256i full_funct7 = _mm256_or_si256(_mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(0b01100)),
+                                                    _mm256_and_si256(_mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(0b00100)),
+                                                                     _mm256_cmpeq_epi32(_mm256_and_si256(funct3, mask2), one)));
+        const __m256i reserved = _mm256_andnot_si256(_mm256_cmpeq_epi32(bits(w, FUNCT7_RESERVED), zero), full_funct7);
+        idx = _mm256_blendv_epi8(idx, _mm256_set1_epi32(ILLEGAL_DECODE_INDEX), reserved);
+
+        const __m256i layout = _mm256_i32gather_epi32(reinterpret_cast<const int *>(layouts.data()), idx, 4);
+        const __m256i fields = _mm256_and_si256(w, _mm256_andnot_si256(mask3, layout));
+
+        //every immediate format, then the one of the lane
+        const __m256i hi = _mm256_srai_epi32(w, 20);
+        const __m256i imm_i = hi;
+        const __m256i imm_s = _mm256_or_si256(bits(hi, 0xffffffe0), bits(_mm256_srli_epi32(w, 7), 0x1f));
+        const __m256i imm_b = _mm256_or_si256(_mm256_or_si256(bits(hi, 0xfffff000), bits(_mm256_slli_epi32(w, 4), 0x800)),
+                                              _mm256_or_si256(bits(hi, 0x7e0), bits(_mm256_srli_epi32(w, 7), 0x1e)));
+        const __m256i imm_u = _mm256_srli_epi32(w, 12);
+        const __m256i imm_j = _mm256_or_si256(_mm256_or_si256(bits(_mm256_srai_epi32(w, 12), 0xfff00000), bits(w, 0xff000)),
+                                              _mm256_or_si256(bits(_mm256_srli_epi32(w, 9), 0x800), bits(hi, 0x7fe)));
+        __m256i imm = _mm256_and_si256(imm_i, hasFormat(layout, DecodeEntry::IImm));
+        imm = _mm256_or_si256(imm, _mm256_and_si256(imm_s, hasFormat(layout, DecodeEntry::SImm)));
+        imm = _mm256_or_si256(imm, _mm256_and_si256(imm_b, hasFormat(layout, DecodeEntry::BImm)));
+        imm = _mm256_or_si256(imm, _mm256_and_si256(imm_u, hasFormat(layout, DecodeEntry::UImm)));
+        imm = _mm256_or_si256(imm, _mm256_and_si256(imm_j, hasFormat(layout, DecodeEntry::JImm)));
+
+        //opcode | funct3 << 8 | (rd | rs1 << 5 | rs2 << 10 | funct7 << 15) << 16
+        const __m256i regs = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(fields, 7), mask5),
+                                                             _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(fields, 15), mask5), 5)),
+                                             _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(fields, 20), mask5), 10),
+                                                             _mm256_slli_epi32(_mm256_srli_epi32(fields, 30), 15)));
+        const __m256i tail = _mm256_or_si256(_mm256_or_si256(bits(w, 0x7f), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(fields, 12), mask3), 8)),
+                                             _mm256_slli_epi32(regs, 16));
+
+        //exec of lanes 0-3 and 4-7, entries are two qwords apart
+        const __m256i idx2 = _mm256_slli_epi32(idx, 1);
+        const long long *entries = reinterpret_cast<const long long *>(decode_table.data());
+        const __m256i exec_lo = _mm256_i32gather_epi64(entries, _mm256_castsi256_si128(idx2), 8);
+        const __m256i exec_hi = _mm256_i32gather_epi64(entries, _mm256_extracti128_si256(idx2, 1), 8);
+
+        //imm and tail qwords of lanes 0-3 and 4-7
+        const __m256i pairs_a = _mm256_unpacklo_epi32(imm, tail);
+        const __m256i pairs_b = _mm256_unpackhi_epi32(imm, tail);
+        const __m256i second_lo = _mm256_permute2x128_si256(pairs_a, pairs_b, 0x20);
+        const __m256i second_hi = _mm256_permute2x128_si256(pairs_a, pairs_b, 0x31);
+
+        store(out + i, exec_lo, second_lo);
+        store(out + i + 4, exec_hi, second_hi);
+    }
+    predecodeScalar(words + i, count - i, out + i);
+}
+
+void predecode(const instr_t *words, std::size_t count, Instr *out)
+{
+    static const auto impl = asmjit::CpuInfo::host().features().x86().hasAVX2() ? predecodeAvx2 : predecodeScalar;
+    impl(words, count, out);
+}
+
+PredecodeCache::Page &PredecodeCache::fill(const mem_t *mem, addr_t page_addr)
+{
+    std::unique_ptr<Page> &page = shadow[page_addr];
+    if(!page)
+    {
+        page = std::make_unique<Page>();
+    }
+    std::memcpy(page->words.data(), mem + page_addr, sizeof(page->words));
+    predecode(page->words.data(), PAGE_WORDS, page->instrs.data());
+    last_addr = page_addr;
+    last = page.get();
+    return *page;
+}
+
+Instr PredecodeCache::at(const mem_t *mem, addr_t pc)
+{
+    instr_t word;
+    std::memcpy(&word, mem + pc, sizeof(word));
+    if(pc & 0b11)
+    {
+        return decode(word);
+    }
+
+    const addr_t page_addr = pc & ~static_cast<addr_t>(PAGE_WORDS * sizeof(instr_t) - 1);
+    const std::size_t idx = (pc - page_addr) / sizeof(instr_t);
+    Page *page = last;
+    if(!page || last_addr != page_addr)
+    {
+        auto it = shadow.find(page_addr);
+        page = it == shadow.end() ? nullptr : it->second.get();
+        last_addr = page_addr;
+        last = page;
+    }
+    //a page seen for the first time, or code written since it was decoded
+    if(!page || page->words[idx] != word)
+    {
+        page = &fill(mem, page_addr);
+    }
+    return page->instrs[idx];
+}
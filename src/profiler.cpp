@@ -0,0 +1,154 @@
+#include "profiler.hpp"
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//state of the Cpu profiled on this thread, for the timer signal
+static thread_local CpuState *profiled_state = nullptr;
+
+static void onProfTimer(int)
+{
+    if(CpuState *state = profiled_state)
+    {
+        state->sample_at.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool Profiler::start(Cpu &cpu_)
+{
+    stop();
+    cpu = &cpu_;
+    cpu->profiler = this;
+    CpuState &state = cpu->getState();
+    if(clock == Clock::Instret)
+    {
+        state.sample_at.store(state.instret + period, std::memory_order_relaxed);
+        return true;
+    }
+
+    struct sigaction action {};
+    action.sa_handler = onProfTimer;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, &old_action))
+    {
+        return false;
+    }
+    action_set = true;
+    state.sample_at.store(UINT64_MAX, std::memory_order_relaxed);
+    profiled_state = &state;
+
+    //CPU time of this thread only, delivered to this thread only
+    sigevent event {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer))
+    {
+        stop();
+        return false;
+    }
+    timer_armed = true;
+
+    itimerspec interval {};
+    interval.it_interval.tv_sec = period / 1000000;
+    interval.it_interval.tv_nsec = (period % 1000000) * 1000;
+    interval.it_value = interval.it_interval;
+    timer_settime(timer, 0, &interval, nullptr);
+    return true;
+}
+
+void Profiler::stop()
+{
+    if(timer_armed)
+    {
+        timer_delete(timer);
+        timer_armed = false;
+    }
+    //the handler of whoever had SIGPROF before, e.g. a host profiler
+    if(action_set)
+    {
+        sigaction(SIGPROF, &old_action, nullptr);
+        action_set = false;
+        profiled_state = nullptr;
+    }
+    if(cpu)
+    {
+        cpu->getState().sample_at.store(UINT64_MAX, std::memory_order_relaxed);
+        cpu->profiler = nullptr;
+        cpu = nullptr;
+    }
+}
+
+void Profiler::sample(Cpu &cpu_)
+{
+    CpuState &state = cpu_.getState();
+    state.sample_at.store(clock == Clock::Instret ? state.instret + period : UINT64_MAX, std::memory_order_relaxed);
+
+    scratch.clear();
+    unwind(cpu_, scratch);
+    ++stacks[scratch];
+    ++nsamples;
+}
+
+// Callers come from the shadow call stack both engines keep on JAL/JALR,
+// so frames are found without frame pointers and a leaf that made no frame
+// still has its caller. Calls nested deeper than CpuState::CallDepth are
+// left out of the middle of the stack.
+void Profiler::unwind(Cpu &cpu_, std::vector<addr_t> &stack) const
+{
+    const CpuState &state = cpu_.getState();
+    stack.push_back(state.pc);
+
+    uint32_t depth = state.call_depth < CpuState::CallDepth ? state.call_depth : CpuState::CallDepth;
+    while(depth && stack.size() < MAX_DEPTH)
+    {
+        stack.push_back(state.calls[--depth] - RV32I_INTR_SIZE);
+    }
+}
+
+std::size_t Profiler::StackHash::operator()(const std::vector<addr_t> &stack) const noexcept
+{
+    std::size_t hash = stack.size();
+    for(addr_t pc : stack)
+    {
+        hash = hash * 0x9e3779b97f4a7c15ull + pc;
+    }
+    return hash;
+}
+
+void Profiler::writeFolded(std::ostream &os, const GuestSymbols &symbols) const
+{
+    //samples of the same function chain fold into one line
+    std::unordered_map<std::string, uint64_t> folded {};
+    for(const auto &[stack, count] : stacks)
+    {
+        std::string line {};
+        for(auto it = stack.rbegin(); it != stack.rend(); ++it)
+        {
+            addr_t offset = 0;
+            const std::string *name = symbols.nearest(*it, offset);
+            if(!line.empty())
+            {
+                line += ';';
+            }
+            if(name)
+            {
+                line += *name;
+            }
+            else
+            {
+                char buf[16];
+                std::snprintf(buf, sizeof(buf), "0x%08x", *it);
+                line += buf;
+            }
+        }
+        folded[line] += count;
+    }
+    for(const auto &[line, count] : folded)
+    {
+        os << line << ' ' << count << '\n';
+    }
+}
@@ -0,0 +1,364 @@
+#include "cpu.hpp"
+#include "rv32i.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Guest buffers are handed to the host as base + addr. A buffer the guest
+// has not mapped is inaccessible, or runs into the guard page past the end
+// of the space, so the host call fails with EFAULT. Structures the host
+// reads or writes itself are checked against the mapped pages first.
+
+typedef reg_t (*syscall_t)(Cpu &cpu);
+
+static reg_t arg(const Cpu &cpu, int n) {return cpu.getReg(10 + n);}
+
+int SyscallState::addFile(int host_fd)
+{
+    auto free = std::find(files.begin(), files.end(), -1);
+    if(free == files.end())
+    {
+        files.push_back(host_fd);
+        return STDERR_FILENO + files.size();
+    }
+    *free = host_fd;
+    return STDERR_FILENO + 1 + (free - files.begin());
+}
+
+int SyscallState::hostFd(int guest_fd) const noexcept
+{
+    if(guest_fd >= 0 && guest_fd <= STDERR_FILENO)
+    {
+        return stdio[guest_fd];
+    }
+    const std::size_t slot = guest_fd - (STDERR_FILENO + 1);
+    return (guest_fd > STDERR_FILENO && slot < files.size()) ? files[slot] : -1;
+}
+
+void SyscallState::closeFiles() noexcept
+{
+    for(int fd : files)
+    {
+        if(fd >= 0) {close(fd);}
+    }
+    files.clear();
+}
+
+// Guest descriptors go through the Cpu's table, unknown ones become -1 and
+// the host call fails with EBADF
+static int fdArg(const Cpu &cpu, int n)
+{
+    return cpu.sys.hostFd(arg(cpu, n));
+}
+static addr_t uarg(const Cpu &cpu, int n) {return static_cast<addr_t>(cpu.getReg(10 + n));}
+
+// Buffer passed on to a host call, which faults gracefully
+template<typename T = void>
+static T *guestPtr(Cpu &cpu, addr_t addr)
+{
+    return reinterpret_cast<T *>(cpu.getMemBase() + addr);
+}
+
+// count objects the host accesses itself, nullptr unless all of them are
+// mapped
+template<typename T>
+static T *guestObject(Cpu &cpu, addr_t addr, std::size_t count = 1)
+{
+    return cpu.mapped(addr, count * sizeof(T)) ? guestPtr<T>(cpu, addr) : nullptr;
+}
+
+static addr_t pageUp(addr_t addr) {return (addr + Memory::GUEST_PAGE_SIZE - 1) & ~(Memory::GUEST_PAGE_SIZE - 1);}
+
+// Host result in guest convention: negative errno on failure
+static reg_t result(long ret)
+{
+    return ret < 0 ? -errno : static_cast<reg_t>(ret);
+}
+
+static reg_t sysOpenat(Cpu &cpu)
+{
+    const int dirfd = arg(cpu, 0) == AT_FDCWD ? AT_FDCWD : fdArg(cpu, 0);
+    const int fd = openat(dirfd, guestPtr<const char>(cpu, uarg(cpu, 1)), arg(cpu, 2) | O_CLOEXEC, uarg(cpu, 3));
+    return fd < 0 ? -errno : cpu.sys.addFile(fd);
+}
+
+static reg_t sysClose(Cpu &cpu)
+{
+    //the simulator's own stdio stays open
+    const int fd = arg(cpu, 0);
+    if(fd >= 0 && fd <= STDERR_FILENO)
+    {
+        return 0;
+    }
+    const int host_fd = cpu.sys.hostFd(fd);
+    if(host_fd < 0)
+    {
+        return -EBADF;
+    }
+    cpu.sys.files[fd - (STDERR_FILENO + 1)] = -1;
+    return result(close(host_fd));
+}
+
+static reg_t sysLseek(Cpu &cpu)
+{
+    off_t ret = lseek(fdArg(cpu, 0), arg(cpu, 1), arg(cpu, 2));
+    if(ret > INT32_MAX)
+    {
+        return -EOVERFLOW;
+    }
+    return result(ret);
+}
+
+static reg_t sysRead(Cpu &cpu)
+{
+    return result(read(fdArg(cpu, 0), guestPtr(cpu, uarg(cpu, 1)), uarg(cpu, 2)));
+}
+
+static reg_t sysWrite(Cpu &cpu)
+{
+    return result(write(fdArg(cpu, 0), guestPtr<const void>(cpu, uarg(cpu, 1)), uarg(cpu, 2)));
+}
+
+struct GuestIovec
+{
+    addr_t base;
+    uint32_t len;
+};
+
+template<bool Write>
+static reg_t sysRWv(Cpu &cpu)
+{
+    int iovcnt = arg(cpu, 2);
+    if(iovcnt < 0 || iovcnt > IOV_MAX)
+    {
+        return -EINVAL;
+    }
+
+    const GuestIovec *guest_iov = guestObject<const GuestIovec>(cpu, uarg(cpu, 1), iovcnt);
+    if(!guest_iov)
+    {
+        return -EFAULT;
+    }
+    std::vector<iovec> iov(iovcnt);
+    for(int i = 0; i < iovcnt; ++i)
+    {
+        iov[i] = {guestPtr(cpu, guest_iov[i].base), guest_iov[i].len};
+    }
+
+    if constexpr (Write)
+    {
+        return result(writev(fdArg(cpu, 0), iov.data(), iovcnt));
+    }
+    else
+    {
+        return result(readv(fdArg(cpu, 0), iov.data(), iovcnt));
+    }
+}
+
+// struct stat64 of asm-generic for 32-bit targets
+struct GuestStat
+{
+    uint64_t st_dev;
+    uint64_t st_ino;
+    uint32_t st_mode;
+    uint32_t st_nlink;
+    uint32_t st_uid;
+    uint32_t st_gid;
+    uint64_t st_rdev;
+    uint64_t pad1;
+    int64_t st_size;
+    int32_t st_blksize;
+    int32_t pad2;
+    int64_t st_blocks;
+    int32_t st_atime_sec;
+    uint32_t st_atime_nsec;
+    int32_t st_mtime_sec;
+    uint32_t st_mtime_nsec;
+    int32_t st_ctime_sec;
+    uint32_t st_ctime_nsec;
+    uint32_t unused4;
+    uint32_t unused5;
+};
+static_assert(sizeof(GuestStat) == 104, "asm-generic stat64 layout");
+
+static reg_t sysFstat(Cpu &cpu)
+{
+    GuestStat *out = guestObject<GuestStat>(cpu, uarg(cpu, 1));
+    if(!out)
+    {
+        return -EFAULT;
+    }
+    struct stat st {};
+    if(fstat(fdArg(cpu, 0), &st))
+    {
+        return -errno;
+    }
+
+    *out = GuestStat {};
+    out->st_dev = st.st_dev;
+    out->st_ino = st.st_ino;
+    out->st_mode = st.st_mode;
+    out->st_nlink = st.st_nlink;
+    out->st_uid = st.st_uid;
+    out->st_gid = st.st_gid;
+    out->st_rdev = st.st_rdev;
+    out->st_size = st.st_size;
+    out->st_blksize = st.st_blksize;
+    out->st_blocks = st.st_blocks;
+    out->st_atime_sec = st.st_atim.tv_sec;
+    out->st_atime_nsec = st.st_atim.tv_nsec;
+    out->st_mtime_sec = st.st_mtim.tv_sec;
+    out->st_mtime_nsec = st.st_mtim.tv_nsec;
+    out->st_ctime_sec = st.st_ctim.tv_sec;
+    out->st_ctime_nsec = st.st_ctim.tv_nsec;
+    return 0;
+}
+
+static reg_t sysExit(Cpu &cpu)
+{
+    cpu.sys.exit_code = arg(cpu, 0);
+    cpu.setDone();
+    return arg(cpu, 0);
+}
+
+// 113 takes the old 32-bit timespec, 403 the 64-bit one
+template<typename Sec_t, typename Nsec_t>
+static reg_t sysClockGettime(Cpu &cpu)
+{
+    struct GuestTimespec
+    {
+        Sec_t tv_sec;
+        Nsec_t tv_nsec;
+    };
+
+    GuestTimespec *out = guestObject<GuestTimespec>(cpu, uarg(cpu, 1));
+    if(!out)
+    {
+        return -EFAULT;
+    }
+    timespec ts {};
+    if(clock_gettime(arg(cpu, 0), &ts))
+    {
+        return -errno;
+    }
+    *out = {static_cast<Sec_t>(ts.tv_sec), static_cast<Nsec_t>(ts.tv_nsec)};
+    return 0;
+}
+
+static reg_t sysBrk(Cpu &cpu)
+{
+    SyscallState &sys = cpu.sys;
+    addr_t want = uarg(cpu, 0);
+    //the heap must not reach into the lowest mapping
+    if(want < sys.brk_start || pageUp(want) > sys.mmap_top)
+    {
+        return sys.brk;
+    }
+
+    //pages given back read as zero when the heap grows again
+    if(pageUp(want) < pageUp(sys.brk))
+    {
+        cpu.release(pageUp(want), pageUp(sys.brk) - pageUp(want));
+    }
+    else if(!cpu.commit(pageUp(sys.brk), pageUp(want) - pageUp(sys.brk)))
+    {
+        return sys.brk;
+    }
+    sys.brk = want;
+    return sys.brk;
+}
+
+static reg_t sysMmap(Cpu &cpu)
+{
+    SyscallState &sys = cpu.sys;
+    addr_t addr = uarg(cpu, 0);
+    uint64_t len = pageUp(uarg(cpu, 1));
+    int flags = arg(cpu, 3);
+
+    if(!(flags & MAP_ANONYMOUS))
+    {
+        return -ENODEV;
+    }
+    if(!uarg(cpu, 1) || !len)
+    {
+        return -EINVAL;
+    }
+
+    if(flags & MAP_FIXED)
+    {
+        if((addr & (Memory::GUEST_PAGE_SIZE - 1)) || addr + len > cpu.getMemSize())
+        {
+            return -EINVAL;
+        }
+        return cpu.discard(addr, len) ? static_cast<reg_t>(addr) : -ENOMEM;
+    }
+
+    //fresh addresses were never committed, so they read as zero
+    if(pageUp(sys.brk) > sys.mmap_top || len > sys.mmap_top - pageUp(sys.brk) || !cpu.commit(sys.mmap_top - len, len))
+    {
+        return -ENOMEM;
+    }
+    sys.mmap_top -= len;
+    return static_cast<reg_t>(sys.mmap_top);
+}
+
+static reg_t sysMunmap(Cpu &cpu)
+{
+    addr_t addr = uarg(cpu, 0);
+    uint64_t len = pageUp(uarg(cpu, 1));
+    if((addr & (Memory::GUEST_PAGE_SIZE - 1)) || !len || addr + len > cpu.getMemSize())
+    {
+        return -EINVAL;
+    }
+    return cpu.release(addr, len) ? 0 : -ENOMEM;
+}
+
+static reg_t sysUnimplemented(Cpu &)
+{
+    return -ENOSYS;
+}
+
+static const std::size_t NSYSCALLS = 404;
+
+static constexpr std::array<syscall_t, NSYSCALLS> makeSyscallTable()
+{
+    std::array<syscall_t, NSYSCALLS> table {};
+    for(syscall_t &entry : table)
+    {
+        entry = sysUnimplemented;
+    }
+
+    using Syscall::rv;
+    table[static_cast<std::size_t>(rv::OPENAT)]          = sysOpenat;
+    table[static_cast<std::size_t>(rv::CLOSE)]           = sysClose;
+    table[static_cast<std::size_t>(rv::LSEEK)]           = sysLseek;
+    table[static_cast<std::size_t>(rv::READ)]            = sysRead;
+    table[static_cast<std::size_t>(rv::WRITE)]           = sysWrite;
+    table[static_cast<std::size_t>(rv::READV)]           = sysRWv<false>;
+    table[static_cast<std::size_t>(rv::WRITEV)]          = sysRWv<true>;
+    table[static_cast<std::size_t>(rv::FSTAT)]           = sysFstat;
+    table[static_cast<std::size_t>(rv::EXIT)]            = sysExit;
+    table[static_cast<std::size_t>(rv::EXIT_GROUP)]      = sysExit;
+    table[static_cast<std::size_t>(rv::CLOCK_GETTIME)]   = sysClockGettime<int32_t, int32_t>;
+    table[static_cast<std::size_t>(rv::BRK)]             = sysBrk;
+    table[static_cast<std::size_t>(rv::MUNMAP)]          = sysMunmap;
+    table[static_cast<std::size_t>(rv::MMAP)]            = sysMmap;
+    table[static_cast<std::size_t>(rv::CLOCK_GETTIME64)] = sysClockGettime<int64_t, int64_t>;
+    return table;
+}
+
+static constexpr std::array<syscall_t, NSYSCALLS> syscall_table = makeSyscallTable();
+
+reg_t doSyscall(Cpu &cpu)
+{
+    addr_t nr = static_cast<addr_t>(cpu.getReg(17));
+    return nr < NSYSCALLS ? syscall_table[nr](cpu) : -ENOSYS;
+}
@@ -0,0 +1,136 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+thread_local TraceRing *TraceRing::current = nullptr;
+
+const char TraceWriter::MAGIC[8] = {'R', 'V', '3', '2', 'T', 'R', 'C', '1'};
+
+bool TraceWriter::open(const char *path)
+{
+    close();
+    if(!(out = fopen(path, "wb")))
+    {
+        return false;
+    }
+    fwrite(MAGIC, sizeof(MAGIC), 1, out);
+    stopping.store(false, std::memory_order_relaxed);
+    thread = std::thread(&TraceWriter::run, this);
+    return true;
+}
+
+TraceRing *TraceWriter::newRing()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return &rings.emplace_back(static_cast<uint32_t>(rings.size()));
+}
+
+void TraceWriter::close()
+{
+    if(thread.joinable())
+    {
+        stopping.store(true, std::memory_order_release);
+        thread.join();
+    }
+    if(out)
+    {
+        fclose(out);
+        out = nullptr;
+    }
+}
+
+// Writes whatever the producers published, true if there was anything
+bool TraceWriter::drain()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool wrote = false;
+    for(TraceRing &ring : rings)
+    {
+        const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        const uint64_t head = ring.head.load(std::memory_order_acquire);
+        if(head == tail)
+        {
+            continue;
+        }
+
+        const uint32_t chunk[2] = {ring.id, static_cast<uint32_t>(head - tail)};
+        fwrite(chunk, sizeof(chunk), 1, out);
+        //the pending events may wrap around the end of the ring
+        const std::size_t first = tail & (TraceRing::CAPACITY - 1);
+        const std::size_t count = std::min<uint64_t>(head - tail, TraceRing::CAPACITY - first);
+        fwrite(&ring.events[first], sizeof(TraceEvent), count, out);
+        fwrite(&ring.events[0], sizeof(TraceEvent), head - tail - count, out);
+        ring.tail.store(head, std::memory_order_release);
+        wrote = true;
+    }
+    return wrote;
+}
+
+void TraceWriter::run()
+{
+    while(!stopping.load(std::memory_order_acquire))
+    {
+        if(!drain())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    //producers are done once close() is called
+    drain();
+    fflush(out);
+}
+
+bool decodeTrace(std::istream &in, std::ostream &out)
+{
+    char magic[sizeof(TraceWriter::MAGIC)];
+    if(!in.read(magic, sizeof(magic)) || std::memcmp(magic, TraceWriter::MAGIC, sizeof(magic)))
+    {
+        return false;
+    }
+
+    uint32_t chunk[2];
+    std::vector<TraceEvent> events {};
+    char line[96];
+    while(in.read(reinterpret_cast<char *>(chunk), sizeof(chunk)))
+    {
+        //a chunk is at most one full ring
+        if(chunk[1] > TraceRing::CAPACITY)
+        {
+            return false;
+        }
+        events.resize(chunk[1]);
+        if(!in.read(reinterpret_cast<char *>(events.data()), events.size() * sizeof(TraceEvent)))
+        {
+            return false;
+        }
+        for(const TraceEvent &event : events)
+        {
+            switch (event.kind)
+            {
+                case TraceEvent::Block:
+                    std::snprintf(line, sizeof(line), "%u 0x%08x block", chunk[0], event.pc);
+                    break;
+                case TraceEvent::RegWrite:
+                    std::snprintf(line, sizeof(line), "%u 0x%08x x%u = 0x%08x", chunk[0], event.pc, event.reg, event.value);
+                    break;
+                case TraceEvent::MemRead:
+                    std::snprintf(line, sizeof(line), "%u 0x%08x read%u [0x%08x] = 0x%08x", chunk[0], event.pc, event.reg * 8,
+                                  event.addr, event.value);
+                    break;
+                case TraceEvent::MemWrite:
+                    std::snprintf(line, sizeof(line), "%u 0x%08x write%u [0x%08x] = 0x%08x", chunk[0], event.pc, event.reg * 8,
+                                  event.addr, event.value);
+                    break;
+                case TraceEvent::Syscall:
+                    std::snprintf(line, sizeof(line), "%u 0x%08x syscall %u = 0x%08x", chunk[0], event.pc, event.addr, event.value);
+                    break;
+                default:
+                    return false;
+            }
+            out << line << '\n';
+        }
+    }
+    return in.eof();
+}
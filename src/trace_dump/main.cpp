@@ -0,0 +1,26 @@
+#include "trace.hpp"
+#include <fstream>
+#include <iostream>
+
+// Prints a trace written by main --trace=<file> as text
+int main(int argc, char* argv[])
+{
+    if(argc != 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <trace file>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if(!in)
+    {
+        std::cout << "Can't open trace file " << argv[1] << std::endl;
+        return 1;
+    }
+    if(!decodeTrace(in, std::cout))
+    {
+        std::cout << "Malformed trace file " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -5,11 +5,23 @@
 #include "asmjit/x86/x86compiler.h"
 #include "asmjit/x86/x86operand.h"
 #include "cpu.hpp"
+#include "perf.hpp"
 #include "rv32i.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <thread>
+#include <unordered_set>
 
-bool is_bb_end(Instr &instr)
+bool is_bb_end(const Instr &instr)
 {
+    //the dispatcher reports illegal instructions, so they leave the block
+    if(instr.exec == executeIllegal)
+    {
+        return true;
+    }
     switch (instr.opcode)
     {
         case Opcode::Branch:
@@ -23,35 +35,129 @@ bool is_bb_end(Instr &instr)
     return false;
 }
 
-std::vector<Instr> lookup(Cpu &cpu, addr_t addr)
+BlockDescriptor &lookup(Cpu &cpu, addr_t addr)
 {
-    auto basic_block_res = cpu.bb_cache.find(addr);
+    //if bb was not found -> decode it into the arena and add it to bb_table
+    if(BlockDescriptor *block = cpu.bb_table.find(addr))
+    {
+        return *block;
+    }
 
-    //if bb was not found -> update bb_cache
-    if(basic_block_res == cpu.bb_cache.end())
+    Instr cur_instr {};
+    addr_t cur_addr = addr;
+    std::vector<Instr> &bb = cpu.bb_decode_buf;
+    bb.clear();
+
+    do
     {
-        Instr cur_instr {};
-        addr_t cur_addr = addr;
-        std::vector<Instr> bb;
-        bb.reserve(BB_AVERAGE_SIZE);
+#ifdef RV32I_TRACING
+        cur_instr = cpu.trace_ring ? decode(cpu.fetch(cur_addr), traced_decode_table) : cpu.predecoded.at(cpu.getMemBase(), cur_addr);
+#else
+        cur_instr = cpu.predecoded.at(cpu.getMemBase(), cur_addr);
+#endif
+        bb.push_back(cur_instr);
+        cur_addr += sizeof(addr_t);
+    } while (!is_bb_end(cur_instr));
 
-        do
-        {
-            reg_t command = cpu.fetch(cur_addr);
-            cur_instr = decode(command);
-            bb.push_back(cur_instr);
-            cur_addr += sizeof(addr_t);
-        } while (!is_bb_end(cur_instr));
+    BlockDescriptor &block = cpu.bb_table.insert(addr);
+    block.pc = addr;
+    block.instrs = cpu.bb_arena.allocate(bb.data(), bb.size());
+    ++cpu.stats.blocks_decoded;
+    return block;
+}
+
+BlockLink *newLinks(Cpu &cpu, const std::vector<addr_t> &targets)
+{
+    std::vector<BlockLink> &links = cpu.bb_links.emplace_back();
+    links.reserve(targets.size());
+    for(addr_t target : targets)
+    {
+        links.push_back(BlockLink {target, nullptr});
+    }
+    return links.data();
+}
+
+void chainBlock(BlockLink *link, BlockDescriptor &next)
+{
+    link->next = &next;
+    next.chained.push_back(link);
+}
 
-        basic_block_res = cpu.bb_cache.emplace(addr, bb).first;
+void invalidateBlock(Cpu &cpu, addr_t addr)
+{
+    BlockDescriptor *block = cpu.bb_table.find(addr);
+    if(!block)
+    {
+        return;
+    }
+
+    //unpatch every exit that jumps straight into the dropped block
+    for(BlockLink *link : block->chained)
+    {
+        link->next = nullptr;
     }
+    block->chained.clear();
+    block->native = nullptr;
+    block->tier = JitTier::None;
+    block->pending.reset();
+    cpu.bb_table.erase(addr);
+
+    //traces carrying a copy of the block go with it
+    std::vector<addr_t> traces = std::move(block->traces);
+    for(addr_t head : traces)
+    {
+        invalidateBlock(cpu, head);
+    }
+}
+
+// Returns the address of exit slot number exits.size() in the links
+// argument and records its target
+static void translateExit(asmjit::x86::Compiler &cc, asmjit::x86::Gp &state, asmjit::x86::Gp &links, asmjit::x86::Gp &link,
+                          std::vector<addr_t> &exits, addr_t target)
+{
+    cc.mov(pcDwordPtr(state), target);
+    cc.lea(link, asmjit::x86::ptr(links, static_cast<int32_t>(exits.size() * sizeof(BlockLink))));
+    exits.push_back(target);
+    cc.ret(link);
+}
 
-    return basic_block_res->second;
+static void translateDynamicExit(asmjit::x86::Compiler &cc, asmjit::x86::Gp &link)
+{
+    cc.xor_(link, link);
+    cc.ret(link);
 }
 
-asmjit::x86::Mem toDwordPtr(Register &reg)
+// pushCall and popCall on the shadow call stack, index is a scratch register
+static void translatePushCall(asmjit::x86::Compiler &cc, asmjit::x86::Gp &state, asmjit::x86::Gp &index, addr_t ret)
 {
-    return asmjit::x86::dword_ptr((uint64_t)(&(reg.self_->val_)));
+    asmjit::Label L_DEEP = cc.newLabel();
+    asmjit::x86::Mem depth = asmjit::x86::dword_ptr(state, offsetof(CpuState, call_depth));
+    cc.mov(index.r32(), depth);
+    cc.cmp(index.r32(), CpuState::CallDepth);
+    cc.jae(L_DEEP);
+    cc.mov(asmjit::x86::dword_ptr(state, index, 2, offsetof(CpuState, calls)), ret);
+    cc.bind(L_DEEP);
+    cc.inc(depth);
+}
+
+static void translatePopCall(asmjit::x86::Compiler &cc, asmjit::x86::Gp &state)
+{
+    asmjit::Label L_EMPTY = cc.newLabel();
+    asmjit::x86::Mem depth = asmjit::x86::dword_ptr(state, offsetof(CpuState, call_depth));
+    cc.cmp(depth, 0);
+    cc.je(L_EMPTY);
+    cc.dec(depth);
+    cc.bind(L_EMPTY);
+}
+
+asmjit::x86::Mem toDwordPtr(asmjit::x86::Gp &state, int reg_id)
+{
+    return asmjit::x86::dword_ptr(state, offsetof(CpuState, regs) + reg_id * sizeof(reg_t));
+}
+
+asmjit::x86::Mem pcDwordPtr(asmjit::x86::Gp &state)
+{
+    return asmjit::x86::dword_ptr(state, offsetof(CpuState, pc));
 }
 
 void translateOp(Instr &instr, TranslationAttr &attr)
@@ -90,13 +196,15 @@ void translateOp(Instr &instr, TranslationAttr &attr)
         case R::Op::funct3::SLT:
             {
                 attr.cc.cmp(attr.dst1, attr.dst2);
-                attr.cc.setl(attr.dst1);
+                attr.cc.setl(attr.dst1.r8());
+                attr.cc.movzx(attr.dst1, attr.dst1.r8());
                 break;
             }
         case R::Op::funct3::SLTU:
             {
                 attr.cc.cmp(attr.dst1, attr.dst2);
-                attr.cc.setb(attr.dst1);
+                attr.cc.setb(attr.dst1.r8());
+                attr.cc.movzx(attr.dst1, attr.dst1.r8());
                 break;
             }
         case R::Op::funct3::SLL:
@@ -148,13 +256,15 @@ void translateImm(Instr &instr, TranslationAttr &attr)
         case I::Imm::funct3::SLTI:
             {
                 attr.cc.cmp(attr.dst1, attr.dst2);
-                attr.cc.setl(attr.dst1);
+                attr.cc.setl(attr.dst1.r8());
+                attr.cc.movzx(attr.dst1, attr.dst1.r8());
                 break;
             }
         case I::Imm::funct3::SLTIU:
             {
                 attr.cc.cmp(attr.dst1, attr.dst2);
-                attr.cc.setb(attr.dst1);
+                attr.cc.setb(attr.dst1.r8());
+                attr.cc.movzx(attr.dst1, attr.dst1.r8());
                 break;
             }
         case I::Imm::funct3::SLLI:
@@ -203,7 +313,7 @@ void translateBranch(Instr &instr, TranslationAttr &attr)
             }
         case B::Branch::funct3::BGE:
             {
-                attr.cc.jg(*attr.L_BRANCH);
+                attr.cc.jge(*attr.L_BRANCH);
                 return;
             }
         case B::Branch::funct3::BLTU:
@@ -213,306 +323,1041 @@ void translateBranch(Instr &instr, TranslationAttr &attr)
             }
         case B::Branch::funct3::BGEU:
             {
-                attr.cc.ja(*attr.L_BRANCH);
+                attr.cc.jae(*attr.L_BRANCH);
                 return;
             }
         default: {return;}
     }
 }
 
-template<typename ValueT>
-static reg_t LoadWrapper(Cpu *cpu, addr_t addr)
-{
-    return cpu->load<ValueT>(addr);
-}
-
 void translateLoad(Instr &instr, TranslationAttr &attr)
 {
     switch ((I::Load::funct3)instr.funct3)
     {
         case I::Load::funct3::LB:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)LoadWrapper<byte_t>, asmjit::FuncSignature::build<reg_t, Cpu *, addr_t>());
+                attr.cc.movsx(attr.ret, asmjit::x86::byte_ptr(attr.mem, attr.addr));
                 break;
             }
         case I::Load::funct3::LH:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)LoadWrapper<half_t>, asmjit::FuncSignature::build<reg_t, Cpu *, addr_t>());
+                attr.cc.movsx(attr.ret, asmjit::x86::word_ptr(attr.mem, attr.addr));
                 break;
             }
         case I::Load::funct3::LW:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)LoadWrapper<word_t>, asmjit::FuncSignature::build<reg_t, Cpu *, addr_t>());
+                attr.cc.mov(attr.ret, asmjit::x86::dword_ptr(attr.mem, attr.addr));
                 break;
             }
         case I::Load::funct3::LBU:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)LoadWrapper<byte_t>, asmjit::FuncSignature::build<reg_t, Cpu *, addr_t>());
-                attr.cc.mov(attr.dst2, 0x000000ff);
+                attr.cc.movzx(attr.ret, asmjit::x86::byte_ptr(attr.mem, attr.addr));
                 break;
             }
         case I::Load::funct3::LHU:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)LoadWrapper<half_t>, asmjit::FuncSignature::build<reg_t, Cpu *, addr_t>());
-                attr.cc.mov(attr.dst2, 0x0000ffff);
+                attr.cc.movzx(attr.ret, asmjit::x86::word_ptr(attr.mem, attr.addr));
                 break;
             }
     }
 }
 
-template<typename StoreT>
-static void StoreWrapper(Cpu *cpu, addr_t addr, reg_t val)
-{
-    cpu->store<StoreT>(addr, val);
-}
-
 void translateStore(Instr &instr, TranslationAttr &attr)
 {
     switch (static_cast<S::Store::funct3>(instr.funct3))
     {
         case S::Store::funct3::SB:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)StoreWrapper<byte_t>, asmjit::FuncSignature::build<void, Cpu *, addr_t, reg_t>());
+                attr.cc.mov(asmjit::x86::byte_ptr(attr.mem, attr.addr), attr.dst2.r8());
                 break;
             }
         case S::Store::funct3::SH:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)StoreWrapper<half_t>, asmjit::FuncSignature::build<void, Cpu *, addr_t, reg_t>());
+                attr.cc.mov(asmjit::x86::word_ptr(attr.mem, attr.addr), attr.dst2.r16());
                 break;
             }
         case S::Store::funct3::SW:
             {
-                attr.cc.invoke(attr.invokeNode, (uint64_t)StoreWrapper<word_t>, asmjit::FuncSignature::build<void, Cpu *, addr_t, reg_t>());
+                attr.cc.mov(asmjit::x86::dword_ptr(attr.mem, attr.addr), attr.dst2);
                 break;
             }
     }
 }
 
-Cpu::func_t translate(Cpu &cpu, std::vector<Instr> &bb)
+// Guest address is computed into attr.addr. 32-bit arithmetic wraps like the
+// guest and zero extends, so [mem + addr] is always inside the guest space.
+static void translateAddress(Instr &instr, TranslationAttr &attr, asmjit::x86::Gp &base)
+{
+    attr.cc.mov(attr.addr.r32(), base);
+    attr.cc.add(attr.addr.r32(), instr.imm);
+}
+
+struct SideExit
+{
+    asmjit::Label L_EXIT;
+    addr_t target;
+    //guest registers to store before leaving
+    uint32_t dirty;
+};
+
+// Optimized tier: x0 sources become constants, instructions writing x0 are
+// dropped and li/mv idioms skip the ALU.
+static bool isDead(const Instr &instr)
+{
+    switch (instr.opcode)
+    {
+        case Opcode::Imm:
+        case Opcode::Op:
+        case Opcode::Load:
+        case Opcode::Lui:
+        case Opcode::Auipc:
+            return instr.rd_id == 0;
+        case Opcode::Fence:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Guest registers of a unit live in virtual registers and are left to the
+// asmjit register allocator. Registers the unit reads are loaded once on
+// entry, exits store the ones written so far.
+class GuestRegs
+{
+public:
+    GuestRegs(asmjit::x86::Compiler &cc, asmjit::x86::Gp &state) : cc(cc), state(state) {}
+
+    void load(uint32_t mask)
+    {
+        regs[0] = cc.newGpd("x0");
+        cc.xor_(regs[0], regs[0]);
+        for(int id = 1; id < NREGS; ++id)
+        {
+            if(mask & (1u << id))
+            {
+                cc.mov(reg(id), toDwordPtr(state, id));
+            }
+        }
+    }
+
+    asmjit::x86::Gp &use(int id)
+    {
+        return reg(id);
+    }
+
+    asmjit::x86::Gp &def(int id)
+    {
+        dirty_ |= 1u << id;
+        return reg(id);
+    }
+
+    uint32_t dirty() const noexcept {return dirty_;}
+
+    void store(uint32_t mask)
+    {
+        for(int id = 1; id < NREGS; ++id)
+        {
+            if(mask & (1u << id))
+            {
+                cc.mov(toDwordPtr(state, id), reg(id));
+            }
+        }
+    }
+
+private:
+    static const int NREGS = 32;
+
+    asmjit::x86::Gp &reg(int id)
+    {
+        if(!regs[id].isValid())
+        {
+            regs[id] = cc.newGpd();
+        }
+        return regs[id];
+    }
+
+    asmjit::x86::Compiler &cc;
+    asmjit::x86::Gp &state;
+    std::array<asmjit::x86::Gp, NREGS> regs {};
+    uint32_t dirty_ {0};
+};
+
+// Registers read and written by the unit, x0 excluded
+static void usedRegs(const std::vector<std::vector<Instr>> &blocks, uint32_t &read, uint32_t &written)
+{
+    read = written = 0;
+    for(const std::vector<Instr> &block : blocks)
+    {
+        for(const Instr &instr : block)
+        {
+            switch (instr.opcode)
+            {
+                case Opcode::Op:
+                    read |= 1u << instr.rs2_id;
+                    [[fallthrough]];
+                case Opcode::Imm:
+                case Opcode::Load:
+                case Opcode::Jalr:
+                    read |= 1u << instr.rs1_id;
+                    written |= 1u << instr.rd_id;
+                    break;
+                case Opcode::Store:
+                case Opcode::Branch:
+                    read |= (1u << instr.rs1_id) | (1u << instr.rs2_id);
+                    break;
+                case Opcode::Lui:
+                case Opcode::Auipc:
+                case Opcode::Jal:
+                    written |= 1u << instr.rd_id;
+                    break;
+                case Opcode::System:
+                    if(instr.funct3) {written |= 1u << instr.rd_id;}
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    read &= ~1u;
+    written &= ~1u;
+}
+
+static bool translateIdiom(Instr &instr, asmjit::x86::Compiler &cc, GuestRegs &regs)
+{
+    using I::Imm::funct3;
+    const funct3 op = static_cast<funct3>(instr.funct3);
+    //li rd, imm
+    if(instr.rs1_id == 0 && (op == funct3::ADDI || op == funct3::ORI || op == funct3::XORI))
+    {
+        cc.mov(regs.def(instr.rd_id), instr.imm);
+        return true;
+    }
+    //mv rd, rs1
+    if(instr.imm == 0 && (op == funct3::ADDI || op == funct3::ORI || op == funct3::XORI))
+    {
+        cc.mov(regs.def(instr.rd_id), regs.use(instr.rs1_id));
+        return true;
+    }
+    return false;
+}
+
+// Reads of the counter CSRs are compiled, other system instructions leave
+// to the dispatcher, which interprets them
+static bool compilesSystem(const Instr &instr)
+{
+    using namespace I::System;
+    const uint32_t counter = instr.imm & 0xf7f;
+    return instr.funct3 && csrReadOnly(instr) && counter >= Csr::CYCLE && counter <= Csr::INSTRET;
+}
+
+static const std::size_t MAX_TRACE_BLOCKS = 16;
+static const std::size_t MAX_TRACE_INSTRS = 256;
+
+// Follows the dominant successor of every block from a hot head as long as
+// it has been executed already. Stops at indirect jumps, system
+// instructions, blocks already on the trace and the size limits.
+HotTrace formTrace(Cpu &cpu, BlockDescriptor &head)
+{
+    HotTrace trace {{}, false};
+    std::size_t ninstrs = 0;
+    BlockDescriptor *block = &head;
+
+    while(true)
+    {
+        trace.blocks.push_back(block);
+        ninstrs += block->instrs.size();
+
+        const Instr &last = block->instrs.back();
+        addr_t last_pc = block->pc + (block->instrs.size() - 1) * RV32I_INTR_SIZE;
+        addr_t next_pc = 0;
+        if(last.opcode == Opcode::Jal)
+        {
+            next_pc = last_pc + last.imm;
+        }
+        else if(last.opcode == Opcode::Branch)
+        {
+            bool taken = 2 * static_cast<uint64_t>(block->taken_count) > block->exec_count;
+            next_pc = taken ? last_pc + last.imm : last_pc + RV32I_INTR_SIZE;
+        }
+        else
+        {
+            break;
+        }
+
+        if(next_pc == head.pc)
+        {
+            trace.loops = true;
+            break;
+        }
+
+        BlockDescriptor *next = cpu.bb_table.find(next_pc);
+        if(!next || trace.blocks.size() == MAX_TRACE_BLOCKS
+            || ninstrs + next->instrs.size() > MAX_TRACE_INSTRS
+            || next->instrs.front().opcode == Opcode::System
+            || next->instrs.front().exec == executeIllegal
+            || std::find(trace.blocks.begin(), trace.blocks.end(), next) != trace.blocks.end())
+        {
+            break;
+        }
+        block = next;
+    }
+
+    return trace;
+}
+
+// Key flags for what the Cpu records while running a unit
+static uint32_t recordingBits(const Cpu &cpu)
+{
+    return (cpu.profiler ? CodeCache::KEY_PROFILED : 0) | (cpu.trace_ring ? CodeCache::KEY_TRACED : 0);
+}
+
+// The unit is identified by what it is compiled from: tier, shape, what it
+// records and the address and raw instruction words of every block
+static CodeCache::Key cacheKey(Cpu &cpu, const HotTrace &trace, JitTier tier)
+{
+    CodeCache::Key key {static_cast<uint32_t>(tier), (trace.loops ? CodeCache::KEY_LOOPS : 0) | recordingBits(cpu)};
+    for(const BlockDescriptor *block : trace.blocks)
+    {
+        key.push_back(block->pc);
+        key.push_back(block->instrs.size());
+        for(std::size_t i = 0; i < block->instrs.size(); ++i)
+        {
+            key.push_back(cpu.fetch(block->pc + i * RV32I_INTR_SIZE));
+        }
+    }
+    return key;
+}
+
+// Targets of the exit slots compile() gives the unit of key, in slot order:
+// the exits of the last block, then the side exits. false if key does not
+// describe a unit.
+bool unitExits(const CodeCache::Key &key, std::vector<addr_t> &exits)
+{
+    const bool loops = key.size() > 1 && (key[1] & CodeCache::KEY_LOOPS);
+    std::vector<addr_t> side_exits {};
+    exits.clear();
+    std::size_t i = CodeCache::KEY_HEAD_PC;
+    while(i < key.size())
+    {
+        const std::size_t count = i + 1 < key.size() ? key[i + 1] : 0;
+        if(!count || count > key.size() - i - 2)
+        {
+            return false;
+        }
+        const addr_t pc = key[i] + (count - 1) * RV32I_INTR_SIZE;
+        const Instr terminator = decode(key[i + 1 + count]);
+        i += 2 + count;
+
+        const bool last_block = i == key.size();
+        const bool continues = !last_block || loops;
+        const addr_t next_pc = last_block ? key[CodeCache::KEY_HEAD_PC] : key[i];
+        //left to the interpreter through a dynamic exit
+        if(terminator.exec == executeIllegal)
+        {
+            continue;
+        }
+        if(terminator.opcode == Opcode::Branch && continues)
+        {
+            const addr_t cold_pc = pc + terminator.imm;
+            side_exits.push_back(next_pc == cold_pc ? pc + RV32I_INTR_SIZE : cold_pc);
+        }
+        else if(terminator.opcode == Opcode::Branch)
+        {
+            exits.push_back(pc + RV32I_INTR_SIZE);
+            exits.push_back(pc + terminator.imm);
+        }
+        else if(terminator.opcode == Opcode::Jal && !continues)
+        {
+            exits.push_back(pc + terminator.imm);
+        }
+    }
+    exits.insert(exits.end(), side_exits.begin(), side_exits.end());
+    return i > CodeCache::KEY_HEAD_PC;
+}
+
+
+static std::shared_ptr<CompileJob> makeJob(Cpu &cpu, BlockDescriptor &block, JitTier tier)
+{
+    const HotTrace trace = tier >= JitTier::Optimized ? formTrace(cpu, block) : HotTrace {{&block}, false};
+    auto job = std::make_shared<CompileJob>();
+    job->tier = tier;
+    job->loops = trace.loops;
+    job->profiled = cpu.profiler != nullptr;
+    for(const BlockDescriptor *member : trace.blocks)
+    {
+        job->pcs.push_back(member->pc);
+        job->blocks.emplace_back(member->instrs.begin(), member->instrs.end());
+    }
+    job->key = cacheKey(cpu, trace, tier);
+    job->cache = cpu.code_cache;
+    job->logged = cpu.output_log != nullptr;
+    job->traced = cpu.trace_ring != nullptr;
+    if(PerfJitLog::shared().enabled())
+    {
+        job->perf_name = perfName(&cpu.symbols, block.pc, tier);
+    }
+    return job;
+}
+
+// Whether every block of the unit keyed by key still holds the instructions
+// it was compiled from
+static bool matchesMemory(Cpu &cpu, const CodeCache::Key &key)
+{
+    for(std::size_t i = CodeCache::KEY_HEAD_PC; i + 1 < key.size();)
+    {
+        addr_t pc = key[i];
+        std::size_t count = key[i + 1];
+        i += 2;
+        for(std::size_t j = 0; j < count; ++j, ++i)
+        {
+            if(i >= key.size() || static_cast<uint32_t>(cpu.fetch(pc + j * RV32I_INTR_SIZE)) != key[i])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void install(Cpu &cpu, BlockDescriptor &block, const CodeCache::Key &key, const CodeCache::Entry &entry)
+{
+    //register the head with the other blocks of the trace for invalidation
+    for(std::size_t i = CodeCache::KEY_HEAD_PC + 2 + key[CodeCache::KEY_HEAD_PC + 1]; i + 1 < key.size(); i += 2 + key[i + 1])
+    {
+        lookup(cpu, key[i]).traces.push_back(block.pc);
+    }
+    block.native = entry.code;
+    block.links = newLinks(cpu, entry.exits);
+    block.tier = static_cast<JitTier>(key[0]);
+}
+
+// Books a compiled job to the Cpu that requested it
+static void account(Cpu &cpu, const CompileJob &job)
 {
-    // addr_t pc_offset = 0;
+    ++cpu.stats.blocks_compiled;
+    cpu.stats.compile_ns += job.compile_ns;
+    cpu.stats.max_compile_ns = std::max(cpu.stats.max_compile_ns, job.compile_ns);
+    cpu.stats.code_bytes += job.result->code_size;
+    if(cpu.output_log) {fputs(job.listing.c_str(), cpu.output_log);}
+}
+
+Cpu::func_t translate(Cpu &cpu, BlockDescriptor &block, JitTier tier)
+{
+    std::shared_ptr<CompileJob> job = makeJob(cpu, block, tier);
+    const CodeCache::Entry *entry = cpu.code_cache->find(job->key);
+    if(entry)
+    {
+        ++cpu.stats.blocks_adopted;
+    }
+    else
+    {
+        compile(*job);
+        if(!(entry = job->result))
+        {
+            return nullptr;
+        }
+        account(cpu, *job);
+    }
+
+    install(cpu, block, job->key, *entry);
+    return entry->code;
+}
+
+bool requestTranslation(Cpu &cpu, BlockDescriptor &block, JitTier tier)
+{
+    if(!cpu.tier_policy.compile_threads)
+    {
+        return translate(cpu, block, tier) != nullptr;
+    }
+
+    std::shared_ptr<CompileJob> job = makeJob(cpu, block, tier);
+    if(const CodeCache::Entry *entry = cpu.code_cache->find(job->key))
+    {
+        ++cpu.stats.blocks_adopted;
+        install(cpu, block, job->key, *entry);
+        return true;
+    }
+    block.pending = job;
+    CompileQueue::shared().submit(std::move(job), cpu.tier_policy.compile_threads);
+    return true;
+}
+
+bool finishTranslation(Cpu &cpu, BlockDescriptor &block)
+{
+    std::shared_ptr<CompileJob> job = std::move(block.pending);
+    if(!job->result)
+    {
+        return false;
+    }
+    account(cpu, *job);
+
+    //stores may have rewritten the code while it was compiled, the blocks
+    //are then dropped and decoded again
+    if(!matchesMemory(cpu, job->key))
+    {
+        for(addr_t pc : job->pcs)
+        {
+            invalidateBlock(cpu, pc);
+        }
+        return true;
+    }
+    install(cpu, block, job->key, *job->result);
+    return true;
+}
+
+// Installs the best cached unit headed at the block whose instructions still
+// match guest memory, e.g. one loaded from disk or compiled by another Cpu,
+// so the block starts out native.
+bool adoptCached(Cpu &cpu, BlockDescriptor &block)
+{
+    const CodeCache::Key *best_key = nullptr;
+    const CodeCache::Entry *best = nullptr;
+    const uint32_t recording = recordingBits(cpu);
+    for(auto [key, entry] : cpu.code_cache->findByHead(block.pc))
+    {
+        if(((*key)[1] & ~CodeCache::KEY_LOOPS) != recording || (best_key && (*key)[0] <= (*best_key)[0]))
+        {
+            continue;
+        }
+        if(matchesMemory(cpu, *key))
+        {
+            best_key = key;
+            best = entry;
+        }
+    }
+    if(!best)
+    {
+        return false;
+    }
+
+    cpu.code_cache->hits.fetch_add(1, std::memory_order_relaxed);
+    ++cpu.stats.blocks_adopted;
+    install(cpu, block, *best_key, *best);
+    return true;
+}
+
+// Decodes the block at pc if the whole of it lies in the executable segments
+// and holds no illegal encoding, which in a text segment is most likely data
+// next to a label. Either way the dispatcher gets to it if it runs.
+static BlockDescriptor *discoverBlock(Cpu &cpu, addr_t pc)
+{
+    for(addr_t cur = pc; cpu.image.inText(cur, RV32I_INTR_SIZE); cur += RV32I_INTR_SIZE)
+    {
+        const Instr instr = cpu.predecoded.at(cpu.getMemBase(), cur);
+        if(instr.exec == executeIllegal)
+        {
+            return nullptr;
+        }
+        if(is_bb_end(instr))
+        {
+            return &lookup(cpu, pc);
+        }
+    }
+    return nullptr;
+}
+
+// Successors known without running the block: both directions of a branch,
+// the target of a JAL and the return address of a call, which the callee
+// comes back to through a JALR
+static void staticSuccessors(const BlockDescriptor &block, std::vector<addr_t> &out)
+{
+    const Instr &last = block.instrs.back();
+    const addr_t last_pc = block.pc + (block.instrs.size() - 1) * RV32I_INTR_SIZE;
+    const addr_t next_pc = last_pc + RV32I_INTR_SIZE;
+    switch (last.opcode)
+    {
+        case Opcode::Branch:
+            out.push_back(last_pc + last.imm);
+            out.push_back(next_pc);
+            break;
+        case Opcode::Jal:
+            out.push_back(last_pc + last.imm);
+            if(last.rd_id) {out.push_back(next_pc);}
+            break;
+        case Opcode::Jalr:
+            if(last.rd_id) {out.push_back(next_pc);}
+            break;
+        case Opcode::System:
+            out.push_back(next_pc);
+            break;
+        default:
+            break;
+    }
+}
+
+std::size_t translateAhead(Cpu &cpu, unsigned nthreads)
+{
+    if(cpu.tier_policy.mode == TierMode::InterpOnly)
+    {
+        return 0;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    //flood the static control flow graph from every entry point
+    std::vector<BlockDescriptor *> blocks {};
+    std::unordered_set<addr_t> seen {};
+    std::vector<addr_t> work(cpu.image.entries.begin(), cpu.image.entries.end());
+    while(!work.empty())
+    {
+        const addr_t pc = work.back();
+        work.pop_back();
+        if((pc & 0b11) || !seen.insert(pc).second)
+        {
+            continue;
+        }
+        BlockDescriptor *block = cpu.bb_table.find(pc);
+        if(!block && !(block = discoverBlock(cpu, pc)))
+        {
+            continue;
+        }
+        blocks.push_back(block);
+        staticSuccessors(*block, work);
+    }
+
+    //blocks headed by ECALL/EBREAK stay interpreted, cached units are adopted
+    std::size_t installed = 0;
+    std::vector<std::pair<BlockDescriptor *, std::shared_ptr<CompileJob>>> jobs {};
+    for(BlockDescriptor *block : blocks)
+    {
+        if(block->tier != JitTier::None || block->pending || block->instrs.front().opcode == Opcode::System)
+        {
+            continue;
+        }
+        if(adoptCached(cpu, *block))
+        {
+            ++installed;
+            continue;
+        }
+        jobs.emplace_back(block, makeJob(cpu, *block, JitTier::Baseline));
+    }
+
+    //compile() only touches the job and the code cache, the calling thread
+    //takes part
+    std::atomic<std::size_t> next {0};
+    auto worker = [&jobs, &next]()
+    {
+        for(std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < jobs.size();)
+        {
+            compile(*jobs[i].second);
+        }
+    };
+    nthreads = std::max(1u, std::min<unsigned>(nthreads, jobs.size()));
+    std::vector<std::thread> threads {};
+    for(unsigned i = 1; i < nthreads; ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    //a unit that failed to compile is requested again once its block runs
+    for(auto &[block, job] : jobs)
+    {
+        if(!job->result)
+        {
+            continue;
+        }
+        account(cpu, *job);
+        install(cpu, *block, job->key, *job->result);
+        ++installed;
+    }
+
+    cpu.stats.aot_blocks += installed;
+    cpu.stats.aot_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return installed;
+}
+
+// Called by code compiled with RingTrace, records to the ring of the thread
+[[maybe_unused]] static void jitTraceEvent(uint32_t kind_reg, uint32_t pc, uint32_t addr, uint32_t value)
+{
+    RingTrace::record(kind_reg & 0xff, kind_reg >> 8, pc, addr, value);
+}
+
+template<typename Addr_t, typename Value_t>
+static void emitTraceEvent(asmjit::x86::Compiler &cc, uint8_t kind, unsigned reg, addr_t pc, const Addr_t &addr, const Value_t &value)
+{
+    asmjit::InvokeNode *node;
+    cc.invoke(&node, (uint64_t)jitTraceEvent, asmjit::FuncSignature::build<void, uint32_t, uint32_t, uint32_t, uint32_t>());
+    node->setArg(0, asmjit::Imm(kind | reg << 8));
+    node->setArg(1, asmjit::Imm(pc));
+    node->setArg(2, addr);
+    node->setArg(3, value);
+}
+
+// Compiles job into job.result. Touches nothing but the job and the code
+// cache, so it runs on any thread. Tracer decides which events the code
+// records, NoTrace code is the same as without tracing.
+template<typename Tracer>
+static void compileWith(CompileJob &job)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const bool fold = job.tier >= JitTier::Optimized;
+
     asmjit::CodeHolder code;
-    code.init(cpu.rt.environment(), cpu.rt.cpuFeatures());
+    code.init(job.cache->environment(), job.cache->cpuFeatures());
 
     asmjit::x86::Compiler cc(&code);
-    cc.addFunc(asmjit::FuncSignature::build<int>());
+    asmjit::FuncNode *func = cc.addFunc(asmjit::FuncSignature::build<BlockLink *, CpuState *, mem_t *, BlockLink *>());
+
+    asmjit::x86::Gp state = cc.newIntPtr("state");
+    asmjit::x86::Gp mem = cc.newIntPtr("mem");
+    asmjit::x86::Gp links = cc.newIntPtr("links");
+    func->setArg(0, state);
+    func->setArg(1, mem);
+    func->setArg(2, links);
+    std::vector<addr_t> exits {};
 
-    asmjit::FileLogger logger(cpu.output_log);
-    code.setLogger(&logger);
+    asmjit::StringLogger logger;
+    if(job.logged)
+    {
+        code.setLogger(&logger);
+    }
 
-    asmjit::x86::Gp dst1 = cc.newGpd();
-    asmjit::x86::Gp dst2 = cc.newGpd();
+    asmjit::x86::Gp tmp = cc.newGpd();
     asmjit::x86::Gp ret = cc.newGpd();
+    asmjit::x86::Gp link = cc.newIntPtr("link");
+    asmjit::x86::Gp addr = cc.newUIntPtr("addr");
+
+    std::vector<SideExit> side_exits {};
 
-    TranslationAttr attr {cc, dst1, dst2, ret, nullptr, nullptr};
-    int pc_offset = 0;
+    //a loop may exit after any of its writes, so it stores all of them and
+    //loads the written ones up front to keep the stored values defined
+    uint32_t read = 0, written = 0;
+    usedRegs(job.blocks, read, written);
+    GuestRegs regs(cc, state);
+    regs.load(job.loops ? read | written : read);
+    auto spill = [&]() {return job.loops ? written : regs.dirty();};
 
-    for(auto instr : bb)
+    //the new value of rd of the instruction at pc
+    auto traceRegWrite = [&](const Instr &instr, addr_t pc)
     {
-        switch (instr.opcode)
+        if constexpr (Tracer::enabled)
         {
-            case Opcode::Imm:
-                {
-                    if(instr.rd_id == 0)
-                    {
-                        cc.nop();
-                    }
-                    else
-                    {
-                        cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                        cc.mov(dst2, instr.imm);
-                        translateImm(instr, attr);
-                        cc.mov( toDwordPtr((cpu.regs[instr.rd_id])), dst1);
-                    }
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Op:
-                {
-                    if(instr.rd_id == 0)
+            emitTraceEvent(cc, TraceEvent::RegWrite, instr.rd_id, pc, asmjit::Imm(0), regs.use(instr.rd_id));
+        }
+    };
+
+    asmjit::Label L_HEAD = cc.newLabel();
+    cc.bind(L_HEAD);
+
+    for(std::size_t b = 0; b < job.blocks.size(); ++b)
+    {
+        const bool last_block = b + 1 == job.blocks.size();
+        //the terminator stays inside the unit and continues at next_pc
+        const bool continues = !last_block || job.loops;
+        const addr_t next_pc = last_block ? job.pcs.front() : job.pcs[b + 1];
+        addr_t pc = job.pcs[b] - RV32I_INTR_SIZE;
+
+        //blocks only leave at their terminator, so they retire as a whole;
+        //a system or illegal instruction left to the interpreter is counted there
+        const Instr &terminator = job.blocks[b].back();
+        const bool interpreted = terminator.exec == executeIllegal || (terminator.opcode == Opcode::System && !compilesSystem(terminator));
+        cc.add(asmjit::x86::qword_ptr(state, offsetof(CpuState, instret)), static_cast<int32_t>(job.blocks[b].size() - interpreted));
+        if constexpr (Tracer::enabled)
+        {
+            emitTraceEvent(cc, TraceEvent::Block, 0, job.pcs[b], asmjit::Imm(0), asmjit::Imm(0));
+        }
+
+        for(Instr &instr : job.blocks[b])
+        {
+            pc += RV32I_INTR_SIZE;
+            //only ever the terminator
+            if(instr.exec == executeIllegal)
+            {
+                regs.store(spill());
+                cc.mov(pcDwordPtr(state), pc);
+                translateDynamicExit(cc, link);
+                continue;
+            }
+            if(fold && isDead(instr))
+            {
+                continue;
+            }
+
+            switch (instr.opcode)
+            {
+                case Opcode::Imm:
                     {
-                        cc.nop();
+                        if(instr.rd_id == 0)
+                        {
+                            cc.nop();
+                        }
+                        else if(fold && translateIdiom(instr, cc, regs))
+                        {
+                        }
+                        else
+                        {
+                            asmjit::x86::Gp &rd = regs.def(instr.rd_id);
+                            TranslationAttr attr {cc, rd, tmp, ret, mem, addr, nullptr, nullptr};
+                            cc.mov(rd, regs.use(instr.rs1_id));
+                            cc.mov(tmp, instr.imm);
+                            translateImm(instr, attr);
+                        }
+                        if(instr.rd_id != 0)
+                        {
+                            traceRegWrite(instr, pc);
+                        }
+                        break;
                     }
-                    else
+                case Opcode::Op:
                     {
-                        cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                        cc.mov(dst2, toDwordPtr(cpu.regs[instr.rs2_id]));
-                        translateOp(instr, attr);
-                        cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), dst1);
+                        if(instr.rd_id == 0)
+                        {
+                            cc.nop();
+                        }
+                        else
+                        {
+                            //rd can only be computed in place if it does not hold rs2
+                            const bool in_place = instr.rd_id != instr.rs2_id;
+                            asmjit::x86::Gp dst = in_place ? regs.def(instr.rd_id) : tmp;
+                            asmjit::x86::Gp src = regs.use(instr.rs2_id);
+                            TranslationAttr attr {cc, dst, src, ret, mem, addr, nullptr, nullptr};
+                            cc.mov(dst, regs.use(instr.rs1_id));
+                            translateOp(instr, attr);
+                            if(!in_place)
+                            {
+                                cc.mov(regs.def(instr.rd_id), tmp);
+                            }
+                            traceRegWrite(instr, pc);
+                        }
+                        break;
                     }
-
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Load:
-                {
-                    if(instr.rd_id == 0)
+                case Opcode::Load:
                     {
-                        cc.nop();
+                        if(instr.rd_id == 0)
+                        {
+                            cc.nop();
+                        }
+                        else
+                        {
+                            TranslationAttr attr {cc, tmp, tmp, ret, mem, addr, nullptr, nullptr};
+                            translateAddress(instr, attr, regs.use(instr.rs1_id));
+                            translateLoad(instr, attr);
+                            cc.mov(regs.def(instr.rd_id), ret);
+                            if constexpr (Tracer::enabled)
+                            {
+                                emitTraceEvent(cc, TraceEvent::MemRead, 1u << (instr.funct3 & 0b11), pc, addr.r32(), ret);
+                            }
+                            traceRegWrite(instr, pc);
+                        }
+                        break;
                     }
-                    else
+                case Opcode::Store:
                     {
-                        cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                        cc.mov(dst2, instr.imm);
-                        cc.add(dst1, dst2);
-
-                        asmjit::InvokeNode *invokeNode {};
-                        attr.invokeNode = &invokeNode;
-                        translateLoad(instr, attr);
-
-                        invokeNode->setArg(0, &cpu);
-                        invokeNode->setArg(1, dst1);
-                        invokeNode->setRet(0, ret);
-                        if((I::Load::funct3)instr.funct3 == I::Load::funct3::LBU || (I::Load::funct3)instr.funct3 == I::Load::funct3::LHU)
+                        TranslationAttr attr {cc, tmp, regs.use(instr.rs2_id), ret, mem, addr, nullptr, nullptr};
+                        translateAddress(instr, attr, regs.use(instr.rs1_id));
+                        translateStore(instr, attr);
+                        if constexpr (Tracer::enabled)
                         {
-                            cc.and_(ret, dst2);
+                            emitTraceEvent(cc, TraceEvent::MemWrite, 1u << instr.funct3, pc, addr.r32(), regs.use(instr.rs2_id));
                         }
-                        cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), ret);
+                        break;
                     }
+                case Opcode::Branch:
+                    {
+                        TranslationAttr attr {cc, tmp, tmp, ret, mem, addr, nullptr, nullptr};
+                        cc.cmp(regs.use(instr.rs1_id), regs.use(instr.rs2_id));
 
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Store:
-                {
-                    cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                    cc.mov(dst2, instr.imm);
-                    cc.add(dst1, dst2);
-                    cc.mov(dst2, toDwordPtr(cpu.regs[instr.rs2_id]));
-
-                    asmjit::InvokeNode *invokeNode {};
-                    attr.invokeNode = &invokeNode;
-                    translateStore(instr, attr);
-                    invokeNode->setArg(0, &cpu);
-                    invokeNode->setArg(1,dst1);
-                    invokeNode->setArg(2,dst2);
-
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Branch:
-                {
-                    pc_offset += cpu.getPc();
-
-                    asmjit::Label L_BRANCH = cc.newLabel();
-                    asmjit::Label L_END = cc.newLabel();
-                    attr.L_BRANCH = &L_BRANCH;
-
-                    cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                    cc.mov(dst2, toDwordPtr(cpu.regs[instr.rs2_id]));
+                        if(continues)
+                        {
+                            //fall through on the hot direction, the cold one is a side exit
+                            Instr cold = instr;
+                            addr_t cold_pc = pc + instr.imm;
+                            if(next_pc == cold_pc)
+                            {
+                                //BEQ/BNE, BLT/BGE and BLTU/BGEU differ in the low bit
+                                cold.funct3 ^= 1;
+                                cold_pc = pc + RV32I_INTR_SIZE;
+                            }
+                            SideExit &side = side_exits.emplace_back(SideExit {cc.newLabel(), cold_pc, spill()});
+                            attr.L_BRANCH = &side.L_EXIT;
+                            translateBranch(cold, attr);
+                        }
+                        else
+                        {
+                            asmjit::Label L_BRANCH = cc.newLabel();
+                            attr.L_BRANCH = &L_BRANCH;
 
-                    cc.cmp(dst1, dst2);
-                    translateBranch(instr, attr);
-                    cc.mov(dst1, instr.size);
-                    cc.jmp(L_END);
+                            translateBranch(instr, attr);
+                            regs.store(spill());
+                            translateExit(cc, state, links, link, exits, pc + RV32I_INTR_SIZE);
 
-                    cc.bind(L_BRANCH);
-                    cc.mov(dst1, instr.imm);
+                            cc.bind(L_BRANCH);
+                            regs.store(spill());
+                            translateExit(cc, state, links, link, exits, pc + instr.imm);
+                        }
+                        break;
+                    }
+                case Opcode::Jalr:
+                    {
+                        //target is computed before rd is written, rd may be rs1
+                        cc.mov(tmp, regs.use(instr.rs1_id));
+                        cc.add(tmp, instr.imm);
+                        cc.and_(tmp, 0xfffffffe);
+                        cc.mov(pcDwordPtr(state), tmp);
+                        if(job.profiled && isLinkReg(instr.rs1_id) && instr.rs1_id != instr.rd_id)
+                        {
+                            translatePopCall(cc, state);
+                        }
 
-                    cc.bind(L_END);
-                    cc.mov(dst2, pc_offset);
-                    cc.add(dst2, dst1);
-                    cc.mov(asmjit::x86::dword_ptr((uint64_t)(&(cpu.pc_))),dst2);
+                        if(instr.rd_id != 0)
+                        {
+                            cc.mov(regs.def(instr.rd_id), pc + RV32I_INTR_SIZE);
+                            traceRegWrite(instr, pc);
+                            if(job.profiled && isLinkReg(instr.rd_id))
+                            {
+                                translatePushCall(cc, state, addr, pc + RV32I_INTR_SIZE);
+                            }
+                        }
 
-                    pc_offset = 0;
-                    break;
-                }
-            case Opcode::Jalr:
-                {
-                    //advance previous pc
-                    pc_offset += cpu.getPc();
+                        regs.store(spill());
+                        translateDynamicExit(cc, link);
+                        break;
+                    }
+                case Opcode::Jal:
+                    {
+                        if(instr.rd_id != 0)
+                        {
+                            cc.mov(regs.def(instr.rd_id), pc + RV32I_INTR_SIZE);
+                            traceRegWrite(instr, pc);
+                            if(job.profiled && isLinkReg(instr.rd_id))
+                            {
+                                translatePushCall(cc, state, addr, pc + RV32I_INTR_SIZE);
+                            }
+                        }
 
-                    if(instr.rd_id != 0)
+                        if(!continues)
+                        {
+                            regs.store(spill());
+                            translateExit(cc, state, links, link, exits, pc + instr.imm);
+                        }
+                        break;
+                    }
+                case Opcode::Auipc:
                     {
-                        cc.mov(dst2, pc_offset);
-                        cc.mov(dst1, instr.size);
-                        cc.add(dst2, dst1);
-                        cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), dst2);
+                        if(instr.rd_id != 0)
+                        {
+                            cc.mov(regs.def(instr.rd_id), pc + (instr.imm << 12));
+                            traceRegWrite(instr, pc);
+                        }
+                        break;
                     }
-
-                    cc.mov(dst1, toDwordPtr(cpu.regs[instr.rs1_id]));
-                    cc.mov(dst2, instr.imm);
-                    cc.add(dst1, dst2);
-                    cc.mov(dst2, 0xfffffffe);
-                    cc.and_(dst1, dst2);
-
-                    cc.mov(asmjit::x86::dword_ptr((uint64_t)(&(cpu.pc_))),dst1);
-
-                    pc_offset = 0;
-                    break;
-                }
-            case Opcode::Jal:
-                {
-                    pc_offset = pc_offset + cpu.getPc();
-                    if(instr.rd_id != 0)
+                case Opcode::Lui:
                     {
-                        cc.mov(dst1, pc_offset + instr.size);
-                        cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), dst1);
+                        if(instr.rd_id == 0)
+                        {
+                            cc.nop();
+                        }
+                        else
+                        {
+                            cc.mov(regs.def(instr.rd_id), (instr.imm << 12));
+                            traceRegWrite(instr, pc);
+                        }
+                        break;
                     }
-
-                    cc.mov(dst1,pc_offset + instr.imm);
-                    cc.mov(asmjit::x86::dword_ptr((uint64_t)(&(cpu.pc_))),dst1);
-                    pc_offset = 0;
-                    break;
-                }
-            case Opcode::Auipc:
-                {
-                    //advance previous pc
-                    addr_t new_pc = pc_offset + cpu.getPc() + (instr.imm << 12);
-
-                    cc.mov(dst1, new_pc);
-                    cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), dst1);
-
-    // cpu.setReg(instr.rd_id, cpu.getPc() + (instr.imm << 12));
-    // cpu.advancePc();
-                    // cc.mov(asmjit::x86::dword_ptr((uint64_t)(&(cpu.pc_))),dst1);
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Lui:
-                {
-                    if(instr.rd_id != 0)
+                case Opcode::Fence:
                     {
                         cc.nop();
+                        break;
                     }
-                    else
+                case Opcode::System:
                     {
-                        cc.mov(dst1, (instr.imm << 12));
-                        cc.mov(toDwordPtr(cpu.regs[instr.rd_id]), dst1);
+                        if(!compilesSystem(instr))
+                        {
+                            regs.store(spill());
+                            cc.mov(pcDwordPtr(state), pc);
+                            translateDynamicExit(cc, link);
+                            break;
+                        }
+
+                        if(instr.rd_id != 0)
+                        {
+                            using namespace I::System;
+                            if((instr.imm & 0xf7f) == Csr::TIME)
+                            {
+                                asmjit::InvokeNode *node;
+                                cc.invoke(&node, asmjit::x86::qword_ptr(state, offsetof(CpuState, clock)), asmjit::FuncSignature::build<uint64_t>());
+                                node->setRet(0, addr);
+                            }
+                            else
+                            {
+                                //instret already counts this instruction
+                                cc.mov(addr, asmjit::x86::qword_ptr(state, offsetof(CpuState, instret)));
+                                cc.sub(addr, 1);
+                            }
+                            if(instr.imm & 0x80)
+                            {
+                                cc.shr(addr, 32);
+                            }
+                            cc.mov(regs.def(instr.rd_id), addr.r32());
+                            traceRegWrite(instr, pc);
+                        }
+                        if(!continues)
+                        {
+                            regs.store(spill());
+                            translateExit(cc, state, links, link, exits, pc + RV32I_INTR_SIZE);
+                        }
+                        break;
                     }
-                    pc_offset += instr.size;
-                    break;
-                }
-            case Opcode::Fence:
-                {
-                    cc.nop();
-                    pc_offset += instr.size;
-                }
-            case Opcode::System:
-                {
-                    pc_offset += cpu.getPc();
-                    cc.mov(dst1, pc_offset);
-                    cc.mov(asmjit::x86::dword_ptr((uint64_t)(&(cpu.pc_))),dst1);
-                    pc_offset = 0;
-                }
-            default:{}
+                default:{}
+            }
+        }
+
+        if(last_block && job.loops)
+        {
+            //a loop leaves to the dispatcher when a profiler sample is due
+            SideExit &sample = side_exits.emplace_back(SideExit {cc.newLabel(), job.pcs.front(), spill()});
+            cc.mov(addr, asmjit::x86::qword_ptr(state, offsetof(CpuState, instret)));
+            cc.cmp(addr, asmjit::x86::qword_ptr(state, offsetof(CpuState, sample_at)));
+            cc.jae(sample.L_EXIT);
+            cc.jmp(L_HEAD);
         }
     }
 
+    for(SideExit &side : side_exits)
+    {
+        cc.bind(side.L_EXIT);
+        regs.store(side.dirty);
+        translateExit(cc, state, links, link, exits, side.target);
+    }
+
     cc.endFunc();
     cc.finalize();
 
+    if(job.logged)
+    {
+        job.listing = logger.data();
+    }
+
     Cpu::func_t exec;
-    asmjit::Error err = cpu.rt.add(&exec, &code);
+    asmjit::Error err = job.cache->add(&exec, &code);
     if (err)
     {
         std::cout << "Failed to translate\n"
             << asmjit::DebugUtils::errorAsString(err)
             << std::endl;
-        return nullptr;
+        return;
     }
-
-    return exec;
+    job.result = job.cache->insert(job.key, CodeCache::Entry {exec, code.codeSize(), std::move(exits)});
+    //another thread may have won the key and freed this copy
+    if(!job.perf_name.empty() && job.result->code == exec)
+    {
+        PerfJitLog::shared().codeLoaded(reinterpret_cast<const void *>(exec), code.codeSize(), job.perf_name);
+    }
+    job.compile_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
-
+void compile(CompileJob &job)
+{
+#ifdef RV32I_TRACING
+    if(job.traced)
+    {
+        compileWith<RingTrace>(job);
+        return;
+    }
+#endif
+    compileWith<NoTrace>(job);
+}
@@ -2,6 +2,9 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+//guest memory the tests may use without mapping it, from address 0
+static const std::size_t TEST_MEM_SIZE = std::size_t(16) << 20;
+
 struct RV32I_Test : public testing::Test
 {
     Memory *mem;
@@ -12,8 +15,10 @@ struct RV32I_Test : public testing::Test
         addi_x3_x4_5  = 0x00520193,
         slli_x3_x4_5  = 0x00521193,
         slti_x3_x4_5  = 0x00522193,
+        srai_x3_x4_1  = 0x40125193,
         sltiu_x3_x4_5 = 0x00523193,
         beq_x3_x4_32  = 0x02418063,
+        bge_x3_x4_32  = 0x0241d063,
         jal_x3_32     = 0x020001ef,
         jalr_x3_x4_32 = 0x020201e7,
         add_x3_x4_x5  = 0x005201b3,
@@ -21,9 +26,13 @@ struct RV32I_Test : public testing::Test
         lw_x3_x4_32   = 0x02022183,
         lui_x3_32     = 0x000201b7,
         auipc_x3_32   = 0x00020197,
+        rdinstret_x3  = 0xc02021f3,
+        rdinstreth_x3 = 0xc82021f3,
+        rdtime_x3     = 0xc01021f3,
+        csrw_cycle_x5 = 0xc0029073,
     };
 
-    void SetUp() {mem = new Memory; cpu = new Cpu{mem};};
+    void SetUp() {mem = new Memory; mem->commit(0, TEST_MEM_SIZE); cpu = new Cpu{mem};};
     void TearDown() {delete mem; delete cpu;};
 };
 
@@ -32,7 +41,55 @@ struct RV32I_Test_Translate : public testing::Test
     Memory *mem;
     Cpu *cpu;
 
-    void SetUp() {mem = new Memory; cpu = new Cpu{mem};};
+    static instr_t itype(Opcode opcode, uint8_t funct3, int rd, int rs1, imm_t imm)
+    {
+        return (imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | static_cast<instr_t>(opcode);
+    }
+    static instr_t rtype(uint8_t funct3, uint8_t funct7, int rd, int rs1, int rs2)
+    {
+        return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | static_cast<instr_t>(Opcode::Op);
+    }
+    static instr_t stype(uint8_t funct3, int rs1, int rs2, imm_t imm)
+    {
+        return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+               ((imm & 0x1f) << 7) | static_cast<instr_t>(Opcode::Store);
+    }
+    static instr_t addi(int rd, int rs1, imm_t imm)
+    {
+        return itype(Opcode::Imm, static_cast<uint8_t>(I::Imm::funct3::ADDI), rd, rs1, imm);
+    }
+    static instr_t btype(B::Branch::funct3 funct3, int rs1, int rs2, imm_t imm)
+    {
+        return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) |
+               (static_cast<instr_t>(funct3) << 12) | (((imm >> 1) & 0xf) << 8) |
+               (((imm >> 11) & 1) << 7) | static_cast<instr_t>(Opcode::Branch);
+    }
+    static instr_t bne(int rs1, int rs2, imm_t imm)
+    {
+        return btype(B::Branch::funct3::BNE, rs1, rs2, imm);
+    }
+    static instr_t jal(int rd, imm_t imm)
+    {
+        return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+               (((imm >> 12) & 0xff) << 12) | (rd << 7) | static_cast<instr_t>(Opcode::Jal);
+    }
+    static instr_t csrrs(int rd, uint32_t csr)
+    {
+        return (csr << 20) | (static_cast<instr_t>(I::System::funct3::CSRRS) << 12) | (rd << 7) | static_cast<instr_t>(Opcode::System);
+    }
+    static constexpr instr_t ecall = 0x00000073;
+    static constexpr instr_t ebreak = 0x00100073;
+
+    void write_program(const std::vector<instr_t> &program, addr_t addr = 0)
+    {
+        for(instr_t instr : program)
+        {
+            cpu->store<word_t>(addr, instr);
+            addr += sizeof(instr_t);
+        }
+    }
+
+    void SetUp() {mem = new Memory; mem->commit(0, TEST_MEM_SIZE); cpu = new Cpu{mem};};
     void TearDown() {delete mem; delete cpu;};
 };
 
@@ -0,0 +1,142 @@
+#include "batch.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+TEST(RV32I_Test_Batch, Test_parse_batch_file)
+{
+    std::string filename = ::testing::TempDir() + "rv32i_jobs";
+    std::ofstream(filename) << "# comment\n"
+                            << "./test/data/fib_out_5\n"
+                            << "\n"
+                            << "./test/data/HelloWorld one two < in.txt > out.txt\n";
+
+    std::vector<BatchJob> jobs {};
+    ASSERT_TRUE(parse_batch_file(filename.c_str(), jobs));
+    ASSERT_EQ(jobs.size(), 2u);
+    EXPECT_EQ(jobs[0].elf, "./test/data/fib_out_5");
+    EXPECT_EQ(jobs[1].argv, (std::vector<std::string> {"./test/data/HelloWorld", "one", "two"}));
+    EXPECT_EQ(jobs[1].stdin_path, "in.txt");
+    EXPECT_EQ(jobs[1].stdout_path, "out.txt");
+    std::remove(filename.c_str());
+}
+
+TEST(RV32I_Test_Batch, Test_run_batch)
+{
+    std::string out = ::testing::TempDir() + "rv32i_hello_out";
+    std::vector<BatchJob> jobs {};
+    for(int i = 0; i < 4; ++i)
+    {
+        jobs.push_back({"./test/data/fib_out_10", {}, "", ""});
+        jobs.push_back({"./test/data/fib_out_5", {}, "", ""});
+    }
+    jobs.push_back({"./test/data/HelloWorld", {}, "", out});
+    jobs.push_back({"./test/data/missing", {}, "", ""});
+
+    std::vector<JobResult> results = run_batch(jobs, 3, TierPolicy {});
+    ASSERT_EQ(results.size(), jobs.size());
+    for(int i = 0; i < 8; ++i)
+    {
+        EXPECT_EQ(results[i].status, JobResult::Status::Ok);
+        EXPECT_EQ(results[i].state.regs[15], i % 2 ? 5 : 55);
+        EXPECT_GT(results[i].instret, 0u);
+    }
+
+    EXPECT_EQ(results[8].status, JobResult::Status::Ok);
+    EXPECT_EQ(results[8].exit_code, 0xfe);
+    std::ifstream hello(out);
+    std::string text((std::istreambuf_iterator<char>(hello)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(text, std::string("Hello RISC-V\n\0", 14));
+    std::remove(out.c_str());
+
+    EXPECT_EQ(results[9].status, JobResult::Status::LoadError);
+}
+
+TEST(RV32I_Test_Batch, Test_faulting_job)
+{
+    //lui x5, 0x40000; lw x6, 0(x5); ebreak: loads from memory nothing mapped
+    const word_t text[3] = {0x400002b7, 0x0002a303, 0x00100073};
+    std::vector<char> file(0x1000 + sizeof(text));
+
+    Elf32_Ehdr ehdr {};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_RISCV;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = 0x10000;
+    ehdr.e_phoff = sizeof(Elf32_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf32_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf32_Phdr);
+    ehdr.e_phnum = 1;
+    Elf32_Phdr phdr = {PT_LOAD, 0x1000, 0x10000, 0x10000, sizeof(text), sizeof(text), PF_R | PF_X, 0x1000};
+    std::memcpy(file.data(), &ehdr, sizeof(ehdr));
+    std::memcpy(file.data() + ehdr.e_phoff, &phdr, sizeof(phdr));
+    std::memcpy(file.data() + 0x1000, text, sizeof(text));
+    std::string filename = ::testing::TempDir() + "rv32i_faulting_job";
+    std::ofstream(filename, std::ios::binary).write(file.data(), file.size());
+
+    //the fault stops its own job, the jobs around it on the other threads run on
+    std::vector<BatchJob> jobs {};
+    for(int i = 0; i < 3; ++i)
+    {
+        jobs.push_back({"./test/data/fib_out_10", {}, "", ""});
+        jobs.push_back({filename, {}, "", ""});
+    }
+    std::vector<JobResult> results = run_batch(jobs, 2, TierPolicy {});
+    ASSERT_EQ(results.size(), jobs.size());
+    for(std::size_t i = 0; i < results.size(); i += 2)
+    {
+        EXPECT_EQ(results[i].status, JobResult::Status::Ok);
+        EXPECT_EQ(results[i].state.regs[15], 55);
+        EXPECT_EQ(results[i + 1].status, JobResult::Status::RunError);
+    }
+    std::remove(filename.c_str());
+}
+
+TEST(RV32I_Test_Batch, Test_job_without_memory)
+{
+    //guest memory can't be reserved under a 2 GiB address space limit
+    EXPECT_EXIT(
+        {
+            rlimit limit {};
+            limit.rlim_cur = limit.rlim_max = rlim_t(2) << 30;
+            setrlimit(RLIMIT_AS, &limit);
+            JobResult result = run_job({"./test/data/fib_out_5", {}, "", ""}, TierPolicy {});
+            std::exit(result.status == JobResult::Status::LoadError ? 0 : 1);
+        },
+        ::testing::ExitedWithCode(0), "");
+}
+
+TEST(RV32I_Test_Batch, Test_write_report_escapes)
+{
+    std::vector<BatchJob> jobs = {{"dir\\a \"b\".elf", {}, "", ""}};
+    std::vector<JobResult> results(1);
+    std::ostringstream os;
+    write_report(os, jobs, results);
+    EXPECT_NE(os.str().find("\"elf\": \"dir\\\\a \\\"b\\\".elf\""), std::string::npos) << os.str();
+}
+
+TEST(RV32I_Test_Batch, Test_close_guest_files)
+{
+    SyscallState sys {};
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    EXPECT_EQ(sys.addFile(fds[0]), 3);
+    EXPECT_EQ(sys.addFile(fds[1]), 4);
+    sys.closeFiles();
+    EXPECT_TRUE(sys.files.empty());
+    EXPECT_EQ(fcntl(fds[0], F_GETFD), -1);
+    EXPECT_EQ(fcntl(fds[1], F_GETFD), -1);
+}
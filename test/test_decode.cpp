@@ -1,6 +1,9 @@
 #include "rv32i.hpp"
 #include "test.hpp"
 #include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
 
 TEST_F(RV32I_Test, TEST_DECODE_IMM)
 {
@@ -79,3 +82,78 @@ TEST_F(RV32I_Test, TEST_DECODE_LUI)
     EXPECT_EQ(instr.imm, 32);
 }
 
+TEST_F(RV32I_Test, TEST_DECODE_STORE_ODD_OFFSET)
+{
+    //sb x3, 1(x4)
+    Instr instr = decode(0x003200a3);
+    EXPECT_EQ(instr.opcode, Opcode::Store);
+    EXPECT_EQ(instr.funct3, static_cast<uint8_t>(S::Store::funct3::SB));
+    EXPECT_EQ(instr.rd_id, 0);
+    EXPECT_EQ(instr.imm, 1);
+}
+
+TEST_F(RV32I_Test, TEST_DECODE_ILLEGAL)
+{
+    //all zeros, all ones, a 16-bit encoding, lw with funct3 0b011, slli with funct7 set,
+    //mul and div, add with funct7 0x21, slli and srai with imm[11:5] 0x01 and 0x21,
+    //jalr with funct3 0b001
+    const std::vector<instr_t> illegal = {0x00000000u, 0xffffffffu, 0x00004501u, 0x00023183u, 0x40521193u,
+                                          0x02a30333u, 0x02a34333u, 0x425201b3u, 0x02521193u, 0x42125193u, 0x020211e7u};
+    std::vector<Instr> bulk(illegal.size());
+    predecode(illegal.data(), illegal.size(), bulk.data());
+    for(std::size_t i = 0; i < illegal.size(); ++i)
+    {
+        EXPECT_EQ(decode(illegal[i]).exec, executeIllegal) << std::hex << illegal[i];
+        EXPECT_EQ(bulk[i].exec, executeIllegal) << std::hex << illegal[i];
+    }
+    //sub, srai and addi with a negative immediate use the same bits legally
+    for(instr_t word : {0x405201b3u, static_cast<instr_t>(INSTR_TO_TEST::srai_x3_x4_1), 0xfff00093u, static_cast<instr_t>(INSTR_TO_TEST::jalr_x3_x4_32)})
+    {
+        EXPECT_NE(decode(word).exec, executeIllegal) << std::hex << word;
+    }
+}
+
+TEST_F(RV32I_Test, TEST_PREDECODE_MATCHES_DECODE)
+{
+    //random words, half of them with a 32-bit opcode, and a tail the vector loop leaves
+    std::mt19937 rng(7);
+    std::vector<instr_t> words(4099);
+    for(std::size_t i = 0; i < words.size(); ++i)
+    {
+        words[i] = (i & 1) ? rng() | 0b11 : rng();
+    }
+    std::vector<Instr> bulk(words.size());
+    predecode(words.data(), words.size(), bulk.data());
+    for(std::size_t i = 0; i < words.size(); ++i)
+    {
+        Instr single = decode(words[i]);
+        ASSERT_EQ(std::memcmp(&bulk[i], &single, sizeof(Instr)), 0) << std::hex << words[i];
+    }
+}
+
+TEST_F(RV32I_Test, TEST_PREDECODE_REDECODES_WRITTEN_CODE)
+{
+    PredecodeCache cache {};
+    cpu->store<word_t>(0x1004, INSTR_TO_TEST::addi_x3_x4_5);
+    EXPECT_EQ(cache.at(cpu->getMemBase(), 0x1004).opcode, Opcode::Imm);
+    cpu->store<word_t>(0x1004, INSTR_TO_TEST::jal_x3_32);
+    Instr instr = cache.at(cpu->getMemBase(), 0x1004);
+    EXPECT_EQ(instr.opcode, Opcode::Jal);
+    EXPECT_EQ(instr.imm, 32);
+    EXPECT_EQ(cache.pages(), 1u);
+}
+
+TEST_F(RV32I_Test, TEST_ARENA_SPANS_STABLE)
+{
+    InstrArena arena {};
+    std::vector<Instr> block = {decode(INSTR_TO_TEST::addi_x3_x4_5), decode(INSTR_TO_TEST::jal_x3_32)};
+    BlockSpan first = arena.allocate(block.data(), block.size());
+    for(int i = 0; i < 4096; ++i)
+    {
+        arena.allocate(block.data(), block.size());
+    }
+    EXPECT_EQ(first.size(), 2u);
+    EXPECT_EQ(first.front().opcode, Opcode::Imm);
+    EXPECT_EQ(first.back().opcode, Opcode::Jal);
+    EXPECT_EQ(first.back().imm, 32);
+}
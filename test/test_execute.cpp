@@ -1,4 +1,12 @@
 #include "test.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 TEST_F(RV32I_Test, TEST_EXECUTE_ADDI)
 {
@@ -100,6 +108,32 @@ TEST_F(RV32I_Test, TEST_EXECUTE_AUIPC)
     EXPECT_EQ(cpu->getPc(), 4);
 }
 
+TEST_F(RV32I_Test, TEST_EXECUTE_CSR)
+{
+    //as if the reading instruction's block was counted on entry
+    cpu->getState().instret = 0x100000005;
+    Instr instr = decode(INSTR_TO_TEST::rdinstret_x3);
+    execute(*cpu, instr);
+    EXPECT_EQ(cpu->getReg(3), 4);
+    instr = decode(INSTR_TO_TEST::rdinstreth_x3);
+    execute(*cpu, instr);
+    EXPECT_EQ(cpu->getReg(3), 1);
+    EXPECT_EQ(cpu->getPc(), 8);
+
+    instr = decode(INSTR_TO_TEST::rdtime_x3);
+    execute(*cpu, instr);
+    const uint32_t before = cpu->getReg(3);
+    execute(*cpu, instr);
+    EXPECT_GT(static_cast<uint32_t>(cpu->getReg(3)) - before, 0u);
+
+    //the counters are read-only
+    cpu->setReg(5, 1);
+    instr = decode(INSTR_TO_TEST::csrw_cycle_x5);
+    execute(*cpu, instr);
+    EXPECT_TRUE(cpu->isdone());
+    EXPECT_EQ(cpu->getPc(), 16);
+}
+
 TEST_F(RV32I_Test, TEST_EXECUTE_LUI)
 {
     cpu->setPc(0);
@@ -144,3 +178,235 @@ TEST_F(RV32I_Test, TEST_EXECUTE_LOAD_STORE)
     EXPECT_EQ(cpu->getPc(), 8);
 }
 
+
+TEST_F(RV32I_Test, TEST_CPU_STATE)
+{
+    cpu->setReg(0, 42);
+    cpu->setReg(5, 42);
+    EXPECT_EQ(cpu->getReg(0), 0);
+    EXPECT_EQ(cpu->getReg(5), 42);
+
+    CpuState snapshot = cpu->getState();
+    EXPECT_EQ(snapshot.regs[5], 42);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(&cpu->getState()) % 64, 0u);
+
+    cpu->setReg(5, 0);
+    cpu->setPc(16);
+    cpu->setState(snapshot);
+    EXPECT_EQ(cpu->getReg(5), 42);
+    EXPECT_EQ(cpu->getPc(), snapshot.pc);
+}
+
+TEST_F(RV32I_Test, TEST_EXECUTE_SRAI)
+{
+    cpu->setReg(4, -8);
+    Instr instr = decode(INSTR_TO_TEST::srai_x3_x4_1);
+    execute( *cpu, instr);
+    EXPECT_EQ(cpu->getReg(3), -4);
+    EXPECT_EQ(cpu->getPc(), 4);
+}
+
+TEST_F(RV32I_Test, TEST_EXECUTE_BGE)
+{
+    cpu->setPc(0);
+    cpu->setReg(3, 2);
+    cpu->setReg(4, 2);
+    Instr instr = decode(INSTR_TO_TEST::bge_x3_x4_32);
+    execute( *cpu, instr);
+    EXPECT_EQ(cpu->getPc(), 32);
+
+    cpu->setReg(4, 3);
+    execute( *cpu, instr);
+    EXPECT_EQ(cpu->getPc(), 36);
+}
+
+TEST_F(RV32I_Test, TEST_INTERPRET_BLOCK)
+{
+    cpu->setPc(0);
+    cpu->setReg(4, 7);
+    std::vector<Instr> block = {decode(INSTR_TO_TEST::addi_x3_x4_5), decode(INSTR_TO_TEST::add_x3_x4_x5),
+                                decode(INSTR_TO_TEST::jal_x3_32)};
+    cpu->setReg(5, 1);
+    interpret_block(*cpu, block.data());
+    EXPECT_EQ(cpu->getReg(3), 12);
+    EXPECT_EQ(cpu->getPc(), 40);
+}
+
+TEST_F(RV32I_Test, TEST_INTERPRET_LONG_BLOCK)
+{
+    //dispatch must not take a host stack frame per instruction
+    const std::size_t n = 1 << 20;
+    std::vector<Instr> block(n, decode(0x00118193)); //addi x3, x3, 1
+    block.push_back(decode(INSTR_TO_TEST::jal_x3_32));
+    cpu->setPc(0);
+    interpret_block(*cpu, block.data());
+    EXPECT_EQ(cpu->getPc(), n * RV32I_INTR_SIZE + 32);
+    EXPECT_EQ(cpu->getReg(3), n * RV32I_INTR_SIZE + RV32I_INTR_SIZE);
+}
+
+TEST_F(RV32I_Test, TEST_EXECUTE_ILLEGAL)
+{
+    Instr instr = decode(0xffffffff);
+    execute( *cpu, instr);
+    EXPECT_TRUE(cpu->isdone());
+}
+
+TEST_F(RV32I_Test, TEST_MEMORY_FULL_SPACE)
+{
+    ASSERT_TRUE(mem->commit(0x80000000, sizeof(word_t)));
+    ASSERT_TRUE(mem->commit(0xfffffffe, sizeof(half_t)));
+    cpu->store<word_t>(0x80000000, 0xdeadbeef);
+    cpu->store<half_t>(0xfffffffe, 0x1234);
+    EXPECT_EQ(cpu->load<word_t>(0x80000000), 0xdeadbeef);
+    EXPECT_EQ(cpu->load<half_t>(0xfffffffe), 0x1234);
+    //untouched pages read as zero
+    ASSERT_TRUE(mem->commit(0xc0000000, sizeof(word_t)));
+    EXPECT_EQ(cpu->load<word_t>(0xc0000000), 0u);
+    EXPECT_FALSE(mem->commit(0xfffff000, 0x2000));
+    //the stack comes committed with the Cpu
+    EXPECT_EQ(cpu->getReg(2), 0x7ffffff0u);
+    cpu->store<word_t>(cpu->getReg(2), 7);
+    EXPECT_EQ(cpu->load<word_t>(cpu->getReg(2)), 7);
+}
+
+TEST_F(RV32I_Test, TEST_MEMORY_UNCOMMITTED)
+{
+    EXPECT_DEATH({volatile reg_t value = cpu->load<word_t>(0xc0000000); (void)value;}, "");
+    ASSERT_TRUE(mem->commit(0xc0000000, sizeof(word_t)));
+    cpu->store<word_t>(0xc0000000, 1);
+    ASSERT_TRUE(mem->release(0xc0000000, 0x1000));
+    EXPECT_DEATH({volatile reg_t value = cpu->load<word_t>(0xc0000000); (void)value;}, "");
+}
+
+//TESTS SYSCALLS
+static reg_t ecall(Cpu &cpu, Syscall::rv nr, std::initializer_list<reg_t> args)
+{
+    int reg = 10;
+    for(reg_t arg : args) {cpu.setReg(reg++, arg);}
+    cpu.setReg(17, static_cast<reg_t>(nr));
+    Instr instr = decode(0x00000073);
+    execute(cpu, instr);
+    return cpu.getReg(10);
+}
+
+TEST_F(RV32I_Test, TEST_SYSCALL_READ_WRITE)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    const char msg[] = "hello";
+    std::memcpy(cpu->getMemBase() + 0x1000, msg, sizeof(msg));
+    //two iovecs {0x1000, 2}, {0x1002, 4}
+    cpu->store<word_t>(0x2000, 0x1000); cpu->store<word_t>(0x2004, 2);
+    cpu->store<word_t>(0x2008, 0x1002); cpu->store<word_t>(0x200c, 4);
+
+    const int in = cpu->sys.addFile(fds[0]);
+    const int out = cpu->sys.addFile(fds[1]);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITEV, {out, 0x2000, 2}), 6);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::READ, {in, 0x3000, 16}), 6);
+    EXPECT_STREQ(reinterpret_cast<const char *>(cpu->getMemBase() + 0x3000), "hello");
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITE, {-1, 0x1000, 1}), -EBADF);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(RV32I_Test, TEST_SYSCALL_FD_TABLE)
+{
+    //host descriptors the guest did not open are out of its reach
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITE, {fds[1], 0x1000, 1}), -EBADF);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOSE, {fds[1]}), -EBADF);
+    EXPECT_NE(fcntl(fds[1], F_GETFD), -1);
+    close(fds[0]);
+    close(fds[1]);
+
+    const char path[] = "/dev/null";
+    std::memcpy(cpu->getMemBase() + 0x1000, path, sizeof(path));
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::OPENAT, {AT_FDCWD, 0x1000, O_WRONLY, 0}), 3);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::OPENAT, {AT_FDCWD, 0x1000, O_RDONLY, 0}), 4);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITE, {3, 0x1000, 4}), 4);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOSE, {3}), 0);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOSE, {3}), -EBADF);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITE, {3, 0x1000, 4}), -EBADF);
+    //the lowest free descriptor is reused
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::OPENAT, {AT_FDCWD, 0x1000, O_RDONLY, 0}), 3);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOSE, {3}), 0);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOSE, {4}), 0);
+}
+
+TEST_F(RV32I_Test, TEST_SYSCALL_MEMORY)
+{
+    cpu->sys.brk_start = cpu->sys.brk = 0x10000;
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::BRK, {0}), 0x10000);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::BRK, {0x12345}), 0x12345);
+    cpu->store<word_t>(0x12000, 7);
+    //shrinking gives the pages back, growing again reads zero
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::BRK, {0x10000}), 0x10000);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::BRK, {0x13000}), 0x13000);
+    EXPECT_EQ(cpu->load<word_t>(0x12000), 0);
+
+    reg_t map = ecall(*cpu, Syscall::rv::MMAP, {0, 0x2000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0});
+    EXPECT_EQ(static_cast<addr_t>(map), SyscallState::MMAP_TOP - 0x2000);
+    cpu->store<word_t>(map, 1);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::MUNMAP, {map, 0x2000}), 0);
+    EXPECT_FALSE(cpu->mapped(map, sizeof(word_t)));
+    //mapping the pages again gives zero pages
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::MMAP, {map, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0}), map);
+    EXPECT_EQ(cpu->load<word_t>(map), 0);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::MMAP, {0, 0x1000, PROT_READ, MAP_PRIVATE, 3, 0}), -ENODEV);
+
+    //the heap and the mappings never overlap
+    cpu->sys.mmap_top = 0x14000;
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::BRK, {0x14001}), 0x13000);
+    cpu->sys.brk = 0x15000;
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::MMAP, {0, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0}), -ENOMEM);
+}
+
+TEST_F(RV32I_Test, TEST_SYSCALL_EFAULT)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    const int in = cpu->sys.addFile(fds[0]);
+    const int out = cpu->sys.addFile(fds[1]);
+    const reg_t unmapped = static_cast<reg_t>(0xc0000000);
+    //structures the host fills in itself must be mapped
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::FSTAT, {in, unmapped}), -EFAULT);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::FSTAT, {in, static_cast<reg_t>(0xffffffc0)}), -EFAULT);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOCK_GETTIME64, {CLOCK_MONOTONIC, static_cast<reg_t>(0xfffffffc)}), -EFAULT);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITEV, {out, unmapped, 1}), -EFAULT);
+    //buffers the host call gets fault there
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::WRITE, {out, unmapped, 4}), -EFAULT);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(RV32I_Test, TEST_SYSCALL_FSTAT_EXIT)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::FSTAT, {cpu->sys.addFile(fds[0]), 0x4000}), 0);
+    //st_mode follows two 64-bit fields
+    EXPECT_TRUE(S_ISFIFO(cpu->load<word_t>(0x4010)));
+    close(fds[0]);
+    close(fds[1]);
+
+    EXPECT_EQ(ecall(*cpu, Syscall::rv::CLOCK_GETTIME64, {CLOCK_MONOTONIC, 0x5000}), 0);
+    EXPECT_EQ(ecall(*cpu, static_cast<Syscall::rv>(1000), {}), -ENOSYS);
+    ecall(*cpu, Syscall::rv::EXIT_GROUP, {3});
+    EXPECT_TRUE(cpu->isdone());
+    EXPECT_EQ(cpu->sys.exit_code, 3);
+}
+
+TEST_F(RV32I_Test, TEST_MEMORY_PAGE_ALIGNMENT)
+{
+    const addr_t addr = 0x40000000;
+    ASSERT_TRUE(mem->commit(addr, 0x3000));
+    EXPECT_FALSE(mem->release(addr + 0x10, 0x1000));
+    EXPECT_FALSE(mem->discard(addr + 0x10, 0x1000));
+    EXPECT_FALSE(mem->mapFile(addr + 0x10, -1, 0, 0x1000));
+    EXPECT_TRUE(mem->mapped(addr, 0x3000));
+    //len is rounded up to whole pages
+    EXPECT_TRUE(mem->release(addr, 0x1001));
+    EXPECT_FALSE(mem->mapped(addr + 0x1000, 1));
+    EXPECT_TRUE(mem->mapped(addr + 0x2000, 0x1000));
+}
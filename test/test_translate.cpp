@@ -1,5 +1,16 @@
 #include "test.hpp"
 #include "io.hpp"
+#include "perf.hpp"
+#include "profiler.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
 
 //TESTS STORE AND LOAD
 TEST_F(RV32I_Test_Translate, Test_1)
@@ -73,3 +84,732 @@ TEST_F(RV32I_Test_Translate, Test_fibonacci_5)
     EXPECT_EQ(cpu->getReg(15), 5);
 }
 
+
+//TESTS BLOCK CHAINING
+TEST_F(RV32I_Test_Translate, Test_chaining)
+{
+    // loop body is translated on its second run
+    cpu->tier_policy.jit_threshold = 1;
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 100), addi(5, 5, 1), bne(5, 6, -4), ebreak};
+    write_program(program);
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 100);
+    BlockDescriptor *loop = cpu->bb_table.find(8);
+    ASSERT_NE(loop, nullptr);
+    ASSERT_EQ(loop->chained.size(), 1u);
+    BlockLink *self_link = loop->chained.front();
+    EXPECT_EQ(self_link->target, 8u);
+    EXPECT_EQ(self_link->next, loop);
+
+    invalidateBlock(*cpu, 8);
+    EXPECT_EQ(self_link->next, nullptr);
+    EXPECT_EQ(cpu->bb_table.find(8), nullptr);
+}
+
+//TESTS INLINE LOADS AND STORES
+TEST_F(RV32I_Test_Translate, Test_inline_memory)
+{
+    using I::Load::funct3;
+    cpu->tier_policy.jit_threshold = 1;
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 3), addi(7, 0, -1), addi(8, 0, 0x400),
+        addi(5, 5, 1),
+        stype(static_cast<uint8_t>(S::Store::funct3::SH), 8, 7, 0),
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LBU), 9, 8, 0),
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LHU), 10, 8, 0),
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LB), 11, 8, 1),
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LW), 12, 8, 0)};
+    program.push_back(bne(5, 6, -4 * static_cast<imm_t>(program.size() - 4)));
+    program.push_back(ebreak);
+    write_program(program);
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    ASSERT_NE(cpu->bb_table.find(16), nullptr);
+    EXPECT_NE(cpu->bb_table.find(16)->native, nullptr);
+    EXPECT_EQ(cpu->getReg(9), 0xff);
+    EXPECT_EQ(cpu->getReg(10), 0xffff);
+    EXPECT_EQ(cpu->getReg(11), -1);
+    EXPECT_EQ(cpu->getReg(12) & 0xffff, 0xffff);
+}
+
+//TESTS ACCESS FAULTS
+TEST_F(RV32I_Test_Translate, Test_access_fault)
+{
+    cpu->tier_policy.mode = TierMode::InterpOnly;
+    // loads from the first page past the test memory
+    write_program({static_cast<instr_t>(TEST_MEM_SIZE) | (8 << 7) | static_cast<instr_t>(Opcode::Lui),
+        itype(Opcode::Load, static_cast<uint8_t>(I::Load::funct3::LW), 9, 8, 0), ebreak});
+
+    EXPECT_EQ(run_simulation(*cpu), 1);
+    EXPECT_TRUE(cpu->isdone());
+}
+
+TEST_F(RV32I_Test_Translate, Test_access_fault_translated)
+{
+    cpu->tier_policy.jit_threshold = 1;
+    // stores a word per page until it runs off the test memory
+    write_program({addi(8, 0, 0), (1 << 12) | (6 << 7) | static_cast<instr_t>(Opcode::Lui),
+        stype(static_cast<uint8_t>(S::Store::funct3::SW), 8, 6, 0), rtype(0, 0, 8, 8, 6), bne(8, 0, -8), ebreak});
+
+    EXPECT_EQ(run_simulation(*cpu), 1);
+    EXPECT_TRUE(cpu->isdone());
+    EXPECT_EQ(cpu->load<word_t>(TEST_MEM_SIZE - 0x1000), 0x1000);
+}
+
+//TESTS TIERED EXECUTION
+TEST_F(RV32I_Test_Translate, Test_interp_only)
+{
+    cpu->tier_policy.mode = TierMode::InterpOnly;
+    write_program({addi(5, 0, 0), addi(6, 0, 50), addi(5, 5, 1), bne(5, 6, -4), ebreak});
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 50);
+    ASSERT_NE(cpu->bb_table.find(8), nullptr);
+    EXPECT_EQ(cpu->bb_table.find(8)->native, nullptr);
+    EXPECT_EQ(cpu->bb_table.find(8)->exec_count, 49u);
+}
+
+TEST_F(RV32I_Test_Translate, Test_tier_promotion)
+{
+    cpu->tier_policy.jit_threshold = 4;
+    cpu->tier_policy.opt_threshold = 20;
+    // x0 writes and sources are folded away by the optimized tier
+    write_program({addi(5, 0, 0), addi(6, 0, 100), addi(5, 5, 1), addi(0, 5, 3), addi(7, 0, 9), bne(5, 6, -12), ebreak});
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(0), 0);
+    EXPECT_EQ(cpu->getReg(5), 100);
+    EXPECT_EQ(cpu->getReg(7), 9);
+    BlockDescriptor *loop = cpu->bb_table.find(8);
+    ASSERT_NE(loop, nullptr);
+    EXPECT_EQ(loop->tier, JitTier::Optimized);
+}
+
+TEST_F(RV32I_Test_Translate, Test_wanted_tier)
+{
+    write_program({addi(5, 0, 1), ebreak});
+    BlockDescriptor &block = lookup(*cpu, 0);
+    TierPolicy policy {TierMode::Tiered, 2, 8};
+
+    EXPECT_EQ(wantedTier(policy, block), JitTier::None);
+    block.exec_count = 2;
+    EXPECT_EQ(wantedTier(policy, block), JitTier::Baseline);
+    block.exec_count = 8;
+    EXPECT_EQ(wantedTier(policy, block), JitTier::Optimized);
+
+    policy.mode = TierMode::InterpOnly;
+    EXPECT_EQ(wantedTier(policy, block), JitTier::None);
+    policy.mode = TierMode::JitOnly;
+    block.exec_count = 0;
+    EXPECT_EQ(wantedTier(policy, block), JitTier::Baseline);
+}
+
+TEST_F(RV32I_Test_Translate, Test_illegal_in_translated_block)
+{
+    //mul x6, x6, x10 is not RV32I and must not run as add
+    for(TierMode mode : {TierMode::InterpOnly, TierMode::JitOnly})
+    {
+        Memory other_mem {};
+        other_mem.commit(0, TEST_MEM_SIZE);
+        Cpu other(&other_mem);
+        other.tier_policy.mode = mode;
+        std::vector<instr_t> program = {addi(6, 0, 3), addi(10, 0, 5), 0x02a30333, addi(7, 0, 1), ebreak};
+        for(std::size_t i = 0; i < program.size(); ++i)
+        {
+            other.store<word_t>(i * sizeof(instr_t), program[i]);
+        }
+        ASSERT_EQ(run_simulation(other), 0);
+
+        EXPECT_TRUE(other.isdone());
+        EXPECT_EQ(other.getPc(), 8u);
+        EXPECT_EQ(other.getReg(6), 3);
+        EXPECT_EQ(other.getReg(7), 0);
+    }
+
+    //a branch with a reserved funct3 leaves through a dynamic exit, a cached
+    //unit ending in one has no exit slots
+    std::vector<addr_t> exits {};
+    EXPECT_TRUE(unitExits({static_cast<uint32_t>(JitTier::Baseline), 0, 0, 2, addi(5, 0, 1), 0x00002063}, exits));
+    EXPECT_TRUE(exits.empty());
+}
+
+//TESTS TRACE FORMATION
+static std::vector<instr_t> traceProgram()
+{
+    using T = RV32I_Test_Translate;
+    return {T::addi(5, 0, 0), T::addi(6, 0, 100),
+        T::addi(5, 5, 1), T::btype(B::Branch::funct3::BEQ, 5, 0, 12),   // 8: never taken
+        T::addi(7, 7, 1), T::jal(0, 8),                                 // 16
+        T::addi(8, 8, 1),                                               // 24: skipped
+        T::bne(5, 6, -20),                                              // 28: back to 8
+        T::ebreak};
+}
+
+TEST_F(RV32I_Test_Translate, Test_form_trace)
+{
+    cpu->tier_policy.mode = TierMode::InterpOnly;
+    write_program(traceProgram());
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    HotTrace trace = formTrace(*cpu, *cpu->bb_table.find(8));
+    ASSERT_EQ(trace.blocks.size(), 3u);
+    EXPECT_EQ(trace.blocks[0]->pc, 8u);
+    EXPECT_EQ(trace.blocks[1]->pc, 16u);
+    EXPECT_EQ(trace.blocks[2]->pc, 28u);
+    EXPECT_TRUE(trace.loops);
+}
+
+TEST_F(RV32I_Test_Translate, Test_trace_execution)
+{
+    cpu->tier_policy.jit_threshold = 2;
+    cpu->tier_policy.opt_threshold = 10;
+    write_program(traceProgram());
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 100);
+    EXPECT_EQ(cpu->getReg(7), 100);
+    EXPECT_EQ(cpu->getReg(8), 0);
+    //the loop latch gets hot first and heads a trace through 8 and 16
+    ASSERT_NE(cpu->bb_table.find(28), nullptr);
+    EXPECT_EQ(cpu->bb_table.find(28)->tier, JitTier::Optimized);
+    EXPECT_EQ(cpu->bb_table.find(16)->traces, std::vector<addr_t>{28});
+
+    //dropping a block inside the trace drops the trace
+    invalidateBlock(*cpu, 16);
+    EXPECT_EQ(cpu->bb_table.find(28), nullptr);
+}
+
+TEST_F(RV32I_Test_Translate, Test_trace_exit_profile)
+{
+    cpu->tier_policy.jit_threshold = 2;
+    cpu->tier_policy.opt_threshold = 5;
+    write_program({addi(6, 0, 20), addi(7, 0, 10),
+        addi(9, 9, 1), addi(5, 0, 0), bne(9, 0, 8),     // 8: always taken
+        addi(8, 8, 1),                                  // 20: cold
+        addi(5, 5, 1), bne(5, 7, -4),                   // 24: inner loop
+        bne(9, 6, -24),                                 // 32: back to 8
+        ebreak});
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(9), 20);
+    //the trace through 8 and 24 leaves through the branch of 24, which must
+    //not count as taken branches of 8
+    BlockDescriptor *head = cpu->bb_table.find(8);
+    ASSERT_NE(head, nullptr);
+    EXPECT_EQ(head->tier, JitTier::Optimized);
+    EXPECT_LT(head->taken_count, head->exec_count);
+}
+
+//TESTS GUEST REGISTERS HELD IN HOST REGISTERS
+TEST_F(RV32I_Test_Translate, Test_register_cache)
+{
+    using R::Op::funct3;
+    cpu->tier_policy.mode = TierMode::JitOnly;
+    cpu->tier_policy.opt_threshold = 5;
+    // x8 = x6 - x8 has rd == rs2, x9 is only written inside the loop
+    write_program({addi(5, 0, 0), addi(6, 0, 10), addi(8, 0, 3),
+        addi(5, 5, 1),
+        rtype(static_cast<uint8_t>(funct3::ADD), 0x20, 8, 6, 8),
+        rtype(static_cast<uint8_t>(funct3::SLL), 0, 9, 5, 5),
+        bne(5, 6, -12),
+        ebreak});
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 10);
+    EXPECT_EQ(cpu->getReg(8), 3);
+    EXPECT_EQ(cpu->getReg(9), 10 << 10);
+    EXPECT_EQ(cpu->bb_table.find(12)->tier, JitTier::Optimized);
+}
+
+//TESTS ELF LOADING
+TEST_F(RV32I_Test_Translate, Test_load_segments)
+{
+    using I::Load::funct3;
+    // text at 0x10000, data at 0x20010 followed by bss; the file bytes after
+    // .data must not show through the bss
+    std::vector<instr_t> text = {0x000202b7,                                                //lui x5, 0x20
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LW), 6, 5, 0x10),
+        itype(Opcode::Load, static_cast<uint8_t>(funct3::LW), 7, 5, 0x100),
+        ebreak};
+    std::vector<char> file(0x2200, 0x5a);
+
+    Elf32_Ehdr ehdr {};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_RISCV;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = 0x10000;
+    ehdr.e_phoff = sizeof(Elf32_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf32_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf32_Phdr);
+    ehdr.e_phnum = 2;
+    Elf32_Phdr phdrs[2] = {
+        {PT_LOAD, 0x1000, 0x10000, 0x10000, static_cast<Elf32_Word>(text.size() * 4), static_cast<Elf32_Word>(text.size() * 4), PF_R | PF_X, 0x1000},
+        {PT_LOAD, 0x2010, 0x20010, 0x20010, 8, 0x1000, PF_R | PF_W, 0x1000}};
+    const word_t data[2] = {0x11223344, 0x55667788};
+    std::memcpy(file.data(), &ehdr, sizeof(ehdr));
+    std::memcpy(file.data() + ehdr.e_phoff, phdrs, sizeof(phdrs));
+    std::memcpy(file.data() + 0x1000, text.data(), text.size() * 4);
+    std::memcpy(file.data() + 0x2010, data, sizeof(data));
+
+    std::string filename = ::testing::TempDir() + "rv32i_load_segments";
+    std::ofstream(filename, std::ios::binary).write(file.data(), file.size());
+
+    ASSERT_EQ(elfio_manager(filename.c_str(), *cpu), 0);
+    EXPECT_EQ(cpu->getPc(), 0x10000u);
+    EXPECT_EQ(cpu->load<word_t>(0x20014), 0x55667788u);
+    EXPECT_EQ(cpu->load<word_t>(0x20018), 0u);
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+    EXPECT_EQ(cpu->getReg(6), 0x11223344);
+    EXPECT_EQ(cpu->getReg(7), 0);
+    std::remove(filename.c_str());
+}
+
+//TESTS SHARED CODE CACHE
+TEST_F(RV32I_Test_Translate, Test_code_cache_shared)
+{
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 20), addi(5, 5, 1), bne(5, 6, -4), ebreak};
+    cpu->tier_policy.jit_threshold = 1;
+    write_program(program);
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    Memory other_mem {};
+    other_mem.commit(0, TEST_MEM_SIZE);
+    Cpu other(&other_mem);
+    other.tier_policy.jit_threshold = 1;
+    for(std::size_t i = 0; i < program.size(); ++i)
+    {
+        other.store<word_t>(i * sizeof(instr_t), program[i]);
+    }
+    uint64_t hits = CodeCache::shared().hits;
+    ASSERT_EQ(run_simulation(other), 0);
+
+    EXPECT_EQ(other.getReg(5), 20);
+    EXPECT_GT(CodeCache::shared().hits, hits);
+    ASSERT_NE(other.bb_table.find(8), nullptr);
+    EXPECT_EQ(other.bb_table.find(8)->native, cpu->bb_table.find(8)->native);
+    //exit slots stay per Cpu
+    EXPECT_NE(other.bb_table.find(8)->links, cpu->bb_table.find(8)->links);
+}
+
+TEST_F(RV32I_Test_Translate, Test_code_cache_persistent)
+{
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 30), addi(5, 5, 1), bne(5, 6, -4), ebreak};
+    CodeCache cold {};
+    cpu->code_cache = &cold;
+    cpu->tier_policy.jit_threshold = 1;
+    write_program(program);
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    std::string filename = ::testing::TempDir() + "rv32i_code_cache";
+    ASSERT_TRUE(cold.save(filename, 42));
+
+    CodeCache warm {};
+    EXPECT_EQ(warm.load(filename, 43), 0u);
+    ASSERT_EQ(warm.load(filename, 42), cold.size());
+
+    Memory other_mem {};
+    other_mem.commit(0, TEST_MEM_SIZE);
+    Cpu other(&other_mem);
+    other.code_cache = &warm;
+    for(std::size_t i = 0; i < program.size(); ++i)
+    {
+        other.store<word_t>(i * sizeof(instr_t), program[i]);
+    }
+    ASSERT_EQ(run_simulation(other), 0);
+
+    EXPECT_EQ(other.getReg(5), 30);
+    //the loop ran native from its first execution
+    ASSERT_NE(other.bb_table.find(8), nullptr);
+    EXPECT_NE(other.bb_table.find(8)->native, nullptr);
+    EXPECT_EQ(warm.misses, 0u);
+    std::remove(filename.c_str());
+}
+
+TEST_F(RV32I_Test_Translate, Test_code_cache_corrupt)
+{
+    CodeCache cold {};
+    cpu->code_cache = &cold;
+    cpu->tier_policy.jit_threshold = 1;
+    write_program({addi(5, 0, 0), addi(6, 0, 30), addi(5, 5, 1), bne(5, 6, -4), ebreak});
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    std::string filename = ::testing::TempDir() + "rv32i_code_cache_corrupt";
+    ASSERT_TRUE(cold.save(filename, 42));
+    std::ifstream in(filename, std::ios::binary);
+    const std::string good((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+
+    //the first entry starts after the 32 byte header with its key length,
+    //exit count and code size
+    auto load = [&](std::size_t field, uint32_t value)
+    {
+        std::string bad = good;
+        std::memcpy(&bad[32 + field * sizeof(uint32_t)], &value, sizeof(value));
+        std::ofstream(filename, std::ios::binary | std::ios::trunc) << bad;
+        CodeCache warm {};
+        return warm.load(filename, 42);
+    };
+    EXPECT_EQ(load(0, UINT32_MAX), 0u);
+    EXPECT_EQ(load(1, 0x40000000), 0u);
+    EXPECT_EQ(load(2, UINT32_MAX), 0u);
+    //a wrong exit count is caught even where the file has the bytes
+    uint32_t exits = 0;
+    std::memcpy(&exits, &good[32 + sizeof(uint32_t)], sizeof(exits));
+    EXPECT_EQ(load(1, exits + 1), 0u);
+    EXPECT_EQ(load(1, exits), cold.size());
+    std::remove(filename.c_str());
+}
+
+TEST_F(RV32I_Test_Translate, Test_code_cache_persistent_time)
+{
+    using namespace I::System;
+    //the loop block reads time, saved code must not call the host clock directly
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 30), addi(5, 5, 1), csrrs(10, Csr::TIME), bne(5, 6, -8), ebreak};
+    CodeCache cold {};
+    cpu->code_cache = &cold;
+    cpu->tier_policy.jit_threshold = 1;
+    write_program(program);
+    ASSERT_EQ(run_simulation(*cpu), 0);
+    ASSERT_NE(cpu->bb_table.find(8), nullptr);
+    ASSERT_NE(cpu->bb_table.find(8)->native, nullptr);
+
+    std::string filename = ::testing::TempDir() + "rv32i_code_cache_time";
+    ASSERT_TRUE(cold.save(filename, 42));
+    CodeCache warm {};
+    ASSERT_EQ(warm.load(filename, 42), cold.size());
+
+    Memory other_mem {};
+    other_mem.commit(0, TEST_MEM_SIZE);
+    Cpu other(&other_mem);
+    other.code_cache = &warm;
+    other.getState().clock = []() noexcept -> uint64_t {return 0x123456789;};
+    for(std::size_t i = 0; i < program.size(); ++i)
+    {
+        other.store<word_t>(i * sizeof(instr_t), program[i]);
+    }
+    ASSERT_EQ(run_simulation(other), 0);
+
+    EXPECT_EQ(other.getReg(5), 30);
+    EXPECT_EQ(other.getReg(10), 0x23456789);
+    ASSERT_NE(other.bb_table.find(8), nullptr);
+    EXPECT_NE(other.bb_table.find(8)->native, nullptr);
+    EXPECT_EQ(warm.misses, 0u);
+    std::remove(filename.c_str());
+}
+
+TEST_F(RV32I_Test_Translate, Test_background_compile)
+{
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 1000), addi(5, 5, 1), bne(5, 6, -4), ebreak};
+    CodeCache cache {};
+    cpu->code_cache = &cache;
+    cpu->tier_policy.jit_threshold = 1;
+    cpu->tier_policy.compile_threads = 1;
+    write_program(program);
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 1000);
+    EXPECT_GE(CompileQueue::shared().threads(), 1u);
+
+    //the loop may have finished before its code was ready
+    BlockDescriptor *loop = cpu->bb_table.find(8);
+    ASSERT_NE(loop, nullptr);
+    if(std::shared_ptr<CompileJob> job = loop->pending)
+    {
+        while(!job->done.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+        EXPECT_TRUE(finishTranslation(*cpu, *loop));
+        EXPECT_EQ(loop->pending, nullptr);
+    }
+    EXPECT_NE(loop->native, nullptr);
+    EXPECT_EQ(loop->tier, JitTier::Baseline);
+}
+
+TEST_F(RV32I_Test_Translate, Test_translate_ahead)
+{
+    CodeCache cache {};
+    cpu->code_cache = &cache;
+    write_program({addi(5, 0, 0), addi(6, 0, 100),
+        addi(5, 5, 1), bne(5, 6, -4),                   // 8: loop
+        jal(1, 12),                                     // 16: call 28
+        addi(7, 0, 7), ebreak,                          // 20: return address
+        addi(8, 0, 8), itype(Opcode::Jalr, 0, 0, 1, 0), // 28: callee
+        0});                                            // 36: data
+    cpu->image.text = {{0, 40}};
+    cpu->image.entries = {0, 36};
+
+    const std::size_t installed = translateAhead(*cpu, 4);
+    for(addr_t pc : {0u, 8u, 16u, 20u, 28u})
+    {
+        ASSERT_NE(cpu->bb_table.find(pc), nullptr);
+    }
+    //the EBREAK ending 20 leaves to the dispatcher, data is not decoded
+    EXPECT_EQ(cpu->bb_table.find(24), nullptr);
+    EXPECT_EQ(cpu->bb_table.find(36), nullptr);
+
+    //discovery needs no JIT, installing and running the blocks does
+    if(cache.environment().arch() != asmjit::Arch::kX64)
+    {
+        GTEST_SKIP() << "translated code needs an x86-64 host, only discovery was checked";
+    }
+    EXPECT_EQ(installed, 5u);
+    for(addr_t pc : {0u, 8u, 16u, 20u, 28u})
+    {
+        EXPECT_EQ(cpu->bb_table.find(pc)->tier, JitTier::Baseline);
+    }
+    EXPECT_EQ(cpu->stats.blocks_compiled, 5u);
+    EXPECT_EQ(cpu->stats.aot_blocks, 5u);
+
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    EXPECT_EQ(cpu->getReg(5), 100);
+    EXPECT_EQ(cpu->getReg(7), 7);
+    EXPECT_EQ(cpu->getReg(8), 8);
+    EXPECT_EQ(cpu->stats.blocks_compiled, 5u);
+    EXPECT_EQ(cpu->stats.interp_instrs, 1u);
+}
+
+TEST_F(RV32I_Test_Translate, Test_stats)
+{
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 100), addi(5, 5, 1), bne(5, 6, -4), ebreak};
+    CodeCache cache {};
+    cpu->code_cache = &cache;
+    cpu->tier_policy.jit_threshold = 10;
+    write_program(program);
+    ASSERT_EQ(run_simulation(*cpu), 0);
+
+    const JitStats &stats = cpu->stats;
+    EXPECT_EQ(stats.blocks_decoded, 3u);
+    EXPECT_EQ(stats.blocks_compiled, 1u);
+    EXPECT_EQ(stats.blocks_adopted, 0u);
+    EXPECT_GT(stats.code_bytes, 0u);
+    EXPECT_GE(stats.max_compile_ns * stats.blocks_compiled, stats.compile_ns);
+    EXPECT_LE(stats.lookup_hits, stats.lookups);
+    EXPECT_GT(stats.interp_instrs, 0u);
+    EXPECT_GT(stats.native_instrs, 0u);
+    EXPECT_EQ(stats.interp_instrs + stats.native_instrs, cpu->getState().instret);
+
+    std::ostringstream os;
+    write_stats(os, stats);
+    EXPECT_NE(os.str().find("\"blocks_compiled\": 1"), std::string::npos);
+}
+
+TEST_F(RV32I_Test_Translate, Test_perf_names)
+{
+    GuestSymbols symbols {};
+    symbols.add(0x200, "loop");
+    symbols.add(0x100, "main");
+    symbols.sort();
+
+    addr_t offset = 0;
+    EXPECT_EQ(symbols.nearest(0x80, offset), nullptr);
+    ASSERT_NE(symbols.nearest(0x1fc, offset), nullptr);
+    EXPECT_EQ(*symbols.nearest(0x1fc, offset), "main");
+    EXPECT_EQ(offset, 0xfcu);
+
+    EXPECT_EQ(perfName(&symbols, 0x208, JitTier::Optimized), "guest:loop+0x8@0x00000208/opt");
+    EXPECT_EQ(perfName(&symbols, 0x80, JitTier::Baseline), "guest:0x00000080/base");
+    EXPECT_EQ(perfName(nullptr, 0x100, JitTier::Baseline), "guest:0x00000100/base");
+}
+
+TEST_F(RV32I_Test_Translate, Test_profiler_unwind)
+{
+    //leaf at 0x100 called from mid at 0x200, called from main at 0x300,
+    //neither with a frame pointer
+    cpu->symbols.add(0x100, "leaf");
+    cpu->symbols.add(0x200, "mid");
+    cpu->symbols.add(0x300, "main");
+    cpu->symbols.sort();
+    cpu->setPc(0x104);
+    CpuState &state = cpu->getState();
+    pushCall(state, 0x310);
+    pushCall(state, 0x20c);
+
+    Profiler profiler(Profiler::Clock::Instret, 100);
+    ASSERT_TRUE(profiler.start(*cpu));
+    profiler.sample(*cpu);
+    EXPECT_EQ(cpu->getState().sample_at.load(), cpu->getState().instret + 100);
+
+    //calls past the recorded depth only count, their returns find the
+    //recorded callers again
+    for(uint32_t i = 0; i < 2 * CpuState::CallDepth; ++i)
+    {
+        pushCall(state, 0x1000);
+    }
+    for(uint32_t i = 0; i < 2 * CpuState::CallDepth; ++i)
+    {
+        popCall(state);
+    }
+    profiler.sample(*cpu);
+    popCall(state);
+    popCall(state);
+    popCall(state);
+    EXPECT_EQ(state.call_depth, 0u);
+    profiler.stop();
+    EXPECT_EQ(cpu->getState().sample_at.load(), UINT64_MAX);
+
+    std::ostringstream os;
+    profiler.writeFolded(os, cpu->symbols);
+    EXPECT_EQ(os.str(), "main;mid;leaf 2\n");
+}
+
+TEST_F(RV32I_Test_Translate, Test_profiler_sampling)
+{
+    //main calls mid, which keeps ra in s1 and calls leaf, which loops and
+    //returns through ra. No frame pointers.
+    std::vector<instr_t> program = {jal(1, 12), ebreak, addi(0, 0, 0),
+                                    addi(9, 1, 0), jal(1, 12), addi(1, 9, 0), itype(Opcode::Jalr, 0, 0, 1, 0),
+                                    addi(6, 0, 1000), addi(5, 5, 1), bne(5, 6, -4), itype(Opcode::Jalr, 0, 0, 1, 0)};
+    cpu->symbols.add(0, "main");
+    cpu->symbols.add(12, "mid");
+    cpu->symbols.add(28, "leaf");
+    cpu->symbols.sort();
+
+    for(TierMode mode : {TierMode::InterpOnly, TierMode::JitOnly})
+    {
+        Memory other_mem {};
+        other_mem.commit(0, TEST_MEM_SIZE);
+        Cpu other(&other_mem);
+        other.symbols = cpu->symbols;
+        other.tier_policy.mode = mode;
+        other.tier_policy.opt_threshold = 5;
+        for(std::size_t i = 0; i < program.size(); ++i)
+        {
+            other.store<word_t>(i * sizeof(instr_t), program[i]);
+        }
+
+        Profiler profiler(Profiler::Clock::Instret, 100);
+        ASSERT_TRUE(profiler.start(other));
+        ASSERT_EQ(run_simulation(other), 0);
+        profiler.stop();
+
+        EXPECT_EQ(other.getReg(5), 1000);
+        EXPECT_EQ(other.getState().call_depth, 0u);
+        //translated loops leave for samples at their back-edge
+        EXPECT_GE(profiler.samples(), other.getState().instret / 200);
+        std::ostringstream os;
+        profiler.writeFolded(os, other.symbols);
+        EXPECT_NE(os.str().find("main;mid;leaf "), std::string::npos);
+        EXPECT_EQ(os.str().find("main;leaf "), std::string::npos);
+    }
+}
+
+TEST_F(RV32I_Test_Translate, Test_shadow_stack_unprofiled)
+{
+    //main calls a callee that stops the guest, so one call stays open
+    std::vector<instr_t> program = {jal(1, 8), addi(0, 0, 0), ebreak};
+    for(TierMode mode : {TierMode::InterpOnly, TierMode::JitOnly})
+    {
+        Memory other_mem {};
+        other_mem.commit(0, TEST_MEM_SIZE);
+        Cpu other(&other_mem);
+        other.tier_policy.mode = mode;
+        for(std::size_t i = 0; i < program.size(); ++i)
+        {
+            other.store<word_t>(i * sizeof(instr_t), program[i]);
+        }
+        ASSERT_EQ(run_simulation(other), 0);
+        //without a profiler neither engine touches the shadow stack
+        EXPECT_EQ(other.getState().call_depth, 0u);
+    }
+}
+
+TEST_F(RV32I_Test_Translate, Test_counter_csrs)
+{
+    using namespace I::System;
+    //reads instret and makes a syscall on every iteration, both at the end of
+    //a block that is compiled
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 100), addi(17, 0, 1000), addi(5, 5, 1), csrrs(11, Csr::INSTRET),
+                                    addi(7, 7, 1), ecall, bne(5, 6, -16), csrrs(12, Csr::INSTRETH), ebreak};
+
+    for(TierMode mode : {TierMode::InterpOnly, TierMode::JitOnly, TierMode::Tiered})
+    {
+        Memory other_mem {};
+        other_mem.commit(0, TEST_MEM_SIZE);
+        Cpu other(&other_mem);
+        other.tier_policy = {mode, 1, 8};
+        for(std::size_t i = 0; i < program.size(); ++i)
+        {
+            other.store<word_t>(i * sizeof(instr_t), program[i]);
+        }
+        ASSERT_EQ(run_simulation(other), 0);
+
+        EXPECT_EQ(other.getReg(5), 100);
+        //4 instructions before the first read, 5 more per iteration
+        EXPECT_EQ(other.getReg(11), 499);
+        EXPECT_EQ(other.getReg(12), 0);
+        EXPECT_EQ(other.getState().instret, 505u);
+    }
+}
+
+#ifdef RV32I_TRACING
+TEST_F(RV32I_Test_Translate, Test_trace_events)
+{
+    //stores and reloads the counter on every iteration
+    std::vector<instr_t> program = {addi(5, 0, 0), addi(6, 0, 3), stype(0b010, 0, 5, 256), itype(Opcode::Load, 0b010, 7, 0, 256),
+                                    addi(5, 5, 1), bne(5, 6, -12), ebreak};
+    std::string filename = ::testing::TempDir() + "rv32i_trace";
+
+    //translated code has to record the same events as the interpreter
+    std::vector<std::string> decoded {};
+    for(TierMode mode : {TierMode::InterpOnly, TierMode::JitOnly})
+    {
+        Memory other_mem {};
+        other_mem.commit(0, TEST_MEM_SIZE);
+        Cpu other(&other_mem);
+        CodeCache cache {};
+        other.code_cache = &cache;
+        other.tier_policy.mode = mode;
+        other.tier_policy.opt_threshold = 2;
+
+        TraceWriter writer {};
+        ASSERT_TRUE(writer.open(filename.c_str()));
+        other.trace_ring = writer.newRing();
+        for(std::size_t i = 0; i < program.size(); ++i)
+        {
+            other.store<word_t>(i * sizeof(instr_t), program[i]);
+        }
+        ASSERT_EQ(run_simulation(other), 0);
+        writer.close();
+
+        std::ifstream in(filename, std::ios::binary);
+        std::ostringstream os;
+        ASSERT_TRUE(decodeTrace(in, os));
+        decoded.push_back(os.str());
+    }
+
+    const std::string &text = decoded[0];
+    EXPECT_NE(text.find("0 0x00000000 block\n0 0x00000000 x5 = 0x00000000\n"), std::string::npos);
+    EXPECT_NE(text.find("0 0x00000008 write32 [0x00000100] = 0x00000002\n"), std::string::npos);
+    EXPECT_NE(text.find("0 0x0000000c read32 [0x00000100] = 0x00000002\n0 0x0000000c x7 = 0x00000002\n"), std::string::npos);
+    EXPECT_NE(text.find("0 0x00000018 block\n"), std::string::npos);
+    EXPECT_EQ(decoded[1], decoded[0]);
+    std::remove(filename.c_str());
+}
+#endif
+
+TEST_F(RV32I_Test_Translate, Test_trace_decode_corrupt)
+{
+    //a chunk claiming more events than a ring holds
+    const uint32_t chunk[2] = {0, static_cast<uint32_t>(TraceRing::CAPACITY + 1)};
+    std::string file(TraceWriter::MAGIC, sizeof(TraceWriter::MAGIC));
+    file.append(reinterpret_cast<const char *>(chunk), sizeof(chunk));
+    file.append((TraceRing::CAPACITY + 1) * sizeof(TraceEvent), '\0');
+    std::istringstream in(file);
+    std::ostringstream os;
+    EXPECT_FALSE(decodeTrace(in, os));
+}